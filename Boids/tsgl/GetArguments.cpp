@@ -4,7 +4,15 @@
 #include <getopt.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include "GetArguments.hpp"
+#include "backends.hpp"
+#include "numa.hpp"
+#include "trajectory.hpp"
+
+/* Values of -simd and -precision, in the order of boids::Simd and boids::Precision */
+static const char *simdNames[] = {"off", "auto", "avx2", "avx512"};
+static const char *precisionNames[] = {"float", "double"};
 
 enum argType : int8_t 
 {
@@ -27,9 +35,38 @@ enum argType : int8_t
     wcent,      // Weight for centroid vector
     wvoid,      // Weight for avoidance vector
     wviso,      // Weight for visual avoidance vector
+    wrand,      // Weight for random noise
     dt,         // Time-step increment
     ddt,        // Momentum factor (0 < ddt < 1)
     minv,       // Minimum velocity
+    skin,       // Extra radius of the Verlet lists
+
+    backend,    // Step kernel, one of the backends.hpp registry
+    reorder,    // Steps between sorting the boid arrays by grid cell
+    balance,    // Split the grid and verlet loops by per-boid work
+    simd,       // Vector instructions for brute force: off, auto, avx2, avx512
+    precision,  // Rule arithmetic: float or double
+    numa,       // First-touch the state arrays in parallel
+    pin,        // Thread pinning: none, compact or scatter
+    perf,       // Hardware counters around the profiled phases
+    latency,    // Steps between step latency reports
+    profile,    // Per-step CSV of the phase timers and counters
+    trace,      // Chrome trace of the phases of every thread
+    checkpoint, // Snapshot the state to this file
+    checkpoint_every, // Steps between snapshots
+    restart,    // Resume from a snapshot
+    output,     // Trajectory file
+    output_every,  // Steps between trajectory frames
+    output_frames, // Frames the trajectory writer can have queued
+    output_policy, // When they are all queued: block, drop or decimate
+    output_format, // raw or compact
+    output_key_every, // Frames between keyframes of the compact format
+    replay,     // Draw a compact trajectory instead of simulating
+    replay_from,   // First step to replay
+    lod,        // Boid count from which the canvas draws the density
+    lod_cell,   // Pixels per density cell
+    lod_heading,   // Color the density by heading
+    lod_budget, // Milliseconds per frame for the boids before the density
 
     no_draw,    // whether to draw on canvas or simulate for speed test
     help
@@ -64,9 +101,37 @@ void get_arguments(int argc, char *argv[], boids::Params &p, bool& noDraw)
         {"wcent", required_argument, nullptr, argType::wcent},
         {"wvoid", required_argument, nullptr, argType::wvoid},
         {"wviso", required_argument, nullptr, argType::wviso},
+        {"wrand", required_argument, nullptr, argType::wrand},
         {"dt", required_argument, nullptr, argType::dt},
         {"ddt", required_argument, nullptr, argType::ddt},
         {"minv", required_argument, nullptr, argType::minv},
+        {"skin", required_argument, nullptr, argType::skin},
+        {"backend", required_argument, nullptr, argType::backend},
+        {"reorder", required_argument, nullptr, argType::reorder},
+        {"balance", required_argument, nullptr, argType::balance},
+        {"simd", required_argument, nullptr, argType::simd},
+        {"precision", required_argument, nullptr, argType::precision},
+        {"numa", required_argument, nullptr, argType::numa},
+        {"pin", required_argument, nullptr, argType::pin},
+        {"perf", required_argument, nullptr, argType::perf},
+        {"latency", required_argument, nullptr, argType::latency},
+        {"profile", required_argument, nullptr, argType::profile},
+        {"trace", required_argument, nullptr, argType::trace},
+        {"checkpoint", required_argument, nullptr, argType::checkpoint},
+        {"checkpointEvery", required_argument, nullptr, argType::checkpoint_every},
+        {"restart", required_argument, nullptr, argType::restart},
+        {"output", required_argument, nullptr, argType::output},
+        {"outputEvery", required_argument, nullptr, argType::output_every},
+        {"outputFrames", required_argument, nullptr, argType::output_frames},
+        {"outputPolicy", required_argument, nullptr, argType::output_policy},
+        {"outputFormat", required_argument, nullptr, argType::output_format},
+        {"keyEvery", required_argument, nullptr, argType::output_key_every},
+        {"replay", required_argument, nullptr, argType::replay},
+        {"replayFrom", required_argument, nullptr, argType::replay_from},
+        {"lod", required_argument, nullptr, argType::lod},
+        {"lodCell", required_argument, nullptr, argType::lod_cell},
+        {"lodHeading", required_argument, nullptr, argType::lod_heading},
+        {"lodBudget", required_argument, nullptr, argType::lod_budget},
         {"noDraw", no_argument, nullptr, argType::no_draw},
         {"help", no_argument, nullptr, argType::help},
         {0}};
@@ -132,6 +197,9 @@ void get_arguments(int argc, char *argv[], boids::Params &p, bool& noDraw)
         case argType::wviso:
             p.wviso = atof(optarg);
             break;
+        case argType::wrand:
+            p.wrand = atof(optarg);
+            break;
         case argType::dt:
             p.dt = atof(optarg);
             break;
@@ -141,9 +209,149 @@ void get_arguments(int argc, char *argv[], boids::Params &p, bool& noDraw)
         case argType::minv:
             p.minv = atof(optarg);
             break;
+        case argType::skin:
+            p.skin = atof(optarg);
+            break;
         case argType::seed:
             p.seed = atof(optarg);
             break;
+        case argType::backend:
+            p.backend = boids::backend_find(optarg);
+            if (p.backend < 0)
+            {
+                fprintf(stderr, "Unknown backend '%s'\n", optarg);
+                print_help();
+                exit(1);
+            }
+            break;
+        case argType::reorder:
+            p.reorder = atoi(optarg);
+            break;
+        case argType::balance:
+            p.balance = atoi(optarg);
+            break;
+        case argType::simd:
+            if (strcmp(optarg, "off") == 0)
+                p.simd = boids::SIMD_OFF;
+            else if (strcmp(optarg, "auto") == 0)
+                p.simd = boids::SIMD_AUTO;
+            else if (strcmp(optarg, "avx2") == 0)
+                p.simd = boids::SIMD_AVX2;
+            else if (strcmp(optarg, "avx512") == 0)
+                p.simd = boids::SIMD_AVX512;
+            else
+            {
+                fprintf(stderr, "Unknown simd '%s'\n", optarg);
+                print_help();
+                exit(1);
+            }
+            break;
+        case argType::precision:
+            if (strcmp(optarg, "float") == 0)
+                p.precision = boids::PRECISION_FLOAT;
+            else if (strcmp(optarg, "double") == 0)
+                p.precision = boids::PRECISION_DOUBLE;
+            else
+            {
+                fprintf(stderr, "Unknown precision '%s'\n", optarg);
+                print_help();
+                exit(1);
+            }
+            break;
+        case argType::numa:
+            p.numa = atoi(optarg);
+            break;
+        case argType::pin:
+            if (strcmp(optarg, "none") == 0)
+                p.pin = boids::PIN_NONE;
+            else if (strcmp(optarg, "compact") == 0)
+                p.pin = boids::PIN_COMPACT;
+            else if (strcmp(optarg, "scatter") == 0)
+                p.pin = boids::PIN_SCATTER;
+            else
+            {
+                fprintf(stderr, "Unknown pin '%s'\n", optarg);
+                print_help();
+                exit(1);
+            }
+            break;
+        case argType::perf:
+            p.perf = atoi(optarg);
+            break;
+        case argType::latency:
+            p.latency = atoi(optarg);
+            break;
+        case argType::profile:
+            p.profile = optarg;
+            break;
+        case argType::trace:
+            p.trace = optarg;
+            break;
+        case argType::checkpoint:
+            p.checkpoint = optarg;
+            break;
+        case argType::checkpoint_every:
+            p.checkpointEvery = atoi(optarg);
+            break;
+        case argType::restart:
+            p.restart = optarg;
+            break;
+        case argType::output:
+            p.output = optarg;
+            break;
+        case argType::output_every:
+            p.outputEvery = atoi(optarg);
+            break;
+        case argType::output_frames:
+            p.outputFrames = atoi(optarg);
+            break;
+        case argType::output_policy:
+            if (strcmp(optarg, "block") == 0)
+                p.outputPolicy = boids::OUTPUT_BLOCK;
+            else if (strcmp(optarg, "drop") == 0)
+                p.outputPolicy = boids::OUTPUT_DROP;
+            else if (strcmp(optarg, "decimate") == 0)
+                p.outputPolicy = boids::OUTPUT_DECIMATE;
+            else
+            {
+                fprintf(stderr, "Unknown output policy '%s'\n", optarg);
+                print_help();
+                exit(1);
+            }
+            break;
+        case argType::output_format:
+            if (strcmp(optarg, "raw") == 0)
+                p.outputFormat = boids::OUTPUT_RAW;
+            else if (strcmp(optarg, "compact") == 0)
+                p.outputFormat = boids::OUTPUT_COMPACT;
+            else
+            {
+                fprintf(stderr, "Unknown output format '%s'\n", optarg);
+                print_help();
+                exit(1);
+            }
+            break;
+        case argType::output_key_every:
+            p.outputKeyEvery = atoi(optarg);
+            break;
+        case argType::replay:
+            p.replay = optarg;
+            break;
+        case argType::replay_from:
+            p.replayFrom = atoi(optarg);
+            break;
+        case argType::lod:
+            p.lod = atoi(optarg);
+            break;
+        case argType::lod_cell:
+            p.lodCell = atoi(optarg);
+            break;
+        case argType::lod_heading:
+            p.lodHeading = atoi(optarg);
+            break;
+        case argType::lod_budget:
+            p.lodBudget = atof(optarg);
+            break;
         case argType::no_draw:
             noDraw = true;
             break;
@@ -203,9 +411,42 @@ the manual pages for more details.\
     fprintf(stderr, "-wcent\t\t[float]\tWeight for centroid vector (%.2lf)\n", p.wcent);
     fprintf(stderr, "-wvoid\t\t[float]\tWeight for avoidance vector (%.2lf)\n", p.wvoid);
     fprintf(stderr, "-wviso\t\t[float]\tWeight for visual avoidance vector (%.2lf)\n", p.wviso);
+    fprintf(stderr, "-wrand\t\t[float]\tWeight for random noise (%.2lf)\n", p.wrand);
     fprintf(stderr, "-dt\t\t[float]\tTime-step increment (%.2lf)\n", p.dt);
     fprintf(stderr, "-ddt\t\t[float]\tMomentum factor (0 < ddt < 1) (%.2lf)\n", p.ddt);
     fprintf(stderr, "-minv\t\t[float]\tMinimum velocity (%.2lf)\n", p.minv);
 
+    fprintf(stderr, "\n-backend\t[str]\tStep kernel (%s)\n", boids::backend_get(p.backend)->name);
+    for (int i = 0; i < boids::backend_count(); i++)
+    {
+        fprintf(stderr, "\t\t\t  %-11s%s\n", boids::backend_get(i)->name, boids::backend_get(i)->help);
+    }
+    fprintf(stderr, "-skin\t\t[float]\tExtra radius of the Verlet lists (%.2lf)\n", p.skin);
+    fprintf(stderr, "-reorder\t[int]\tSort boid arrays by grid cell every n steps, grid and verlet (%d)\n", p.reorder);
+    fprintf(stderr, "-balance\t[int]\tSplit grid and verlet by last step's work, 0 or 1 (%d)\n", p.balance);
+    fprintf(stderr, "-simd\t\t[str]\tVector kernel of the simd backend, off, auto, avx2 or avx512 (%s)\n", simdNames[p.simd]);
+    fprintf(stderr, "-precision\t[str]\tRule arithmetic of tiled, grid and verlet, float or double (%s)\n", precisionNames[p.precision]);
+    fprintf(stderr, "-numa\t\t[int]\tFirst-touch state arrays by thread block, 0 or 1 (%d)\n", p.numa);
+    fprintf(stderr, "-pin\t\t[str]\tPin threads to CPUs, none, compact or scatter (none)\n");
+    fprintf(stderr, "-latency\t[int]\tStep latency percentiles every n steps and at exit, 0 for none (%d)\n", p.latency);
+    fprintf(stderr, "-perf\t\t[int]\tCycles, instructions, cache and branch misses per phase, PROFILE builds, 0 or 1 (%d)\n", p.perf);
+    fprintf(stderr, "-profile\t[file]\tPer-step CSV of phase times and counters, PROFILE builds (none)\n");
+    fprintf(stderr, "-trace\t\t[file]\tChrome trace JSON of every thread's phases, PROFILE builds (none)\n");
+    fprintf(stderr, "\n-checkpoint\t[file]\tSnapshot the state here at exit (none)\n");
+    fprintf(stderr, "-checkpointEvery\t[int]\tAlso every n steps, 0 for only at exit (%d)\n", p.checkpointEvery);
+    fprintf(stderr, "-restart\t[file]\tResume from a snapshot; -steps more steps, model options from the file (none)\n");
+    fprintf(stderr, "\n-output\t\t[file]\tStream positions and velocities here from a writer thread (none)\n");
+    fprintf(stderr, "-outputEvery\t[int]\tSteps between frames (%d)\n", p.outputEvery);
+    fprintf(stderr, "-outputFrames\t[int]\tFrames that can wait for the writer (%d)\n", p.outputFrames);
+    fprintf(stderr, "-outputPolicy\t[str]\tWhen none is free, block, drop or decimate (block)\n");
+    fprintf(stderr, "-outputFormat\t[str]\traw floats, or compact: quantized, delta-coded, indexed (raw)\n");
+    fprintf(stderr, "-keyEvery\t[int]\tFrames between keyframes of compact files (%d)\n", p.outputKeyEvery);
+    fprintf(stderr, "-replay\t\t[file]\tDraw a compact trajectory instead of simulating (none)\n");
+    fprintf(stderr, "-replayFrom\t[int]\tStep to start the replay at (%d)\n", p.replayFrom);
+    fprintf(stderr, "\n-lod\t\t[int]\tDraw the density instead of the boids from this many boids, 0 for never (%d)\n", p.lod);
+    fprintf(stderr, "-lodBudget\t[float]\tAlso once the boids take longer than this many ms per frame, 0 for no limit (%.2lf)\n", p.lodBudget);
+    fprintf(stderr, "-lodCell\t[int]\tPixels per side of a density cell (%d)\n", p.lodCell);
+    fprintf(stderr, "-lodHeading\t[int]\tColor the density by mean heading, 0 or 1 (%d)\n", p.lodHeading);
+
     printed = true;
 }
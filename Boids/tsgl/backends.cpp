@@ -0,0 +1,385 @@
+/*
+    The backends of this build, in the order -help lists them.
+
+    The first entry is the default. The OpenMP build compiles every kernel
+    into one binary; the OpenACC builds (MC, GPU) only list the kernels that
+    carry acc pragmas, since nvc++ fixes the offload target at compile time.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <utility>
+#include "misc.h"
+#include "boids.hpp"
+#include "rules.hpp"
+#include "grid.hpp"
+#include "verlet.hpp"
+#include "balance.hpp"
+#include "backends.hpp"
+#include "prof.hpp"
+#if defined(OMP)
+#include "simd.hpp"
+#include "persistent.hpp"
+#include "numa.hpp"
+#endif
+
+
+/**
+ * @brief Report which instantiation of a rules.hpp kernel p selects.
+ */
+static void print_specialization(struct boids::Params p)
+{
+	unsigned rules = boids::active_rules(p);
+
+	fprintf(stderr, "Kernel specialized for rules:%s%s%s%s (%s)\n",
+			(rules & boids::RULE_CENT) ? " centering" : "",
+			(rules & boids::RULE_COPY) ? " copying" : "",
+			(rules & boids::RULE_VOID) ? " avoidance" : "",
+			(rules & boids::RULE_VISO) ? " visual" : "",
+			p.precision == boids::PRECISION_DOUBLE ? "double" : "float");
+}
+
+static void no_init(struct boids::Params &p, boids::Workspace &w)
+{
+}
+
+static void no_finish(struct boids::Params p, boids::Workspace &w)
+{
+}
+
+/* Brute force, the reference loop of boids.cpp. */
+
+static void serial_init(struct boids::Params &p, boids::Workspace &w)
+{
+	p.threads = 1;
+}
+
+static void brute_step(
+	struct boids::Params p, boids::Workspace &w, const int *ids,
+	float *xp, float *yp, float *xv, float *yv,
+	float *xnp, float *ynp, float *xnv, float *ynv)
+{
+	PROF_BEGIN(heading);
+	boids::compute_new_headings(p, ids, xp, yp, xv, yv, xnv, ynv, xnp, ynp);
+	PROF_END(heading, boids::PROF_HEADING);
+}
+
+#if defined(OMP)
+/* Brute force, hand-vectorized. */
+
+static void simd_init(struct boids::Params &p, boids::Workspace &w)
+{
+	// Pick the vector kernel from what this CPU supports
+	p.simd = boids::simd_select(p.simd);
+	fprintf(stderr, "Brute-force kernel: %s\n", boids::simd_name(p.simd));
+}
+
+static void simd_step(
+	struct boids::Params p, boids::Workspace &w, const int *ids,
+	float *xp, float *yp, float *xv, float *yv,
+	float *xnp, float *ynp, float *xnv, float *ynv)
+{
+	// Falls back to compute_new_headings when p.simd is SIMD_OFF
+	PROF_BEGIN(heading);
+	boids::compute_new_headings_simd(p, p.simd, ids, xp, yp, xv, yv, xnv, ynv, xnp, ynp);
+	PROF_END(heading, boids::PROF_HEADING);
+}
+
+/* Brute force, one parallel region for many steps. */
+
+static void persistent_run(
+	struct boids::Params p, boids::Workspace &w, int steps, const int *ids,
+	float **xp, float **yp, float **xv, float **yv,
+	float **xnp, float **ynp, float **xnv, float **ynv)
+{
+	boids::run_persistent(p, steps, ids, xp, yp, xv, yv, xnp, ynp, xnv, ynv);
+}
+
+static void persistent_step(
+	struct boids::Params p, boids::Workspace &w, const int *ids,
+	float *xp, float *yp, float *xv, float *yv,
+	float *xnp, float *ynp, float *xnv, float *ynv)
+{
+	// Swaps only the local copies, so the new state stays in the back buffers
+	boids::run_persistent(p, 1, ids, &xp, &yp, &xv, &yv, &xnp, &ynp, &xnv, &ynv);
+}
+
+/* Brute force, blocked for cache. */
+
+static void tiled_init(struct boids::Params &p, boids::Workspace &w)
+{
+	print_specialization(p);
+}
+
+static void tiled_step(
+	struct boids::Params p, boids::Workspace &w, const int *ids,
+	float *xp, float *yp, float *xv, float *yv,
+	float *xnp, float *ynp, float *xnv, float *ynv)
+{
+	PROF_BEGIN(heading);
+	boids::compute_new_headings_tiled(p, ids, xp, yp, xv, yv, xnv, ynv, xnp, ynp);
+	PROF_END(heading, boids::PROF_HEADING);
+}
+#endif
+
+/* Cost-based partitioning shared by grid and verlet. */
+
+static void balance_init(struct boids::Params &p, boids::Workspace &w)
+{
+	if (!p.balance)
+		return;
+
+	#if defined(OMP)
+	boids::balance_init(p, w.balance);
+	fprintf(stderr, "Balancing %d threads by per-boid work, %d chunks each\n",
+			w.balance.threads, BALANCE_CHUNKS);
+	#else
+	fprintf(stderr, "-balance needs the OpenMP build, ignoring it\n");
+	p.balance = 0;
+	#endif
+}
+
+static boids::Balance *balance_of(struct boids::Params p, boids::Workspace &w)
+{
+	return p.balance ? &w.balance : NULL;
+}
+
+static void balance_finish(struct boids::Params p, boids::Workspace &w)
+{
+	if (!p.balance)
+		return;
+
+	#if defined(OMP)
+	// Chunks the cost estimate misplaced badly enough to be stolen
+	long chunks = w.balance.steps * w.balance.threads * BALANCE_CHUNKS;
+	fprintf(stderr, "Load balancing stole %ld of %ld chunks (%.2f%%)\n",
+			w.balance.steals, chunks,
+			chunks ? 100.0 * w.balance.steals / chunks : 0.0);
+	boids::balance_free(w.balance);
+	#endif
+}
+
+/* Uniform grid. */
+
+static void grid_init(struct boids::Params &p, boids::Workspace &w)
+{
+	boids::grid_init(p, w.grid);
+	#if defined(OMP)
+	// grid_reorder swaps this buffer into the state arrays
+	if (p.numa)
+		boids::first_touch(p, w.grid.ftmp, p.num);
+	#endif
+	fprintf(stderr, "Grid search with %d x %d cells\n", w.grid.ncx, w.grid.ncy);
+	print_specialization(p);
+	balance_init(p, w);
+}
+
+static void grid_step(
+	struct boids::Params p, boids::Workspace &w, const int *ids,
+	float *xp, float *yp, float *xv, float *yv,
+	float *xnp, float *ynp, float *xnv, float *ynv)
+{
+	PROF_BEGIN(search);
+	boids::grid_build(p, w.grid, xp, yp);
+	PROF_END(search, boids::PROF_SEARCH);
+	PROF_COUNT(boids::PROF_REBUILDS, 1);
+
+	PROF_BEGIN(heading);
+	boids::compute_new_headings_grid(p, w.grid, ids, xp, yp, xv, yv, xnv, ynv, xnp, ynp, balance_of(p, w));
+	PROF_END(heading, boids::PROF_HEADING);
+}
+
+static void grid_reorder(
+	struct boids::Params p, boids::Workspace &w,
+	int **ids, float **xp, float **yp, float **xv, float **yv)
+{
+	boids::grid_build(p, w.grid, *xp, *yp);
+	#if defined(OMP)
+	// The costs are per slot; the grid's scratch is free until grid_reorder
+	if (p.balance)
+		boids::balance_reorder(p, w.balance, w.grid.cellBoids, &w.grid.itmp);
+	#endif
+	boids::grid_reorder(p, w.grid, ids, xp, yp, xv, yv);
+}
+
+static long grid_missed(struct boids::Params p, boids::Workspace &w, const float *xp, const float *yp)
+{
+	return boids::grid_missed(p, w.grid, xp, yp);
+}
+
+static void grid_finish(struct boids::Params p, boids::Workspace &w)
+{
+	boids::grid_free(w.grid);
+	balance_finish(p, w);
+}
+
+/* Verlet lists. */
+
+static void verlet_init(struct boids::Params &p, boids::Workspace &w)
+{
+	boids::verlet_init(p, w.verlet);
+	#if defined(OMP)
+	if (p.numa)
+		boids::first_touch(p, w.verlet.grid.ftmp, p.num);
+	#endif
+	fprintf(stderr, "Verlet search with skin %.2f, built with %d x %d cells\n",
+			w.verlet.skin, w.verlet.grid.ncx, w.verlet.grid.ncy);
+	print_specialization(p);
+	balance_init(p, w);
+}
+
+static void verlet_step(
+	struct boids::Params p, boids::Workspace &w, const int *ids,
+	float *xp, float *yp, float *xv, float *yv,
+	float *xnp, float *ynp, float *xnv, float *ynv)
+{
+	PROF_BEGIN(search);
+	boids::verlet_update(p, w.verlet, xp, yp);
+	PROF_END(search, boids::PROF_SEARCH);
+
+	PROF_BEGIN(heading);
+	boids::compute_new_headings_verlet(p, w.verlet, ids, xp, yp, xv, yv, xnv, ynv, xnp, ynp, balance_of(p, w));
+	PROF_END(heading, boids::PROF_HEADING);
+}
+
+static void verlet_reorder(
+	struct boids::Params p, boids::Workspace &w,
+	int **ids, float **xp, float **yp, float **xv, float **yv)
+{
+	// The lists hold slot indices, so they are stale once slots move
+	boids::grid_build(p, w.verlet.grid, *xp, *yp);
+	#if defined(OMP)
+	if (p.balance)
+		boids::balance_reorder(p, w.balance, w.verlet.grid.cellBoids, &w.verlet.grid.itmp);
+	#endif
+	boids::grid_reorder(p, w.verlet.grid, ids, xp, yp, xv, yv);
+	w.verlet.valid = false;
+}
+
+static long verlet_missed(struct boids::Params p, boids::Workspace &w, const float *xp, const float *yp)
+{
+	return boids::verlet_missed(p, w.verlet, xp, yp);
+}
+
+static void verlet_finish(struct boids::Params p, boids::Workspace &w)
+{
+	// How often the lists had to be rebuilt, for tuning -skin
+	fprintf(stderr, "Verlet lists built %d times in %d steps (every %.2f steps)\n",
+			w.verlet.builds, w.verlet.updates,
+			w.verlet.builds ? (double)w.verlet.updates / w.verlet.builds : 0.0);
+	boids::verlet_free(w.verlet);
+	balance_finish(p, w);
+}
+
+static const boids::Backend backends[] = {
+#if defined(OMP)
+	{"simd", "every pair, vector kernel picked by -simd", true, false,
+		simd_init, simd_step, NULL, NULL, NULL, no_finish},
+	{"persistent", "every pair, one thread team kept across steps", true, false,
+		simd_init, persistent_step, persistent_run, NULL, NULL, no_finish},
+	{"serial", "every pair, reference loop on one thread", true, true,
+		serial_init, brute_step, NULL, NULL, NULL, no_finish},
+	{"omp", "every pair, reference loop with OpenMP", true, false,
+		no_init, brute_step, NULL, NULL, NULL, no_finish},
+	{"tiled", "every pair, blocked for cache", true, false,
+		tiled_init, tiled_step, NULL, NULL, NULL, no_finish},
+#else
+	{"acc", "every pair, reference loop with OpenACC", true, false,
+		no_init, brute_step, NULL, NULL, NULL, no_finish},
+#endif
+	{"grid", "uniform grid rebuilt every step", false, false,
+		grid_init, grid_step, NULL, grid_reorder, grid_missed, grid_finish},
+	{"verlet", "neighbor lists rebuilt after -skin / 2 of motion", false, false,
+		verlet_init, verlet_step, NULL, verlet_reorder, verlet_missed, verlet_finish},
+};
+
+/**
+ * @brief Number of backends in this build.
+ */
+int boids::backend_count()
+{
+	return sizeof(backends) / sizeof(backends[0]);
+}
+
+/**
+ * @brief The backend at index, as stored in Params::backend.
+ *
+ * @param index
+ * @return the backend, or NULL if index is out of range
+ */
+const boids::Backend *boids::backend_get(int index)
+{
+	if (index < 0 || index >= backend_count())
+		return NULL;
+	return &backends[index];
+}
+
+/**
+ * @brief Look a backend up by its -backend name.
+ *
+ * @param name
+ * @return its index, or -1 if this build has no such backend
+ */
+int boids::backend_find(const char *name)
+{
+	for (int i = 0; i < backend_count(); i++)
+	{
+		if (strcmp(backends[i].name, name) == 0)
+			return i;
+	}
+	return -1;
+}
+
+/**
+ * @brief Run steps steps of backend b, swapping the buffers after each.
+ *
+ * Sorts the boids by cell every p.reorder steps when b supports it, and
+ * advances p.step. The pointers are updated in place, so afterwards
+ * *xp .. *yv hold the newest state.
+ *
+ * @param b
+ * @param p
+ * @param w
+ * @param steps
+ * @param ids stable id of the boid in each slot, permuted along by reorder
+ * @param xp
+ * @param yp
+ * @param xv
+ * @param yv
+ * @param xnp
+ * @param ynp
+ * @param xnv
+ * @param ynv
+ */
+void boids::backend_advance(
+	const boids::Backend *b, struct boids::Params &p, boids::Workspace &w, int steps,
+	int **ids, float **xp, float **yp, float **xv, float **yv,
+	float **xnp, float **ynp, float **xnv, float **ynv)
+{
+	if (b->run != NULL)
+	{
+		b->run(p, w, steps, *ids, xp, yp, xv, yv, xnp, ynp, xnv, ynv);
+		p.step += steps;
+		PROF_STEP(p, steps);
+		return;
+	}
+
+	for (int s = 0; s < steps; s++)
+	{
+		if (b->reorder != NULL && p.reorder > 0 && p.step % p.reorder == 0)
+		{
+			PROF_BEGIN(reorder);
+			b->reorder(p, w, ids, xp, yp, xv, yv);
+			PROF_END(reorder, boids::PROF_REORDER);
+		}
+
+		b->step(p, w, *ids, *xp, *yp, *xv, *yv, *xnp, *ynp, *xnv, *ynv);
+
+		std::swap(*xp, *xnp);
+		std::swap(*yp, *ynp);
+		std::swap(*xv, *xnv);
+		std::swap(*yv, *ynv);
+		p.step++;
+		PROF_STEP(p, 1);
+	}
+}
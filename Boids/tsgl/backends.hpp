@@ -0,0 +1,75 @@
+/*
+    Registry of the ways a step can be computed, chosen at run time with
+    -backend instead of by rebuilding.
+*/
+#ifndef BACKENDS_HPP
+#define BACKENDS_HPP
+
+#include "boids.hpp"
+#include "grid.hpp"
+#include "verlet.hpp"
+#include "balance.hpp"
+
+namespace boids {
+
+    /**
+     * @brief Acceleration structures a backend keeps between steps.
+     *
+     * Only the members of the selected backend are allocated.
+     */
+    struct Workspace
+    {
+        Grid grid;        // cell list of the grid backend
+        Verlet verlet;    // neighbor lists of the verlet backend
+        Balance balance;  // per-boid work, for grid and verlet with -balance
+    };
+
+    /**
+     * @brief One way of computing a step.
+     *
+     * Every backend has the same entry points, so the driver runs, times and
+     * reports them all the same way. step reads the current state and writes
+     * the new velocities and positions to the back buffers in one fused pass.
+     */
+    struct Backend
+    {
+        const char *name;
+        const char *help;
+        bool allPairs;    // tests every pair each step (for pair-interaction rates)
+        bool oneThread;   // runs on one thread whatever p.threads says
+
+        // Allocate the workspace; may adjust p, e.g. the thread count
+        void (*init)(struct Params &p, Workspace &w);
+
+        void (*step)(struct Params p, Workspace &w, const int *ids,
+                     float *xp, float *yp, float *xv, float *yv,
+                     float *xnp, float *ynp, float *xnv, float *ynv);
+
+        // Run several steps in one call and swap the buffers after each;
+        // NULL to have the driver call step once per step
+        void (*run)(struct Params p, Workspace &w, int steps, const int *ids,
+                    float **xp, float **yp, float **xv, float **yv,
+                    float **xnp, float **ynp, float **xnv, float **ynv);
+
+        // Sort the state arrays by cell and swap them in; NULL if unsupported
+        void (*reorder)(struct Params p, Workspace &w,
+                        int **ids, float **xp, float **yp, float **xv, float **yv);
+
+        // Pairs within the rule radius that the last step did not test, for
+        // validation (positions as that step saw them); NULL if it tests all
+        long (*missed)(struct Params p, Workspace &w, const float *xp, const float *yp);
+
+        // Print any statistics and release the workspace
+        void (*finish)(struct Params p, Workspace &w);
+    };
+
+    int backend_count();
+
+    const Backend *backend_get(int index);
+
+    int backend_find(const char *name);
+
+    void backend_advance(const Backend *b, struct Params &p, Workspace &w, int steps, int **ids, float **xp, float **yp, float **xv, float **yv, float **xnp, float **ynp, float **xnv, float **ynv);
+
+}
+#endif
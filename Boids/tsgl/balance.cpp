@@ -0,0 +1,113 @@
+/*
+    Load balancing of the grid and verlet loops.
+
+    Once a flock has clustered, a boid in the middle of it has hundreds of
+    candidates while a stray one has none, so the equal-count blocks of
+    "omp parallel for" hand some threads many times the work of others.
+    The kernels instead report how many candidates each boid tested; since
+    boids move little per step, that is a good estimate of the next step's
+    cost. balance_partition turns it into a prefix sum and cuts the boids
+    into chunks of equal cost, and balanced_for (balance.hpp) steals chunks
+    to absorb whatever the estimate got wrong.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <algorithm>
+#include "misc.h"
+#include "boids.hpp"
+#include "balance.hpp"
+
+
+/**
+ * @brief Allocate the cost and partition arrays for p.num boids.
+ *
+ * @param p
+ * @param b
+ */
+void boids::balance_init(struct boids::Params p, boids::Balance &b)
+{
+	b.threads = MAX(1, p.threads);
+	b.cost = new int[p.num];
+	b.prefix = new long[p.num + 1];
+	b.bounds = new int[b.threads * BALANCE_CHUNKS + 1];
+	b.counters = new boids::BalanceCounter[b.threads];
+
+	/* Before the first step every boid is assumed to cost the same. */
+	for (int i = 0; i < p.num; i++)
+		b.cost[i] = 1;
+
+	b.steps = 0;
+	b.steals = 0;
+}
+
+/**
+ * @brief Release the memory of a balance made by balance_init.
+ *
+ * @param b
+ */
+void boids::balance_free(boids::Balance &b)
+{
+	delete[] b.cost;
+	delete[] b.prefix;
+	delete[] b.bounds;
+	delete[] b.counters;
+	b.cost = NULL;
+	b.prefix = NULL;
+	b.bounds = NULL;
+	b.counters = NULL;
+}
+
+/**
+ * @brief Move each boid's cost along with it when the slots are reordered.
+ *
+ * The new slot k holds the boid that was in slot order[k]. The gathered
+ * costs go into *tmp, a spare array of p.num ints, which is then traded
+ * for the old cost array.
+ *
+ * @param p
+ * @param b
+ * @param order
+ * @param tmp
+ */
+void boids::balance_reorder(struct boids::Params p, boids::Balance &b, const int *order, int **tmp)
+{
+	int *dst = *tmp;
+
+	#if defined(OMP)
+	#pragma omp parallel for num_threads(p.threads)
+	#endif
+	for (int k = 0; k < p.num; k++)
+		dst[k] = b.cost[order[k]];
+
+	*tmp = b.cost;
+	b.cost = dst;
+}
+
+/**
+ * @brief Cut the boids into chunks of equal cost for the next balanced_for.
+ *
+ * Every boid counts at least 1, for the work of finishing its heading.
+ *
+ * @param p
+ * @param b
+ */
+void boids::balance_partition(struct boids::Params p, boids::Balance &b)
+{
+	int chunks = b.threads * BALANCE_CHUNKS;
+
+	b.prefix[0] = 0;
+	for (int i = 0; i < p.num; i++)
+		b.prefix[i + 1] = b.prefix[i] + b.cost[i] + 1;
+
+	/* Chunk j starts at the first boid whose running cost reaches j / chunks. */
+	for (int j = 0; j < chunks; j++)
+	{
+		long target = b.prefix[p.num] * j / chunks;
+		b.bounds[j] = std::lower_bound(b.prefix, b.prefix + p.num, target) - b.prefix;
+	}
+	b.bounds[chunks] = p.num;
+
+	for (int t = 0; t < b.threads; t++)
+		b.counters[t].next.store(0, std::memory_order_relaxed);
+}
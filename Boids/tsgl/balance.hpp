@@ -0,0 +1,101 @@
+/*
+    Cost-based partitioning of the per-boid loops, with work stealing.
+*/
+#ifndef BALANCE_HPP
+#define BALANCE_HPP
+
+#include <atomic>
+#include <omp.h>
+#include "boids.hpp"
+#include "prof.hpp"
+
+/* Chunks each thread's share is cut into, the unit of stealing. */
+#define BALANCE_CHUNKS 8
+
+namespace boids {
+
+    /* Next chunk of one thread's share, alone on its cache line. */
+    struct alignas(64) BalanceCounter
+    {
+        std::atomic<int> next;
+    };
+
+    /**
+     * @brief Per-boid work of the last step and the partition made from it.
+     *
+     * Thread t owns chunks [t * BALANCE_CHUNKS, (t + 1) * BALANCE_CHUNKS),
+     * which together hold about 1 / threads of the total cost. Chunk j is
+     * the boids bounds[j] .. bounds[j + 1].
+     */
+    struct Balance
+    {
+        int threads;              // shares the boids are split into
+        int *cost;                // work of each boid in the last step
+        long *prefix;             // p.num + 1 running sums of cost
+        int *bounds;              // threads * BALANCE_CHUNKS + 1 boid offsets
+        BalanceCounter *counters; // one per share
+
+        long steps;               // number of balanced loops run
+        long steals;              // chunks run by a thread that did not own them
+    };
+
+    void balance_init(struct Params p, Balance &b);
+
+    void balance_free(Balance &b);
+
+    void balance_partition(struct Params p, Balance &b);
+
+    void balance_reorder(struct Params p, Balance &b, const int *order, int **tmp);
+
+    /**
+     * @brief Run body(which) for every boid, split by the cost of the last step.
+     *
+     * body returns the work it did for that boid (e.g. candidates tested),
+     * which sizes the chunks of the next call. A thread runs the chunks of
+     * its own share first, then steals the remaining chunks of the others,
+     * so a misprediction (or a thread the runtime did not give us) costs at
+     * most a chunk of idle time.
+     *
+     * @param p
+     * @param b
+     * @param body callable int(int which)
+     */
+    template <typename Body>
+    inline void balanced_for(const Params &p, Balance &b, Body body)
+    {
+        balance_partition(p, b);
+
+        #pragma omp parallel num_threads(b.threads)
+        {
+            int t = omp_get_thread_num();
+            long stolen = 0;
+            PROF_TRACE_BEGIN(share);
+
+            for (int v = 0; v < b.threads; v++)
+            {
+                int owner = (t + v) % b.threads;
+                int k;
+
+                while ((k = b.counters[owner].next.fetch_add(1, std::memory_order_relaxed)) < BALANCE_CHUNKS)
+                {
+                    int chunk = owner * BALANCE_CHUNKS + k;
+
+                    for (int which = b.bounds[chunk]; which < b.bounds[chunk + 1]; which++)
+                        b.cost[which] = body(which);
+
+                    if (owner != t)
+                        stolen++;
+                }
+            }
+
+            PROF_TRACE_END(share, "share");
+
+            #pragma omp atomic
+            b.steals += stolen;
+        }
+
+        b.steps++;
+    }
+
+}
+#endif
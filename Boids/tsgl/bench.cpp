@@ -0,0 +1,498 @@
+/*
+    In-process benchmark of the step backends, without TSGL.
+
+    Replaces the shell scripts in testing that launched one binary per trial
+    and scraped a single number from stdout. One process sweeps every
+    combination of boid count, thread count and backend. Each configuration
+    runs some warmup steps, then timed repetitions until the 95% confidence
+    interval of the mean is within -ci of it (or -maxReps is reached), and
+    reports median, p95 and boid updates per second as JSON or TSV, plus
+    pair interactions per second for the backends that test every pair.
+
+    With -scaling strong the boid count stays fixed across -threadList;
+    with -scaling weak it grows with the thread count and the world grows
+    with it, keeping the density (and so the neighbors per boid) constant.
+    Each row then also gets its speedup, parallel efficiency and Karp-Flatt
+    serial fraction against the first thread count of the list, except for
+    backends that always run on one thread: those keep their size and get
+    no metrics.
+
+    Every simulation option of tsglBoids (-width, -wrand, -reorder, ...)
+    applies to all configurations; type -help for the sweep options.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <omp.h>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include "misc.h"
+#include "boids.hpp"
+#include "backends.hpp"
+#include "GetArguments.hpp"
+
+
+/* How -threadList is interpreted. */
+enum Scaling
+{
+    SCALING_NONE,       // independent configurations
+    SCALING_STRONG,     // fixed problem, more threads
+    SCALING_WEAK        // problem and world grow with the threads
+};
+
+/**
+ * @brief What to sweep and how long to measure each configuration.
+ */
+struct BenchOptions
+{
+    std::vector<int> nums;      // boid counts
+    std::vector<int> threads;   // thread counts
+    std::vector<int> backends;  // indices into the backend registry
+    int warmup;                 // untimed steps before the repetitions
+    int repSteps;               // steps per timed repetition
+    int minReps;                // repetitions before checking the interval
+    int maxReps;                // give up on the interval after this many
+    double ci;                  // target half-width of the 95% interval, relative to the mean
+    int scaling;                // one of Scaling
+    bool tsv;                   // TSV instead of JSON
+    const char *out;            // output file, NULL for stdout
+};
+
+/**
+ * @brief Measurements of one configuration.
+ */
+struct BenchResult
+{
+    const char *backend;
+    int num;
+    int width, height;
+    int threads;                // as run, after the backend's init
+    int reps;
+    double mean, median, p95, min, ci; // seconds per step
+    double boidsPerSecond;      // num / median
+    double pairsPerSecond;      // num * (num - 1) / median, NAN unless allPairs
+    bool allPairs;
+
+    // Against the first thread count of the list, NAN without -scaling or
+    // for a backend that always runs on one thread
+    double speedup;             // work per second relative to the first row
+    double efficiency;          // speedup / relative thread count
+    double karpFlatt;           // experimentally determined serial fraction
+};
+
+/**
+ * @brief Parse a comma-separated list of ints, e.g. "512,1024,2048".
+ */
+static std::vector<int> parse_ints(const char *s)
+{
+    std::vector<int> v;
+    char *end;
+
+    while (*s)
+    {
+        v.push_back(strtol(s, &end, 10));
+        if (end == s)
+            break;
+        s = (*end == ',') ? end + 1 : end;
+    }
+    return v;
+}
+
+static void print_bench_help()
+{
+    fprintf(stderr, "\nbenchBoids sweeps backends, boid counts and thread counts.\n\n");
+    fprintf(stderr, "-nums\t\t[list]\tBoid counts, comma separated (512,1024,2048)\n");
+    fprintf(stderr, "-threadList\t[list]\tThread counts, comma separated (1,<max>)\n");
+    fprintf(stderr, "-backends\t[list]\tBackend names, comma separated (all)\n");
+    fprintf(stderr, "-warmup\t\t[int]\tUntimed steps per configuration (5)\n");
+    fprintf(stderr, "-repSteps\t[int]\tSteps per timed repetition (5)\n");
+    fprintf(stderr, "-minReps\t[int]\tRepetitions before checking the interval (5)\n");
+    fprintf(stderr, "-maxReps\t[int]\tMost repetitions per configuration (100)\n");
+    fprintf(stderr, "-ci\t\t[float]\tTarget 95%% interval, fraction of the mean (0.02)\n");
+    fprintf(stderr, "-scaling\t[str]\tnone, strong or weak over -threadList (none)\n");
+    fprintf(stderr, "-format\t\t[str]\tjson or tsv (json)\n");
+    fprintf(stderr, "-out\t\t[file]\tWrite results here instead of stdout\n");
+    fprintf(stderr, "\nAll tsglBoids options below set the other parameters.\n");
+}
+
+/**
+ * @brief Take the sweep options out of argv, leaving the rest for get_arguments.
+ *
+ * @return the new argc
+ */
+static int get_bench_arguments(int argc, char *argv[], BenchOptions &o)
+{
+    int kept = 1;
+
+    for (int i = 1; i < argc; i++)
+    {
+        const char *a = argv[i];
+        const char *v = (i + 1 < argc) ? argv[i + 1] : NULL;
+
+        while (*a == '-')
+            a++;
+
+        if (v != NULL && strcmp(a, "nums") == 0)
+            o.nums = parse_ints(v);
+        else if (v != NULL && strcmp(a, "threadList") == 0)
+            o.threads = parse_ints(v);
+        else if (v != NULL && strcmp(a, "backends") == 0)
+        {
+            std::string list = v;
+            size_t start = 0;
+
+            o.backends.clear();
+            while (start <= list.size())
+            {
+                size_t end = list.find(',', start);
+                std::string name = list.substr(start, end == std::string::npos ? std::string::npos : end - start);
+                int b = boids::backend_find(name.c_str());
+
+                if (b < 0)
+                {
+                    fprintf(stderr, "Unknown backend '%s'\n", name.c_str());
+                    exit(1);
+                }
+                o.backends.push_back(b);
+                if (end == std::string::npos)
+                    break;
+                start = end + 1;
+            }
+        }
+        else if (v != NULL && strcmp(a, "warmup") == 0)
+            o.warmup = atoi(v);
+        else if (v != NULL && strcmp(a, "repSteps") == 0)
+            o.repSteps = MAX(1, atoi(v));
+        else if (v != NULL && strcmp(a, "minReps") == 0)
+            o.minReps = MAX(2, atoi(v));
+        else if (v != NULL && strcmp(a, "maxReps") == 0)
+            o.maxReps = atoi(v);
+        else if (v != NULL && strcmp(a, "ci") == 0)
+            o.ci = atof(v);
+        else if (v != NULL && strcmp(a, "scaling") == 0)
+        {
+            if (strcmp(v, "none") == 0)
+                o.scaling = SCALING_NONE;
+            else if (strcmp(v, "strong") == 0)
+                o.scaling = SCALING_STRONG;
+            else if (strcmp(v, "weak") == 0)
+                o.scaling = SCALING_WEAK;
+            else
+            {
+                fprintf(stderr, "Unknown scaling '%s'\n", v);
+                exit(1);
+            }
+        }
+        else if (v != NULL && strcmp(a, "format") == 0)
+            o.tsv = strcmp(v, "tsv") == 0;
+        else if (v != NULL && strcmp(a, "out") == 0)
+            o.out = v;
+        else
+        {
+            if (strcmp(a, "help") == 0)
+                print_bench_help();
+            argv[kept++] = argv[i];
+            continue;
+        }
+        i++;
+    }
+
+    o.maxReps = MAX(o.maxReps, o.minReps);
+    return kept;
+}
+
+/**
+ * @brief The 97.5% quantile of Student's t with df degrees of freedom, the
+ * factor of a two-sided 95% confidence interval of a mean.
+ *
+ * The repetitions are few, so the normal 1.96 would make the interval far
+ * too narrow (by 40% at 5 repetitions); past 30 degrees it is close enough.
+ */
+static double t_quantile(int df)
+{
+    static const double t975[] = {
+        12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306, 2.262, 2.228,
+        2.201, 2.179, 2.160, 2.145, 2.131, 2.120, 2.110, 2.101, 2.093, 2.086,
+        2.080, 2.074, 2.069, 2.064, 2.060, 2.056, 2.052, 2.048, 2.045, 2.042};
+
+    if (df >= 1 && df <= (int)(sizeof(t975) / sizeof(t975[0])))
+        return t975[df - 1];
+    return 1.96;
+}
+
+/**
+ * @brief Time one configuration.
+ */
+static BenchResult run_config(boids::Params p, const BenchOptions &o, int backendIndex)
+{
+    const boids::Backend *b = boids::backend_get(backendIndex);
+    boids::Workspace w;
+    BenchResult r;
+    std::vector<double> t;
+    float *a[8];
+    int *ids = new int[p.num];
+
+    p.backend = backendIndex;
+    b->init(p, w);
+
+    for (int k = 0; k < 8; k++)
+        a[k] = new float[p.num];
+    for (int i = 0; i < p.num; i++)
+        ids[i] = i;
+    boids::random_boids(p, a[0], a[1], a[2], a[3]);
+
+    boids::backend_advance(b, p, w, o.warmup, &ids, &a[0], &a[1], &a[2], &a[3], &a[4], &a[5], &a[6], &a[7]);
+
+    double sum = 0, sum2 = 0, halfWidth = 0;
+    while ((int)t.size() < o.maxReps)
+    {
+        double t1 = omp_get_wtime();
+        boids::backend_advance(b, p, w, o.repSteps, &ids, &a[0], &a[1], &a[2], &a[3], &a[4], &a[5], &a[6], &a[7]);
+        double dt = (omp_get_wtime() - t1) / o.repSteps;
+
+        t.push_back(dt);
+        sum += dt;
+        sum2 += dt * dt;
+
+        int n = t.size();
+        if (n >= o.minReps)
+        {
+            double mean = sum / n;
+            double var = MAX(0.0, (sum2 - n * mean * mean) / (n - 1));
+            halfWidth = t_quantile(n - 1) * sqrt(var / n);
+            if (halfWidth <= o.ci * mean)
+                break;
+        }
+    }
+
+    std::sort(t.begin(), t.end());
+    r.backend = b->name;
+    r.num = p.num;
+    r.width = p.width;
+    r.height = p.height;
+    r.threads = p.threads;
+    r.reps = t.size();
+    r.mean = sum / t.size();
+    r.median = (t.size() % 2) ? t[t.size() / 2] : (t[t.size() / 2 - 1] + t[t.size() / 2]) / 2;
+    r.p95 = t[(size_t)ceil(0.95 * t.size()) - 1];
+    r.min = t[0];
+    r.ci = halfWidth;
+    r.allPairs = b->allPairs;
+    r.boidsPerSecond = p.num / r.median;
+    // The others test far fewer pairs than that
+    r.pairsPerSecond = r.allPairs ? (double)p.num * (p.num - 1) / r.median : NAN;
+    r.speedup = r.efficiency = r.karpFlatt = NAN;
+
+    b->finish(p, w);
+    for (int k = 0; k < 8; k++)
+        delete[] a[k];
+    delete[] ids;
+
+    return r;
+}
+
+/**
+ * @brief Work of one step: pair tests for all-pairs backends, else boid updates.
+ */
+static double step_work(const BenchResult &r)
+{
+    return r.allPairs ? (double)r.num * (r.num - 1) : (double)r.num;
+}
+
+/**
+ * @brief Fill in the scaling metrics of r against the first row of its sweep.
+ *
+ * Speedup is the ratio of work per second, which is the plain time ratio
+ * for strong scaling and the scaled (Gustafson) speedup for weak scaling.
+ * The Karp-Flatt metric e = (1/S - 1/p) / (1 - 1/p) is the serial fraction
+ * that would explain the measured speedup S on p times the threads; if it
+ * grows with p, the loss is overhead rather than a fixed serial part.
+ *
+ * Both use the thread counts that ran, after the backends' init, not the
+ * ones asked for.
+ *
+ * @param r
+ * @param base first row
+ */
+static void scaling_metrics(BenchResult &r, const BenchResult &base)
+{
+    double ratio = (double)r.threads / base.threads;
+
+    r.speedup = (step_work(r) / r.median) / (step_work(base) / base.median);
+    r.efficiency = r.speedup / ratio;
+    r.karpFlatt = (ratio > 1) ? (1 / r.speedup - 1 / ratio) / (1 - 1 / ratio) : NAN;
+}
+
+/**
+ * @brief A JSON number, or null for NAN (or an infinity).
+ *
+ * Tests the exponent bits, since -Ofast lets the compiler fold isnan(x)
+ * to false.
+ */
+static std::string json_number(double x)
+{
+    char buf[32];
+    uint64_t bits;
+
+    memcpy(&bits, &x, sizeof(bits));
+    if ((bits & 0x7ff0000000000000ull) == 0x7ff0000000000000ull)
+        return "null";
+    snprintf(buf, sizeof(buf), "%.6g", x);
+    return buf;
+}
+
+/**
+ * @brief The CPU model from /proc/cpuinfo, or "unknown".
+ */
+static std::string cpu_model()
+{
+    char line[512];
+    std::string model = "unknown";
+    FILE *f = fopen("/proc/cpuinfo", "r");
+
+    if (f == NULL)
+        return model;
+    while (fgets(line, sizeof(line), f) != NULL)
+    {
+        char *colon = strchr(line, ':');
+        if (strncmp(line, "model name", 10) == 0 && colon != NULL)
+        {
+            model = colon + 2;
+            model.erase(model.find_last_not_of("\n") + 1);
+            break;
+        }
+    }
+    fclose(f);
+    return model;
+}
+
+static void write_json(FILE *f, boids::Params p, const BenchOptions &o, const std::vector<BenchResult> &results)
+{
+    char host[256] = "unknown", date[64];
+    time_t now = time(NULL);
+
+    gethostname(host, sizeof(host));
+    strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S", localtime(&now));
+
+    fprintf(f, "{\n");
+    fprintf(f, "  \"host\": \"%s\",\n  \"cpu\": \"%s\",\n  \"cpus\": %d,\n", host, cpu_model().c_str(), omp_get_num_procs());
+    fprintf(f, "  \"date\": \"%s\",\n  \"compiler\": \"%s\",\n", date, __VERSION__);
+    fprintf(f, "  \"params\": {\"width\": %d, \"height\": %d, \"seed\": %d, \"wrand\": %g, \"reorder\": %d, \"balance\": %d, \"precision\": \"%s\"},\n",
+            p.width, p.height, p.seed, p.wrand, p.reorder, p.balance,
+            p.precision == boids::PRECISION_DOUBLE ? "double" : "float");
+    fprintf(f, "  \"warmup\": %d, \"repSteps\": %d, \"ci\": %g, \"scaling\": \"%s\",\n", o.warmup, o.repSteps, o.ci,
+            o.scaling == SCALING_STRONG ? "strong" : o.scaling == SCALING_WEAK ? "weak" : "none");
+    fprintf(f, "  \"results\": [\n");
+    for (size_t i = 0; i < results.size(); i++)
+    {
+        const BenchResult &r = results[i];
+        fprintf(f, "    {\"backend\": \"%s\", \"num\": %d, \"width\": %d, \"height\": %d, \"threads\": %d, \"reps\": %d, "
+                   "\"mean\": %.9g, \"median\": %.9g, \"p95\": %.9g, \"min\": %.9g, \"ci95\": %.9g, "
+                   "\"boidsPerSecond\": %.6g, \"pairsPerSecond\": %s, \"allPairs\": %s, "
+                   "\"speedup\": %s, \"efficiency\": %s, \"karpFlatt\": %s}%s\n",
+                r.backend, r.num, r.width, r.height, r.threads, r.reps, r.mean, r.median, r.p95, r.min, r.ci,
+                r.boidsPerSecond, json_number(r.pairsPerSecond).c_str(), r.allPairs ? "true" : "false",
+                json_number(r.speedup).c_str(), json_number(r.efficiency).c_str(), json_number(r.karpFlatt).c_str(),
+                i + 1 < results.size() ? "," : "");
+    }
+    fprintf(f, "  ]\n}\n");
+}
+
+static void write_tsv(FILE *f, const std::vector<BenchResult> &results)
+{
+    fprintf(f, "backend\tnum\twidth\theight\tthreads\treps\tmean\tmedian\tp95\tmin\tci95\tboidsPerSecond\tpairsPerSecond\tallPairs\t"
+               "speedup\tefficiency\tkarpFlatt\n");
+    for (const BenchResult &r : results)
+    {
+        fprintf(f, "%s\t%d\t%d\t%d\t%d\t%d\t%.9g\t%.9g\t%.9g\t%.9g\t%.9g\t%.6g\t%.6g\t%d\t%.6g\t%.6g\t%.6g\n",
+                r.backend, r.num, r.width, r.height, r.threads, r.reps, r.mean, r.median, r.p95, r.min, r.ci,
+                r.boidsPerSecond, r.pairsPerSecond, r.allPairs, r.speedup, r.efficiency, r.karpFlatt);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    boids::Params p = boids::getDefaultParams();
+    BenchOptions o;
+    bool noDraw = true;
+
+    o.nums = {512, 1024, 2048};
+    o.threads = {1};
+    if (omp_get_num_procs() > 1)
+        o.threads.push_back(omp_get_num_procs());
+    for (int b = 0; b < boids::backend_count(); b++)
+        o.backends.push_back(b);
+    o.warmup = 5;
+    o.repSteps = 5;
+    o.minReps = 5;
+    o.maxReps = 100;
+    o.ci = 0.02;
+    o.scaling = SCALING_NONE;
+    o.tsv = false;
+    o.out = NULL;
+
+    argc = get_bench_arguments(argc, argv, o);
+    get_arguments(argc, argv, p, noDraw);
+
+    std::vector<BenchResult> results;
+    for (int b : o.backends)
+    {
+        const boids::Backend *backend = boids::backend_get(b);
+
+        for (int num : o.nums)
+        {
+            size_t first = results.size();
+
+            for (int threads : o.threads)
+            {
+                boids::Params q = p;
+                double ratio = (double)threads / o.threads[0];
+
+                q.num = num;
+                q.threads = threads;
+                if (o.scaling == SCALING_WEAK && !backend->oneThread)
+                {
+                    // Area grows with the boids, so the density stays put
+                    q.num = lround(num * ratio);
+                    q.width = lround(p.width * sqrt(ratio));
+                    q.height = lround(p.height * sqrt(ratio));
+                }
+
+                BenchResult r = run_config(q, o, b);
+                if (o.scaling != SCALING_NONE && !backend->oneThread)
+                    scaling_metrics(r, results.size() > first ? results[first] : r);
+
+                fprintf(stderr, "%-10s num %7d threads %3d: median %.3e s/step, p95 %.3e, %.3e %s (%d reps)",
+                        r.backend, r.num, r.threads, r.median, r.p95,
+                        r.allPairs ? r.pairsPerSecond : r.boidsPerSecond, r.allPairs ? "pairs/s" : "boids/s", r.reps);
+                if (o.scaling != SCALING_NONE && !backend->oneThread)
+                    fprintf(stderr, ", speedup %.2f, efficiency %.2f, Karp-Flatt %.3f",
+                            r.speedup, r.efficiency, r.karpFlatt);
+                fprintf(stderr, "\n");
+                results.push_back(r);
+            }
+        }
+    }
+
+    FILE *f = stdout;
+    if (o.out != NULL && (f = fopen(o.out, "w")) == NULL)
+    {
+        perror(o.out);
+        return 1;
+    }
+
+    if (o.tsv)
+        write_tsv(f, results);
+    else
+        write_json(f, p, o, results);
+
+    if (f != stdout)
+        fclose(f);
+    return 0;
+}
@@ -60,6 +60,16 @@
 #include <omp.h>
 #include "misc.h"
 #include "boids.hpp"
+#include "rules.hpp"
+#include "rng.hpp"
+#include "prof.hpp"
+
+/* Tile sizes of compute_new_headings_tiled. A source tile is four float
+ * arrays of TILE_SOURCES entries (16 KiB), small enough to stay in L1 while
+ * every target of a tile is run against it.
+ */
+#define TILE_TARGETS 128
+#define TILE_SOURCES 1024
 
 
 /**
@@ -80,6 +90,48 @@ void boids::norm(float* x, float* y)
 	}
 }
 
+/**
+ * @brief Scatter the boids uniformly over the world with random unit headings.
+ *
+ * Boid i draws from (p.seed, i), so the state is the same for any number
+ * of threads and can be filled in parallel.
+ *
+ * @param p
+ * @param xp
+ * @param yp
+ * @param xv
+ * @param yv
+ */
+void boids::random_boids(
+	struct boids::Params p, float *xp, float *yp,
+	float *xv, float *yv)
+{
+	#if defined(OMP)
+	#pragma omp parallel for shared(xp, yp, xv, yv) num_threads(p.threads)
+	#elif defined(MC)
+	#pragma acc parallel loop independent num_gangs(p.threads)
+	#elif defined(GPU)
+	#pragma acc kernels loop independent
+	#endif
+	for (int i = 0; i < p.num; i++)
+	{
+		float u[4], len;
+
+		boids::rng_uniform4(p.seed, i, 0, boids::RNG_INIT, u);
+		xp[i] = -p.width / 2 + u[0] * p.width;
+		yp[i] = -p.height / 2 + u[1] * p.height;
+		xv[i] = 2 * u[2] - 1;
+		yv[i] = 2 * u[3] - 1;
+
+		len = LEN(xv[i], yv[i]);
+		if (len != 0)
+		{
+			xv[i] /= len;
+			yv[i] /= len;
+		}
+	}
+}
+
 /**
  * @brief Default parameters for the simulation
  * 
@@ -93,14 +145,23 @@ boids::Params boids::getDefaultParams()
 		.num = 512, .len = 20, 
 		.mag = 1, .seed = 0, 
 		.invert = 0, .steps = 1000, 
-		.psdump = 0, .angle = 270.0, 
+		.psdump = 0, .step = 0,
+		.angle = 270.0, 
 		.vangle = 90, .minv = 0.5, 
 		.ddt = 0.95, .dt = 3.0, 
 		.rcopy = 80, .rcent = 30, 
 		.rviso = 40, .rvoid = 15, 
 		.wcopy = 0.2, .wcent = 0.4, 
-		.wviso = 0.8, .wvoid = 1.0, .
-		threads = 1, .term = NULL
+		.wviso = 0.8, .wvoid = 1.0, .wrand = 0.0, 
+		.skin = 15, .threads = 1, .backend = 0,
+		.reorder = 0, .balance = 0, .simd = boids::SIMD_AUTO,
+		.precision = boids::PRECISION_FLOAT, .numa = 0, .pin = 0,
+		.perf = 0, .latency = 0, .checkpointEvery = 0,
+		.outputEvery = 1, .outputFrames = 8, .outputPolicy = 0,
+		.outputFormat = 0, .outputKeyEvery = 30, .replayFrom = 0,
+		.lod = 100000, .lodCell = 4, .lodHeading = 1, .lodBudget = 16,
+		.profile = NULL, .trace = NULL, .checkpoint = NULL, .restart = NULL,
+		.output = NULL, .replay = NULL, .term = NULL
     };
 
 	return defaultParams;
@@ -114,17 +175,21 @@ boids::Params boids::getDefaultParams()
  * be parallelized for all compilers, especially openacc.
  * 
  * @param p 
+ * @param ids stable id of the boid in each slot, keys the wrand noise
  * @param xp 
  * @param yp 
  * @param xv 
  * @param yv 
  * @param xnv 
  * @param ynv 
+ * @param xnp back buffer for the new x positions, or NULL to only compute headings
+ * @param ynp back buffer for the new y positions
  */
 void boids::compute_new_headings(
-	struct boids::Params p, float *xp, float *yp,
+	struct boids::Params p, const int *ids, float *xp, float *yp,
 	float *xv, float *yv,
-	float *xnv, float *ynv)
+	float *xnv, float *ynv,
+	float *xnp, float *ynp)
 {
 
 	// for each boid, we will examine every other boid
@@ -149,7 +214,7 @@ void boids::compute_new_headings(
 		them in order for it to compile, likely the GPU parallel. 
 	*/
 	#if defined(OMP)
-	#pragma omp parallel for collapse(1) shared(xp, yp, xv, yv, xnv, ynv) num_threads(p.threads)
+	#pragma omp parallel for collapse(1) shared(ids, xp, yp, xv, yv, xnv, ynv, xnp, ynp) num_threads(p.threads)
 	#elif defined(MC)
 	#pragma acc parallel loop independent collapse(1) num_gangs(p.threads)
 	#elif defined(GPU)
@@ -163,6 +228,7 @@ void boids::compute_new_headings(
 		float mindist, mx = 0, my = 0, d;
 		float cosangle, cosvangle, costemp;
 		float xtemp, ytemp, maxr, u, v;
+		PROF_ONLY(long hits = 0, cent = 0, copy = 0, avoid = 0, viso = 0);
 
 		/* This is the maximum distance in which any rule is activated. */
 		maxr = MAX(p.rviso, MAX(p.rcopy, MAX(p.rcent, p.rvoid)));
@@ -223,6 +289,7 @@ void boids::compute_new_headings(
 			 */
 			if (mindist > maxr)
 				continue;
+			PROF_ONLY(hits++);
 
 			/* Make a vector from boid(which) to boid(i). */
 			xtemp = mx - xp[which];
@@ -250,6 +317,7 @@ void boids::compute_new_headings(
 				xa += mx - xp[which];
 				ya += my - yp[which];
 				numcent++;
+				PROF_ONLY(cent++);
 			}
 
 			/* If we are close enough to copy, but far enough to avoid,
@@ -259,6 +327,7 @@ void boids::compute_new_headings(
 			{
 				xb += xv[i];
 				yb += yv[i];
+				PROF_ONLY(copy++);
 			}
 
 			/* If we are within collision range, then try to avoid boid(i). */
@@ -277,6 +346,7 @@ void boids::compute_new_headings(
 				ytemp *= d;
 				xc += xtemp;
 				yc += ytemp;
+				PROF_ONLY(avoid++);
 			}
 
 			/* If boid(i) is within rviso distance and the angle between this boid's
@@ -325,9 +395,20 @@ void boids::compute_new_headings(
 				}
 				xd += u;
 				yd += v;
+				PROF_ONLY(viso++);
 			}
 		} // end of loop for every boid
 
+		#if defined(PROFILE)
+		boids::ProfThread &prof = boids::prof_self();
+		prof.count[boids::PROF_TESTED] += p.num - 1;
+		prof.count[boids::PROF_HITS] += hits;
+		prof.count[boids::PROF_CENT] += cent;
+		prof.count[boids::PROF_COPY] += copy;
+		prof.count[boids::PROF_VOID] += avoid;
+		prof.count[boids::PROF_VISO] += viso;
+		#endif
+
 		/* Avoid centering on only one other boid;
 		 * it makes you look aggressive!
 		 */
@@ -348,12 +429,17 @@ void boids::compute_new_headings(
 		xt = xa * p.wcent + xb * p.wcopy + xc * p.wvoid + xd * p.wviso;
 		yt = ya * p.wcent + yb * p.wcopy + yc * p.wvoid + yd * p.wviso;
 
-		/* Optionally add some noise. */
-		// LS Note: eliminate this option for simplicity
-		// if(wrand > 0) {
-		//   xt += random_range(-1, 1) * wrand;
-		//   yt += random_range(-1, 1) * wrand;
-		// }
+		/* Optionally add some noise, from a counter-based generator so
+		 * that it does not depend on which thread computes the boid, nor
+		 * on which slot the boid is in.
+		 */
+		if (p.wrand > 0)
+		{
+			float u[4];
+			boids::rng_uniform4(p.seed, ids[which], p.step, boids::RNG_NOISE, u);
+			xt += (2 * u[0] - 1) * p.wrand;
+			yt += (2 * u[1] - 1) * p.wrand;
+		}
 
 		/* Update the velocity and renormalize if it is too small. */
 		xnv[which] = xv[which] * p.ddt + xt * (1 - p.ddt);
@@ -364,5 +450,111 @@ void boids::compute_new_headings(
 			xnv[which] *= p.minv / d;
 			ynv[which] *= p.minv / d;
 		}
+
+		/* With back buffers, also move the boid: one fused pass per step. */
+		if (xnp != NULL)
+			boids::integrate(p, xp[which], yp[which], xnv[which], ynv[which], &xnp[which], &ynp[which]);
 	}
-}
\ No newline at end of file
+}
+
+/**
+ * @brief compute_new_headings_tiled for one rule mask and precision.
+ */
+template <unsigned RULES, typename Real>
+struct TiledKernel
+{
+	static void run(
+		struct boids::Params p, const int *ids, float *xp, float *yp,
+		float *xv, float *yv,
+		float *xnv, float *ynv,
+		float *xnp, float *ynp)
+	{
+		boids::RuleConsts c = boids::rule_consts(p);
+		float maxr2 = SQR(c.maxr);
+		int ntiles = (p.num + TILE_TARGETS - 1) / TILE_TARGETS;
+
+		#if defined(OMP)
+		#pragma omp parallel for schedule(dynamic) shared(ids, xp, yp, xv, yv, xnv, ynv, xnp, ynp) num_threads(p.threads)
+		#endif
+		for (int tile = 0; tile < ntiles; tile++)
+		{
+			boids::Accum<Real> acc[TILE_TARGETS];
+			int tbegin = tile * TILE_TARGETS;
+			int tend = MIN(tbegin + TILE_TARGETS, p.num);
+
+			for (int which = tbegin; which < tend; which++)
+				acc[which - tbegin] = {0, 0, 0, 0, 0, 0, 0, 0, 0};
+
+			for (int sbegin = 0; sbegin < p.num; sbegin += TILE_SOURCES)
+			{
+				int send = MIN(sbegin + TILE_SOURCES, p.num);
+
+				for (int which = tbegin; which < tend; which++)
+				{
+					boids::Accum<Real> &a = acc[which - tbegin];
+					float x = xp[which], y = yp[which];
+
+					for (int i = sbegin; i < send; i++)
+					{
+						Real dx, dy, d2;
+
+						if (i == which)
+							continue;
+
+						dx = boids::min_image(xp[i] - x, p.width);
+						dy = boids::min_image(yp[i] - y, p.height);
+						d2 = SQR(dx) + SQR(dy);
+						if (d2 > maxr2)
+							continue;
+
+						boids::accumulate_pair<RULES, Real>(p, c, a, dx, dy, sqrt(d2),
+								xv[which], yv[which], xv[i], yv[i]);
+					}
+				}
+			}
+
+			for (int which = tbegin; which < tend; which++)
+			{
+				boids::finish_heading<RULES, Real>(p, acc[which - tbegin], ids[which], xv[which], yv[which], &xnv[which], &ynv[which]);
+				PROF_COUNT(boids::PROF_TESTED, p.num - 1);
+
+				/* With back buffers, also move the boid: one fused pass per step. */
+				if (xnp != NULL)
+					boids::integrate(p, xp[which], yp[which], xnv[which], ynv[which], &xnp[which], &ynp[which]);
+			}
+		}
+	}
+};
+
+/**
+ * @brief Computes the headings for all boids, all pairs, blocked for cache.
+ *
+ * The brute-force loop streams all of xp, yp, xv and yv from memory once
+ * per boid. Here the boids are cut into tiles: each thread takes a tile of
+ * target boids and runs it against one tile of source boids at a time, so
+ * a source tile is loaded once per TILE_TARGETS targets instead of once
+ * per target. The targets keep their rule accumulators across source
+ * tiles. This is the right kernel when the rule radii are large compared
+ * to the world and a grid degenerates to a handful of cells.
+ *
+ * Same result as compute_new_headings within float tolerance.
+ *
+ * @param p
+ * @param ids stable id of the boid in each slot, keys the wrand noise
+ * @param xp
+ * @param yp
+ * @param xv
+ * @param yv
+ * @param xnv
+ * @param ynv
+ * @param xnp back buffer for the new x positions, or NULL to only compute headings
+ * @param ynp back buffer for the new y positions
+ */
+void boids::compute_new_headings_tiled(
+	struct boids::Params p, const int *ids, float *xp, float *yp,
+	float *xv, float *yv,
+	float *xnv, float *ynv,
+	float *xnp, float *ynp)
+{
+	boids::select_kernel<TiledKernel>(p)(p, ids, xp, yp, xv, yv, xnv, ynv, xnp, ynp);
+}
@@ -11,7 +11,22 @@ namespace boids {
     #define DIST(x1, y1, x2, y2) LEN(((x1) - (x2)), ((y1) - (y2)))
     #define DOT(x1, y1, x2, y2) ((x1) * (x2) + (y1) * (y2))
 
-    
+    /* Instruction sets the brute-force kernel can use (see simd.hpp). */
+    enum Simd
+    {
+        SIMD_OFF,       // the scalar compute_new_headings loop
+        SIMD_AUTO,      // the widest one this CPU supports
+        SIMD_AVX2,      // 8 candidate boids per iteration
+        SIMD_AVX512     // 16 candidate boids per iteration
+    };
+
+    /* Arithmetic of the rules in the tiled, grid and verlet kernels (see rules.hpp). */
+    enum Precision
+    {
+        PRECISION_FLOAT,
+        PRECISION_DOUBLE
+    };
+
     struct Params
     {
         int width;
@@ -23,6 +38,7 @@ namespace boids {
         int invert;
         int steps;
         int psdump;
+        int step;    // current time step, keys the noise of the wrand rule
 
         double angle;
         double vangle;
@@ -37,16 +53,47 @@ namespace boids {
         double wcent;
         double wviso;
         double wvoid;
-        // double  wrand = 0.0;   // eliminate for simplicity
+        double wrand; // weight of the random noise (0 = off)
+        double skin;  // extra radius of the Verlet lists
 
         int threads; // will ignore for openACC version; used for multicore
+        int backend; // index of the step kernel in the backends.hpp registry
+        int reorder; // sort the state arrays by grid cell every reorder steps (0 = never)
+        int balance; // split the grid and verlet loops by the last step's work (0 = equal blocks)
+        int simd;    // one of boids::Simd, for the simd backend
+        int precision; // one of boids::Precision
+        int numa;    // first-touch the state arrays with the kernels' thread split (0 = off)
+        int pin;     // one of boids::Pin (see numa.hpp)
+        int perf;    // read hardware counters around the prof.hpp phases (0 = off)
+        int latency; // step latency percentiles at exit and every latency steps (0 = off)
+        int checkpointEvery; // steps between checkpoints (0 = only at exit)
+        int outputEvery;  // steps between trajectory frames
+        int outputFrames; // frames the trajectory writer can have queued
+        int outputPolicy; // one of boids::OutputPolicy (see trajectory.hpp)
+        int outputFormat; // one of boids::OutputFormat
+        int outputKeyEvery; // frames between keyframes of the compact format
+        int replayFrom;   // first step to replay
+        int lod;          // boid count from which the canvas draws the density (0 = never)
+        int lodCell;      // pixels per side of a density cell
+        int lodHeading;   // color the density by mean heading (0 = white)
+        double lodBudget; // ms per frame for the boids before switching to the density (0 = no limit)
+        char *profile; // per-step CSV of the prof.hpp counters, or NULL
+        char *trace;   // Chrome trace JSON of the prof.hpp phases, or NULL
+        char *checkpoint; // where to snapshot the state (see checkpoint.hpp), or NULL
+        char *restart;    // checkpoint to resume from instead of a random start, or NULL
+        char *output;     // trajectory file, or NULL
+        char *replay;     // compact trajectory to draw instead of simulating, or NULL
 
         char *term;
     };
 
     void norm(float* x, float* y);
 
-    void compute_new_headings(struct Params p, float* xp, float* yp, float* xv, float* yv, float* xnv, float* ynv);
+    void compute_new_headings(struct Params p, const int* ids, float* xp, float* yp, float* xv, float* yv, float* xnv, float* ynv, float* xnp = NULL, float* ynp = NULL);
+
+    void compute_new_headings_tiled(struct Params p, const int* ids, float* xp, float* yp, float* xv, float* yv, float* xnv, float* ynv, float* xnp = NULL, float* ynp = NULL);
+
+    void random_boids(struct Params p, float* xp, float* yp, float* xv, float* yv);
 
     Params getDefaultParams();
 
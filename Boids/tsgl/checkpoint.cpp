@@ -0,0 +1,263 @@
+/*
+    Writing and mapping checkpoints, see checkpoint.hpp.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <string>
+#include "misc.h"
+#include "boids.hpp"
+#include "checkpoint.hpp"
+
+
+/**
+ * @brief First multiple of CHECKPOINT_ALIGN at or after offset.
+ */
+static uint64_t align_up(uint64_t offset)
+{
+	return (offset + CHECKPOINT_ALIGN - 1) / CHECKPOINT_ALIGN * CHECKPOINT_ALIGN;
+}
+
+/**
+ * @brief write() all of buf, retrying short writes.
+ */
+static bool write_all(int fd, const void *buf, size_t n)
+{
+	const char *c = (const char *)buf;
+
+	while (n > 0)
+	{
+		ssize_t done = write(fd, c, n);
+
+		if (done < 0 && errno == EINTR)
+			continue;
+		if (done <= 0)
+			return false;
+		c += done;
+		n -= done;
+	}
+	return true;
+}
+
+/**
+ * @brief Write zeros up to the next CHECKPOINT_ALIGN boundary after offset.
+ */
+static bool write_padding(int fd, uint64_t offset)
+{
+	static const char zeros[CHECKPOINT_ALIGN] = {0};
+
+	return write_all(fd, zeros, align_up(offset) - offset);
+}
+
+/**
+ * @brief Snapshot the state to path.
+ *
+ * @param path
+ * @param p with the current step
+ * @param ids stable id of the boid in each slot
+ * @param xp
+ * @param yp
+ * @param xv
+ * @param yv
+ * @return false, with a message on stderr, if the file could not be written
+ */
+bool boids::checkpoint_write(
+	const char *path, struct boids::Params p, const int *ids,
+	const float *xp, const float *yp, const float *xv, const float *yv)
+{
+	const void *arrays[CHECKPOINT_ARRAYS] = {ids, xp, yp, xv, yv};
+	std::string tmp = std::string(path) + ".tmp";
+	boids::CheckpointHeader h;
+	uint64_t offset;
+	int fd;
+
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, CHECKPOINT_MAGIC, sizeof(h.magic));
+	h.version = CHECKPOINT_VERSION;
+	h.paramsSize = sizeof(boids::Params);
+	h.num = p.num;
+	h.params = p;
+	h.params.profile = h.params.trace = h.params.term = NULL;
+	h.params.checkpoint = h.params.restart = h.params.output = h.params.replay = NULL;
+
+	offset = align_up(sizeof(h));
+	for (int k = 0; k < CHECKPOINT_ARRAYS; k++)
+	{
+		h.offsets[k] = offset;
+		offset = align_up(offset + (uint64_t)p.num * 4);
+	}
+	h.size = offset;
+
+	fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+	{
+		perror(tmp.c_str());
+		return false;
+	}
+
+	bool ok = write_all(fd, &h, sizeof(h)) && write_padding(fd, sizeof(h));
+	for (int k = 0; ok && k < CHECKPOINT_ARRAYS; k++)
+	{
+		ok = write_all(fd, arrays[k], (size_t)p.num * 4) &&
+			 write_padding(fd, h.offsets[k] + (uint64_t)p.num * 4);
+	}
+	ok = ok && fsync(fd) == 0;
+	ok = (close(fd) == 0) && ok;
+
+	if (!ok || rename(tmp.c_str(), path) != 0)
+	{
+		perror(path);
+		unlink(tmp.c_str());
+		return false;
+	}
+	return true;
+}
+
+/**
+ * @brief Map a checkpoint and check that this build can load it.
+ *
+ * @param path
+ * @param c filled in on success
+ * @return false, with a message on stderr, if path is not a usable checkpoint
+ */
+bool boids::checkpoint_open(const char *path, boids::Checkpoint &c)
+{
+	struct stat st;
+	int fd = open(path, O_RDONLY);
+
+	if (fd < 0 || fstat(fd, &st) != 0)
+	{
+		perror(path);
+		if (fd >= 0)
+			close(fd);
+		return false;
+	}
+
+	c.size = st.st_size;
+	c.map = (c.size >= sizeof(boids::CheckpointHeader))
+		? mmap(NULL, c.size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+	close(fd);
+	if (c.map == MAP_FAILED)
+	{
+		fprintf(stderr, "%s: not a checkpoint\n", path);
+		return false;
+	}
+	c.header = (const boids::CheckpointHeader *)c.map;
+
+	const char *problem = NULL;
+	if (memcmp(c.header->magic, CHECKPOINT_MAGIC, sizeof(c.header->magic)) != 0)
+		problem = "not a checkpoint";
+	else if (c.header->version != CHECKPOINT_VERSION || c.header->paramsSize != sizeof(boids::Params))
+		problem = "written by an incompatible version";
+	else if (c.header->size != c.size)
+		problem = "truncated";
+	if (problem != NULL)
+	{
+		fprintf(stderr, "%s: %s\n", path, problem);
+		checkpoint_close(c);
+		return false;
+	}
+
+	// Let the copy stream the arrays in ahead of it
+	madvise(c.map, c.size, MADV_SEQUENTIAL);
+	madvise(c.map, c.size, MADV_WILLNEED);
+	return true;
+}
+
+/**
+ * @brief The parameters to resume with.
+ *
+ * The model (world, boid count, rules, seed and step) comes from the
+ * checkpoint; how to run it (steps, threads, backend and the other
+ * options) comes from run.
+ *
+ * @param c
+ * @param run the parameters from the command line
+ */
+boids::Params boids::checkpoint_params(const boids::Checkpoint &c, struct boids::Params run)
+{
+	boids::Params p = c.header->params;
+
+	p.steps = run.steps;
+	p.psdump = run.psdump;
+	p.skin = run.skin;
+	p.threads = run.threads;
+	p.backend = run.backend;
+	p.reorder = run.reorder;
+	p.balance = run.balance;
+	p.simd = run.simd;
+	p.precision = run.precision;
+	p.numa = run.numa;
+	p.pin = run.pin;
+	p.perf = run.perf;
+	p.latency = run.latency;
+	p.checkpointEvery = run.checkpointEvery;
+	p.outputEvery = run.outputEvery;
+	p.outputFrames = run.outputFrames;
+	p.outputPolicy = run.outputPolicy;
+	p.outputFormat = run.outputFormat;
+	p.outputKeyEvery = run.outputKeyEvery;
+	p.replayFrom = run.replayFrom;
+	p.lod = run.lod;
+	p.lodCell = run.lodCell;
+	p.lodHeading = run.lodHeading;
+	p.lodBudget = run.lodBudget;
+	p.profile = run.profile;
+	p.trace = run.trace;
+	p.checkpoint = run.checkpoint;
+	p.restart = run.restart;
+	p.output = run.output;
+	p.replay = run.replay;
+	p.term = run.term;
+	return p;
+}
+
+/**
+ * @brief Copy the state of a checkpoint into the state arrays.
+ *
+ * @param c
+ * @param p from checkpoint_params
+ * @param ids
+ * @param xp
+ * @param yp
+ * @param xv
+ * @param yv
+ */
+void boids::checkpoint_load(
+	const boids::Checkpoint &c, struct boids::Params p, int *ids,
+	float *xp, float *yp, float *xv, float *yv)
+{
+	void *arrays[CHECKPOINT_ARRAYS] = {ids, xp, yp, xv, yv};
+
+	for (int k = 0; k < CHECKPOINT_ARRAYS; k++)
+	{
+		// Every array has 4-byte elements; copy them as bits
+		const uint32_t *src = (const uint32_t *)((const char *)c.map + c.header->offsets[k]);
+		uint32_t *dst = (uint32_t *)arrays[k];
+
+		// Same split as the kernels, so with -numa the pages stay on their node
+		#if defined(OMP)
+		#pragma omp parallel for schedule(static) num_threads(p.threads)
+		#endif
+		for (int i = 0; i < p.num; i++)
+			dst[i] = src[i];
+	}
+}
+
+/**
+ * @brief Unmap a checkpoint.
+ *
+ * @param c
+ */
+void boids::checkpoint_close(boids::Checkpoint &c)
+{
+	munmap(c.map, c.size);
+	c.map = NULL;
+	c.header = NULL;
+}
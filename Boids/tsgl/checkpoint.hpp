@@ -0,0 +1,74 @@
+/*
+    Binary snapshots of the whole simulation state, to resume long runs.
+
+    A checkpoint is one file: a page-sized header holding the Params it
+    was written with, then the ids and the xp, yp, xv, yv arrays, each
+    starting on a page boundary in the in-memory layout (native byte
+    order). The noise of the wrand rule is keyed by (seed, boid id, step)
+    (see rng.hpp), so Params and the ids already hold the whole RNG state.
+
+    Writing is a few large sequential writes to a temporary file that is
+    renamed over the old checkpoint, so a crash mid-write keeps the last
+    good one. Loading maps the file and copies the arrays straight into
+    the state arrays, in parallel with the kernels' thread split.
+*/
+#ifndef CHECKPOINT_HPP
+#define CHECKPOINT_HPP
+
+#include <stddef.h>
+#include <stdint.h>
+#include "boids.hpp"
+
+/* Bump whenever the layout below or struct Params changes. */
+#define CHECKPOINT_VERSION 4
+#define CHECKPOINT_MAGIC "BOIDSCKP"
+#define CHECKPOINT_ALIGN 4096
+
+namespace boids {
+
+    /* The arrays of a checkpoint, in file order. */
+    enum CheckpointArray
+    {
+        CHECKPOINT_IDS,
+        CHECKPOINT_XP,
+        CHECKPOINT_YP,
+        CHECKPOINT_XV,
+        CHECKPOINT_YV,
+        CHECKPOINT_ARRAYS
+    };
+
+    struct CheckpointHeader
+    {
+        char magic[8];
+        uint32_t version;
+        uint32_t paramsSize;                   // sizeof(Params) of the writer
+        uint64_t num;
+        uint64_t offsets[CHECKPOINT_ARRAYS];   // byte offset of each array
+        uint64_t size;                         // of the whole file
+        Params params;                         // with the string options cleared
+    };
+
+    /**
+     * @brief A checkpoint file mapped for reading.
+     */
+    struct Checkpoint
+    {
+        const CheckpointHeader *header;
+        void *map;
+        size_t size;
+    };
+
+    bool checkpoint_write(const char *path, struct Params p, const int *ids,
+                          const float *xp, const float *yp, const float *xv, const float *yv);
+
+    bool checkpoint_open(const char *path, Checkpoint &c);
+
+    Params checkpoint_params(const Checkpoint &c, struct Params run);
+
+    void checkpoint_load(const Checkpoint &c, struct Params p, int *ids,
+                         float *xp, float *yp, float *xv, float *yv);
+
+    void checkpoint_close(Checkpoint &c);
+
+}
+#endif
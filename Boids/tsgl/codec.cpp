@@ -0,0 +1,508 @@
+/*
+    Quantization, prediction and residual packing of codec.hpp.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "misc.h"
+#include "boids.hpp"
+#include "codec.hpp"
+
+
+/**
+ * @brief Quantize a frame into q, see codec.hpp.
+ */
+static void quantize(
+	const boids::CodecHeader &h, uint16_t **q,
+	const float *x, const float *y, const float *vx, const float *vy)
+{
+	for (uint32_t i = 0; i < h.num; i++)
+	{
+		double speed = LEN(vx[i], vy[i]);
+
+		q[boids::CODEC_X][i] = (uint16_t)lround((x[i] / h.width + 0.5) * 65536);
+		q[boids::CODEC_Y][i] = (uint16_t)lround((y[i] / h.height + 0.5) * 65536);
+		q[boids::CODEC_ANGLE][i] = lround(atan2(vy[i], vx[i]) * (CODEC_VELOCITY_LEVELS / (2 * M_PI))) & (CODEC_VELOCITY_LEVELS - 1);
+		q[boids::CODEC_SPEED][i] = MIN(CODEC_VELOCITY_LEVELS - 1L, lround(speed / h.speedMax * (CODEC_VELOCITY_LEVELS - 1)));
+	}
+}
+
+/**
+ * @brief The floats of the quantized frame q.
+ */
+static void dequantize(
+	const boids::CodecHeader &h, uint16_t *const *q,
+	float *x, float *y, float *vx, float *vy)
+{
+	for (uint32_t i = 0; i < h.num; i++)
+	{
+		double angle = q[boids::CODEC_ANGLE][i] * (2 * M_PI / CODEC_VELOCITY_LEVELS);
+		double speed = q[boids::CODEC_SPEED][i] * (h.speedMax / (CODEC_VELOCITY_LEVELS - 1));
+
+		// Back into [-size / 2, size / 2), where the kernels keep the boids
+		x[i] = (q[boids::CODEC_X][i] / 65536.0 - 0.5) * h.width;
+		y[i] = (q[boids::CODEC_Y][i] / 65536.0 - 0.5) * h.height;
+		vx[i] = speed * cos(angle);
+		vy[i] = speed * sin(angle);
+	}
+}
+
+/**
+ * @brief The values of channel c are taken modulo channel_mask(c) + 1.
+ */
+static inline uint32_t channel_mask(int c)
+{
+	return (c == boids::CODEC_X || c == boids::CODEC_Y) ? 0xffff : CODEC_VELOCITY_LEVELS - 1;
+}
+
+/**
+ * @brief The residual q - guess of channel c, as the nearest signed value.
+ */
+static inline int32_t residual(int c, uint32_t q, uint32_t guess)
+{
+	int shift = 32 - __builtin_popcount(channel_mask(c));
+
+	return (int32_t)(((q - guess) & channel_mask(c)) << shift) >> shift;
+}
+
+/**
+ * @brief What a delta frame predicts for value i of channel c.
+ *
+ * @param h
+ * @param c
+ * @param q this frame, of which the velocity channels are already known
+ * @param prev the previous frame
+ * @param prev2 and the one before
+ * @param sinceKey frames from the last keyframe to the previous frame
+ * @param gap steps from the previous frame to this one
+ * @param i
+ */
+static inline uint16_t predict(
+	const boids::CodecHeader &h, int c, uint16_t *const *q,
+	uint16_t *const *prev, uint16_t *const *prev2, int sinceKey, int gap, uint32_t i)
+{
+	if (c == boids::CODEC_X || c == boids::CODEC_Y)
+	{
+		// integrate() moves a boid by its new velocity times dt each step
+		double angle = q[boids::CODEC_ANGLE][i] * (2 * M_PI / CODEC_VELOCITY_LEVELS);
+		double speed = q[boids::CODEC_SPEED][i] * (h.speedMax / (CODEC_VELOCITY_LEVELS - 1));
+		double move = (c == boids::CODEC_X) ? cos(angle) * 65536 / h.width : sin(angle) * 65536 / h.height;
+
+		return (uint16_t)(prev[c][i] + (int32_t)lround(move * speed * h.dt * gap));
+	}
+
+	// Linear extrapolation, except right after a keyframe with no slope yet
+	if (sinceKey == 0)
+		return prev[c][i];
+	return (2 * prev[c][i] - prev2[c][i]) & channel_mask(c);
+}
+
+/**
+ * @brief Append n zigzag residuals as one block of their widest bit width.
+ */
+static void put_block(std::vector<uint8_t> &out, const uint32_t *z, int n)
+{
+	uint32_t all = 0;
+	uint64_t acc = 0;
+	int width, bits = 0;
+
+	for (int k = 0; k < n; k++)
+		all |= z[k];
+	width = all ? 32 - __builtin_clz(all) : 0;
+	out.push_back((uint8_t)width);
+
+	for (int k = 0; k < n; k++)
+	{
+		acc |= (uint64_t)z[k] << bits;
+		for (bits += width; bits >= 8; bits -= 8)
+		{
+			out.push_back((uint8_t)acc);
+			acc >>= 8;
+		}
+	}
+	if (bits > 0)
+		out.push_back((uint8_t)acc);
+}
+
+/**
+ * @brief Read one block of n residuals from [*p, end), advancing *p.
+ *
+ * @return false if it is malformed or runs past end
+ */
+static bool get_block(const uint8_t **p, const uint8_t *end, uint32_t *z, int n)
+{
+	const uint8_t *s;
+	uint64_t acc = 0;
+	int width, bits = 0;
+
+	if (*p >= end || **p > 16)
+		return false;
+	width = *(*p)++;
+	if (end - *p < ((long)n * width + 7) / 8)
+		return false;
+
+	s = *p;
+	for (int k = 0; k < n; k++)
+	{
+		for (; bits < width; bits += 8)
+			acc |= (uint64_t)*s++ << bits;
+		z[k] = (uint32_t)acc & ((1u << width) - 1);
+		acc >>= width;
+		bits -= width;
+	}
+	*p += ((long)n * width + 7) / 8;
+	return true;
+}
+
+/**
+ * @brief Make the frame in q the previous one.
+ */
+static void rotate(uint16_t **q, uint16_t **prev, uint16_t **prev2, int *sinceKey, bool key)
+{
+	for (int c = 0; c < boids::CODEC_CHANNELS; c++)
+	{
+		uint16_t *t = prev2[c];
+
+		prev2[c] = prev[c];
+		prev[c] = q[c];
+		q[c] = t;
+	}
+	*sinceKey = key ? 0 : *sinceKey + 1;
+}
+
+static void alloc_channels(uint16_t **q, uint16_t **prev, uint16_t **prev2, uint32_t num)
+{
+	for (int c = 0; c < boids::CODEC_CHANNELS; c++)
+	{
+		q[c] = new uint16_t[num];
+		prev[c] = new uint16_t[num];
+		prev2[c] = new uint16_t[num];
+	}
+}
+
+static void free_channels(uint16_t **q, uint16_t **prev, uint16_t **prev2)
+{
+	for (int c = 0; c < boids::CODEC_CHANNELS; c++)
+	{
+		delete[] q[c];
+		delete[] prev[c];
+		delete[] prev2[c];
+	}
+}
+
+/**
+ * @brief Write the header of a compact trajectory to f.
+ *
+ * @param e
+ * @param f
+ * @param p p.outputKeyEvery frames between keyframes
+ * @return false if the write failed
+ */
+bool boids::encoder_open(boids::Encoder &e, FILE *f, struct boids::Params p)
+{
+	boids::CodecHeader &h = e.header;
+
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, CODEC_MAGIC, sizeof(h.magic));
+	h.version = CODEC_VERSION;
+	h.num = p.num;
+	h.width = p.width;
+	h.height = p.height;
+	h.every = p.outputEvery;
+	h.keyEvery = MAX(1, p.outputKeyEvery);
+	// The new velocity blends the old one with the sum of the weighted
+	// rules, each at most 1 long, so neither can exceed this
+	h.speedMax = MAX(1.0, MAX(p.minv, p.wcopy + p.wcent + p.wvoid + p.wviso + p.wrand));
+	h.dt = p.dt;
+
+	alloc_channels(e.q, e.prev, e.prev2, p.num);
+	e.sinceKey = -1;
+	e.prevStep = 0;
+	e.residuals.resize(p.num);
+	e.payload.clear();
+	e.index.clear();
+	e.offset = sizeof(h);
+
+	return fwrite(&h, sizeof(h), 1, f) == 1;
+}
+
+/**
+ * @brief Encode and write one frame.
+ *
+ * @param e
+ * @param f
+ * @param step
+ * @param x indexed by boid id, as are the others
+ * @param y
+ * @param vx
+ * @param vy
+ * @return false if the write failed
+ */
+bool boids::encoder_frame(
+	boids::Encoder &e, FILE *f, int step,
+	const float *x, const float *y, const float *vx, const float *vy)
+{
+	const boids::CodecHeader &h = e.header;
+	bool key = e.sinceKey < 0 || e.sinceKey + 1 >= h.keyEvery;
+
+	quantize(h, e.q, x, y, vx, vy);
+
+	e.payload.clear();
+	for (int c = 0; c < CODEC_CHANNELS; c++)
+	{
+		if (key)
+		{
+			const uint8_t *raw = (const uint8_t *)e.q[c];
+			e.payload.insert(e.payload.end(), raw, raw + h.num * sizeof(uint16_t));
+			continue;
+		}
+
+		for (uint32_t i = 0; i < h.num; i++)
+		{
+			uint16_t guess = predict(h, c, e.q, e.prev, e.prev2, e.sinceKey, step - e.prevStep, i);
+			int32_t r = residual(c, e.q[c][i], guess);
+
+			// Zigzag, so small residuals of either sign need few bits
+			e.residuals[i] = ((uint32_t)r << 1) ^ (uint32_t)(r >> 31);
+		}
+		for (uint32_t i = 0; i < h.num; i += CODEC_BLOCK)
+			put_block(e.payload, &e.residuals[i], MIN(CODEC_BLOCK, (int)(h.num - i)));
+	}
+
+	boids::CodecFrame fr = {step, (uint32_t)e.payload.size(), key};
+	if (fwrite(&fr, sizeof(fr), 1, f) != 1 ||
+		fwrite(e.payload.data(), 1, e.payload.size(), f) != e.payload.size())
+		return false;
+
+	e.index.push_back({e.offset, step, key});
+	e.offset += sizeof(fr) + e.payload.size();
+	e.prevStep = step;
+	rotate(e.q, e.prev, e.prev2, &e.sinceKey, key);
+	return true;
+}
+
+/**
+ * @brief Write the index and footer, and release the encoder.
+ *
+ * @param e
+ * @param f
+ * @return false if the write failed
+ */
+bool boids::encoder_close(boids::Encoder &e, FILE *f)
+{
+	boids::CodecFooter footer;
+
+	footer.indexOffset = e.offset;
+	footer.frames = e.index.size();
+	memcpy(footer.magic, CODEC_INDEX_MAGIC, sizeof(footer.magic));
+
+	bool ok = fwrite(e.index.data(), sizeof(boids::CodecIndexEntry), e.index.size(), f) == e.index.size() &&
+			  fwrite(&footer, sizeof(footer), 1, f) == 1;
+
+	free_channels(e.q, e.prev, e.prev2);
+	e.index.clear();
+	return ok;
+}
+
+/**
+ * @brief Rebuild the index of a file without one by walking the frame headers.
+ */
+static void scan_frames(boids::Decoder &d)
+{
+	boids::CodecFrame fr;
+	uint64_t offset = sizeof(boids::CodecHeader);
+
+	fseek(d.file, offset, SEEK_SET);
+	while (fread(&fr, sizeof(fr), 1, d.file) == 1 && fseek(d.file, fr.bytes, SEEK_CUR) == 0)
+	{
+		d.index.push_back({offset, fr.step, fr.key});
+		offset += sizeof(fr) + fr.bytes;
+	}
+
+	// The last frame may have been cut short
+	fseek(d.file, 0, SEEK_END);
+	if (!d.index.empty() && (uint64_t)ftell(d.file) < offset)
+		d.index.pop_back();
+}
+
+/**
+ * @brief Open a compact trajectory and load its index.
+ *
+ * @param d
+ * @param path
+ * @return false, with a message on stderr, if path is not a compact trajectory
+ */
+bool boids::decoder_open(boids::Decoder &d, const char *path)
+{
+	boids::CodecFooter footer;
+
+	d.file = fopen(path, "rb");
+	if (d.file == NULL)
+	{
+		perror(path);
+		return false;
+	}
+	if (fread(&d.header, sizeof(d.header), 1, d.file) != 1 ||
+		memcmp(d.header.magic, CODEC_MAGIC, sizeof(d.header.magic)) != 0 ||
+		d.header.version != CODEC_VERSION)
+	{
+		fprintf(stderr, "%s: not a compact trajectory of this version\n", path);
+		fclose(d.file);
+		return false;
+	}
+
+	d.index.clear();
+	if (fseek(d.file, -(long)sizeof(footer), SEEK_END) == 0 &&
+		fread(&footer, sizeof(footer), 1, d.file) == 1 &&
+		memcmp(footer.magic, CODEC_INDEX_MAGIC, sizeof(footer.magic)) == 0)
+	{
+		d.index.resize(footer.frames);
+		fseek(d.file, footer.indexOffset, SEEK_SET);
+		if (fread(d.index.data(), sizeof(boids::CodecIndexEntry), footer.frames, d.file) != footer.frames)
+			d.index.clear();
+	}
+	if (d.index.empty())
+	{
+		scan_frames(d);
+		fprintf(stderr, "%s has no index, found %zu frames by scanning\n", path, d.index.size());
+	}
+
+	alloc_channels(d.q, d.prev, d.prev2, d.header.num);
+	d.sinceKey = -1;
+	d.current = -1;
+	d.residuals.resize(d.header.num);
+	return true;
+}
+
+/**
+ * @brief The last frame at or before step.
+ *
+ * @param d
+ * @param step
+ * @return its index, the first frame if step comes before it, -1 for an empty file
+ */
+int boids::decoder_find(const boids::Decoder &d, int step)
+{
+	int lo = 0, hi = (int)d.index.size() - 1;
+
+	if (hi < 0)
+		return -1;
+	while (lo < hi)
+	{
+		int mid = (lo + hi + 1) / 2;
+
+		if (d.index[mid].step <= step)
+			lo = mid;
+		else
+			hi = mid - 1;
+	}
+	return lo;
+}
+
+/**
+ * @brief Decode frame i into d.q and make it the previous frame.
+ */
+static bool decode_frame(boids::Decoder &d, int i)
+{
+	const boids::CodecIndexEntry &entry = d.index[i];
+	const boids::CodecHeader &h = d.header;
+	boids::CodecFrame fr;
+
+	if (fseek(d.file, entry.offset, SEEK_SET) != 0 || fread(&fr, sizeof(fr), 1, d.file) != 1)
+		return false;
+	d.payload.resize(fr.bytes);
+	if (fread(d.payload.data(), 1, fr.bytes, d.file) != fr.bytes)
+		return false;
+
+	const uint8_t *p = d.payload.data(), *end = p + fr.bytes;
+	for (int c = 0; c < boids::CODEC_CHANNELS; c++)
+	{
+		if (fr.key)
+		{
+			if (end - p < (long)(h.num * sizeof(uint16_t)))
+				return false;
+			memcpy(d.q[c], p, h.num * sizeof(uint16_t));
+			p += h.num * sizeof(uint16_t);
+			continue;
+		}
+
+		int gap = entry.step - d.index[i - 1].step;
+
+		for (uint32_t j = 0; j < h.num; j += CODEC_BLOCK)
+		{
+			if (!get_block(&p, end, &d.residuals[j], MIN(CODEC_BLOCK, (int)(h.num - j))))
+				return false;
+		}
+		for (uint32_t j = 0; j < h.num; j++)
+		{
+			uint32_t z = d.residuals[j];
+			int32_t r = (int32_t)(z >> 1) ^ -(int32_t)(z & 1);
+
+			d.q[c][j] = (predict(h, c, d.q, d.prev, d.prev2, d.sinceKey, gap, j) + r) & channel_mask(c);
+		}
+	}
+
+	rotate(d.q, d.prev, d.prev2, &d.sinceKey, fr.key);
+	d.current = i;
+	return true;
+}
+
+/**
+ * @brief Decode a frame, by boid id.
+ *
+ * The next frame after the last one read costs one frame; any other
+ * decodes forward from the keyframe before it.
+ *
+ * @param d
+ * @param frame index, see decoder_find
+ * @param x
+ * @param y
+ * @param vx
+ * @param vy
+ * @return false if the file is damaged there
+ */
+bool boids::decoder_read(boids::Decoder &d, int frame, float *x, float *y, float *vx, float *vy)
+{
+	int from = frame;
+
+	if (frame < 0 || frame >= (int)d.index.size())
+		return false;
+
+	if (frame == d.current)
+		from = frame + 1;
+	else if (d.current < 0 || frame != d.current + 1 || d.index[frame].key)
+	{
+		while (from > 0 && !d.index[from].key)
+			from--;
+		if (!d.index[from].key)
+			return false;
+	}
+	else
+		from = d.current + 1;
+
+	for (int i = from; i <= frame; i++)
+	{
+		if (!decode_frame(d, i))
+		{
+			d.current = -1;
+			return false;
+		}
+	}
+
+	dequantize(d.header, d.prev, x, y, vx, vy);
+	return true;
+}
+
+/**
+ * @brief Close the file and release the decoder.
+ *
+ * @param d
+ */
+void boids::decoder_close(boids::Decoder &d)
+{
+	fclose(d.file);
+	free_channels(d.q, d.prev, d.prev2);
+	d.index.clear();
+}
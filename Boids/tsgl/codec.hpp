@@ -0,0 +1,153 @@
+/*
+    Compact, seekable trajectory files (-outputFormat compact, -replay).
+
+    Raw frames cost 16 bytes per boid. Here every value is quantized over
+    its natural range: x and y to 16-bit fixed point over the periodic
+    world (1/64 pixel on a 1024 pixel side), the velocity to a heading
+    angle and a speed of CODEC_VELOCITY_LEVELS steps each (0.09 degrees).
+    Quantized positions wrap modulo 2^16 exactly like boids wrap around
+    the world, and angles wrap modulo a turn, so all differences below are
+    taken modulo the range of their channel.
+
+    Every keyEvery-th frame is a keyframe holding the four uint16 arrays
+    as they are. Each frame in between stores, per boid and value, the
+    residual against a prediction from the previous frames:
+
+      angle, speed  linear extrapolation from the two previous frames
+                    (plain delta right after a keyframe)
+      x, y          the previous position moved by this frame's velocity,
+                    which is decoded first, for the steps since that frame;
+                    exact but for rounding when every step is written
+
+    The residuals are zigzag-mapped and bit-packed in blocks of
+    CODEC_BLOCK, each at the width of its largest residual, so a block of
+    boids that fly as predicted costs a few bits per value. Prediction
+    runs on the quantized values, so decoding is exact up to the
+    quantization and does not drift.
+
+    File layout (native byte order):
+
+        CodecHeader
+        frames: CodecFrame, then its payload of bytes bytes
+        index: one CodecIndexEntry per frame
+        CodecFooter
+
+    The footer sits at the end of the file, so a reader finds the index
+    with one seek and jumps to any step by decoding at most keyEvery frames
+    from the keyframe before it. A file whose writer died has no footer;
+    the frame headers still carry their lengths, so it can be scanned.
+*/
+#ifndef CODEC_HPP
+#define CODEC_HPP
+
+#include <stdio.h>
+#include <stdint.h>
+#include <vector>
+#include "boids.hpp"
+
+#define CODEC_VERSION 1
+#define CODEC_MAGIC "BOIDSTRZ"
+#define CODEC_INDEX_MAGIC "BOIDSIDX"
+
+/* Residuals per bit width byte. */
+#define CODEC_BLOCK 16
+
+/* Quantization steps of the heading angle and the speed. */
+#define CODEC_VELOCITY_LEVELS 4096
+
+namespace boids {
+
+    /* The quantized channels of a frame, in payload order. */
+    enum CodecChannel
+    {
+        CODEC_ANGLE,
+        CODEC_SPEED,
+        CODEC_X,        // predicted from the two above
+        CODEC_Y,
+        CODEC_CHANNELS
+    };
+
+    struct CodecHeader
+    {
+        char magic[8];
+        uint32_t version;
+        uint32_t num;
+        int32_t width, height;
+        int32_t every;      // steps between frames, as asked for
+        int32_t keyEvery;   // frames between keyframes
+        float speedMax;     // speed of the largest quantized speed
+        float dt;           // of the run, to predict the positions
+    };
+
+    struct CodecFrame
+    {
+        int32_t step;
+        uint32_t bytes;     // of the payload that follows
+        uint32_t key;       // 1 for a keyframe
+    };
+
+    struct CodecIndexEntry
+    {
+        uint64_t offset;    // of the CodecFrame
+        int32_t step;
+        uint32_t key;
+    };
+
+    struct CodecFooter
+    {
+        uint64_t indexOffset;
+        uint64_t frames;
+        char magic[8];
+    };
+
+    /**
+     * @brief The writing side: the quantized previous frames and the index so far.
+     */
+    struct Encoder
+    {
+        CodecHeader header;
+        uint16_t *q[CODEC_CHANNELS];      // this frame
+        uint16_t *prev[CODEC_CHANNELS];   // the one before
+        uint16_t *prev2[CODEC_CHANNELS];  // and the one before that
+        int sinceKey;                     // frames since the last keyframe, -1 before the first
+        int prevStep;                     // step of prev
+        std::vector<uint32_t> residuals;  // of one channel
+        std::vector<uint8_t> payload;
+        std::vector<CodecIndexEntry> index;
+        uint64_t offset;                  // of the next frame in the file
+    };
+
+    /**
+     * @brief The reading side: the file, its index and the last decoded frame.
+     */
+    struct Decoder
+    {
+        FILE *file;
+        CodecHeader header;
+        std::vector<CodecIndexEntry> index;
+        uint16_t *q[CODEC_CHANNELS];
+        uint16_t *prev[CODEC_CHANNELS];
+        uint16_t *prev2[CODEC_CHANNELS];
+        int sinceKey;
+        int current;                      // frame in prev, -1 for none
+        std::vector<uint32_t> residuals;
+        std::vector<uint8_t> payload;
+    };
+
+    bool encoder_open(Encoder &e, FILE *f, struct Params p);
+
+    bool encoder_frame(Encoder &e, FILE *f, int step,
+                       const float *x, const float *y, const float *vx, const float *vy);
+
+    bool encoder_close(Encoder &e, FILE *f);
+
+    bool decoder_open(Decoder &d, const char *path);
+
+    int decoder_find(const Decoder &d, int step);
+
+    bool decoder_read(Decoder &d, int frame, float *x, float *y, float *vx, float *vy);
+
+    void decoder_close(Decoder &d);
+
+}
+#endif
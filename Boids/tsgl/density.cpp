@@ -0,0 +1,192 @@
+/*
+    The density grid of density.hpp.
+*/
+
+#include <string.h>
+#include <math.h>
+#include <omp.h>
+#include "misc.h"
+#include "boids.hpp"
+#include "density.hpp"
+
+
+/**
+ * @brief Red, green and blue of a hue, saturation and value, all in [0, 1].
+ */
+static void hsv_to_rgb(float h, float s, float v, float *rgb)
+{
+	float f = 6 * (h - floorf(h));
+	int sector = (int)f % 6;
+	float p = v * (1 - s), q = v * (1 - s * (f - floorf(f))), t = v * (1 - s * (1 - (f - floorf(f))));
+
+	switch (sector)
+	{
+	case 0: rgb[0] = v; rgb[1] = t; rgb[2] = p; break;
+	case 1: rgb[0] = q; rgb[1] = v; rgb[2] = p; break;
+	case 2: rgb[0] = p; rgb[1] = v; rgb[2] = t; break;
+	case 3: rgb[0] = p; rgb[1] = q; rgb[2] = v; break;
+	case 4: rgb[0] = t; rgb[1] = p; rgb[2] = v; break;
+	default: rgb[0] = v; rgb[1] = p; rgb[2] = q; break;
+	}
+}
+
+/**
+ * @brief Allocate a grid of cell x cell pixel cells over the world.
+ *
+ * @param d
+ * @param p the world is p.width x p.height, splats use p.threads threads
+ * @param cell
+ */
+void boids::density_init(boids::Density &d, struct boids::Params p, int cell)
+{
+	d.cell = MAX(1, cell);
+	d.cols = (p.width + d.cell - 1) / d.cell;
+	d.rows = (p.height + d.cell - 1) / d.cell;
+	#if defined(OMP)
+	d.threads = MAX(1, p.threads);
+	#else
+	d.threads = 1;
+	#endif
+
+	size_t cells = (size_t)d.cols * d.rows;
+	d.count = new float[cells]();
+	d.hx = new float[cells]();
+	d.hy = new float[cells]();
+	d.partial = new float[3 * cells * d.threads];
+	d.max = 0;
+}
+
+/**
+ * @brief Count the boids and sum their headings in every cell.
+ *
+ * @param d
+ * @param p
+ * @param x positions, any order
+ * @param y
+ * @param vx velocities, in the same order
+ * @param vy
+ */
+void boids::density_splat(
+	boids::Density &d, struct boids::Params p,
+	const float *x, const float *y, const float *vx, const float *vy)
+{
+	int cells = d.cols * d.rows;
+	float max = 0;
+
+	#if defined(OMP)
+	#pragma omp parallel num_threads(d.threads)
+	#endif
+	{
+		// The team may be smaller than asked for; only its copies are written
+		int team = omp_get_num_threads();
+		float *count = &d.partial[(size_t)omp_get_thread_num() * 3 * cells];
+		float *hx = count + cells, *hy = hx + cells;
+
+		memset(count, 0, 3 * cells * sizeof(float));
+
+		#if defined(OMP)
+		#pragma omp for schedule(static)
+		#endif
+		for (int i = 0; i < p.num; i++)
+		{
+			int col = MIN(MAX((int)((x[i] + p.width / 2) / d.cell), 0), d.cols - 1);
+			int row = MIN(MAX((int)((y[i] + p.height / 2) / d.cell), 0), d.rows - 1);
+			int c = row * d.cols + col;
+			float speed = LEN(vx[i], vy[i]);
+
+			count[c] += 1;
+			if (speed > 0)
+			{
+				hx[c] += vx[i] / speed;
+				hy[c] += vy[i] / speed;
+			}
+		}
+
+		// The implied barrier above leaves every copy complete
+		#if defined(OMP)
+		#pragma omp for schedule(static) reduction(max : max)
+		#endif
+		for (int c = 0; c < cells; c++)
+		{
+			float n = 0, sx = 0, sy = 0;
+
+			for (int t = 0; t < team; t++)
+			{
+				const float *part = &d.partial[(size_t)t * 3 * cells];
+
+				n += part[c];
+				sx += part[cells + c];
+				sy += part[2 * cells + c];
+			}
+			d.count[c] = n;
+			d.hx[c] = sx;
+			d.hy[c] = sy;
+			max = MAX(max, n);
+		}
+	}
+	d.max = max;
+}
+
+/**
+ * @brief Write the color of every cell, as shaded by density.hpp.
+ *
+ * Empty cells are transparent.
+ *
+ * @param d after density_splat
+ * @param p
+ * @param heading hue from the mean heading, else white
+ * @param rgba 4 floats per color, cell by cell in row-major order from the
+ *        bottom left, each repeated repeat times (e.g. once per vertex)
+ * @param repeat
+ */
+void boids::density_shade(const boids::Density &d, struct boids::Params p, bool heading, float *rgba, int repeat)
+{
+	int cells = d.cols * d.rows;
+	float scale = (d.max > 0) ? 1 / log1pf(d.max) : 0;
+
+	#if defined(OMP)
+	#pragma omp parallel for schedule(static) num_threads(d.threads)
+	#endif
+	for (int c = 0; c < cells; c++)
+	{
+		float rgb[3] = {0, 0, 0}, alpha = 0;
+
+		if (d.count[c] > 0)
+		{
+			float v = log1pf(d.count[c]) * scale;
+
+			if (heading)
+			{
+				float h = atan2f(d.hy[c], d.hx[c]) / (2 * M_PI) + 0.5f;
+				float s = LEN(d.hx[c], d.hy[c]) / d.count[c];
+				hsv_to_rgb(h, MIN(s, 1.0f), v, rgb);
+			}
+			else
+				rgb[0] = rgb[1] = rgb[2] = v;
+			alpha = 1;
+		}
+
+		for (int k = 0; k < repeat; k++)
+		{
+			float *out = &rgba[4 * ((size_t)c * repeat + k)];
+
+			out[0] = rgb[0];
+			out[1] = rgb[1];
+			out[2] = rgb[2];
+			out[3] = alpha;
+		}
+	}
+}
+
+/**
+ * @brief Free the grid.
+ *
+ * @param d
+ */
+void boids::density_free(boids::Density &d)
+{
+	delete[] d.count;
+	delete[] d.hx;
+	delete[] d.hy;
+	delete[] d.partial;
+}
@@ -0,0 +1,43 @@
+/*
+    Boid density on a coarse grid, the far level of detail of the canvas.
+
+    Past a few ten thousand boids the triangles on the canvas overlap into
+    noise, and writing them costs more than the simulation. The density
+    instead splats every boid into a cell of cell x cell pixels and shades
+    each cell once: brighter for more boids (on a log scale, relative to
+    the densest cell), and with -lodHeading its hue from the mean heading
+    of the boids in it, saturated where they fly the same way.
+
+    Splatting is a parallel histogram: each thread counts into its own
+    copy of the grid, then the copies are summed cell by cell, so there are
+    no atomics on the cells a dense flock keeps hitting.
+*/
+#ifndef DENSITY_HPP
+#define DENSITY_HPP
+
+#include "boids.hpp"
+
+namespace boids {
+
+    struct Density
+    {
+        int cols, rows;
+        int cell;       // pixels per cell side
+        int threads;    // copies in partial, at most this many are used
+        float *count;   // boids per cell
+        float *hx, *hy; // their summed unit headings
+        float *partial; // per thread: count, hx and hy of every cell
+        float max;      // largest count of the last splat
+    };
+
+    void density_init(Density &d, struct Params p, int cell);
+
+    void density_splat(Density &d, struct Params p,
+                       const float *x, const float *y, const float *vx, const float *vy);
+
+    void density_shade(const Density &d, struct Params p, bool heading, float *rgba, int repeat);
+
+    void density_free(Density &d);
+
+}
+#endif
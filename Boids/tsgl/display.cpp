@@ -0,0 +1,146 @@
+/*
+    The triple buffer of display.hpp.
+*/
+
+#include <stdio.h>
+#include <omp.h>
+#include "misc.h"
+#include "boids.hpp"
+#include "latency.hpp"
+#include "display.hpp"
+
+
+/**
+ * @brief Allocate the three frames, none of them fresh.
+ *
+ * @param d
+ * @param p frames of p.num boids
+ */
+void boids::display_init(boids::Display &d, struct boids::Params p)
+{
+	for (int k = 0; k < 3; k++)
+	{
+		boids::TrajectoryFrame &f = d.frames[k];
+
+		f.step = -1;
+		f.x = new float[p.num];
+		f.y = new float[p.num];
+		f.vx = new float[p.num];
+		f.vy = new float[p.num];
+		d.owners[k] = new int[p.num]();
+	}
+	d.front = 0;
+	d.middle = 1;
+	d.back = 2;
+
+	d.published = d.overwritten = d.drawn = 0;
+	boids::histogram_clear(d.draw);
+}
+
+/**
+ * @brief Copy the current state into the back frame and make it the fresh one.
+ *
+ * Simulation thread only. The copy splits the slots over the threads like
+ * the kernels' loops do, so the thread that copies a boid is the one that
+ * computed it (for the backends with the default static split); it is
+ * kept as the boid's owner for the canvas's per-thread colors.
+ *
+ * @param d
+ * @param p p.step is the step of the state
+ * @param ids stable id of the boid in each slot
+ * @param xp
+ * @param yp
+ * @param xv
+ * @param yv
+ */
+void boids::display_publish(
+	boids::Display &d, struct boids::Params p, const int *ids,
+	const float *xp, const float *yp, const float *xv, const float *yv)
+{
+	boids::TrajectoryFrame &frame = d.frames[d.back];
+	int *owner = d.owners[d.back];
+	frame.step = p.step;
+
+	#if defined(OMP)
+	#pragma omp parallel for num_threads(p.threads)
+	#endif
+	for (int i = 0; i < p.num; i++)
+	{
+		frame.x[ids[i]] = xp[i];
+		frame.y[ids[i]] = yp[i];
+		frame.vx[ids[i]] = xv[i];
+		frame.vy[ids[i]] = yv[i];
+		#if defined(OMP)
+		owner[ids[i]] = omp_get_thread_num();
+		#endif
+	}
+
+	// Release the writes above with the frame; acquire the one handed back,
+	// which the canvas may have been reading until it swapped it out
+	int old = d.middle.exchange(d.back | DISPLAY_FRESH, std::memory_order_acq_rel);
+	d.back = old & ~DISPLAY_FRESH;
+	d.published++;
+	if (old & DISPLAY_FRESH)
+		d.overwritten++;
+}
+
+/**
+ * @brief The latest published frame, or NULL if it was already taken.
+ *
+ * Canvas thread only. The frame stays valid until the next call.
+ *
+ * @param d
+ */
+const boids::TrajectoryFrame *boids::display_take(boids::Display &d)
+{
+	// Only this thread clears the bit, so a fresh frame stays fresh until
+	// the exchange, which picks up anything published meanwhile
+	if (!(d.middle.load(std::memory_order_relaxed) & DISPLAY_FRESH))
+		return NULL;
+
+	d.front = d.middle.exchange(d.front, std::memory_order_acq_rel) & ~DISPLAY_FRESH;
+	d.drawn++;
+	return &d.frames[d.front];
+}
+
+/**
+ * @brief Simulation thread of each boid of the frame display_take returned,
+ * or NULL if the simulation does not run on OpenMP threads.
+ *
+ * Canvas thread only, with the same lifetime as that frame.
+ *
+ * @param d
+ */
+const int *boids::display_owners(const boids::Display &d)
+{
+	#if defined(OMP)
+	return d.owners[d.front];
+	#else
+	return NULL;
+	#endif
+}
+
+/**
+ * @brief Report how many steps the canvas kept up with, and free the frames.
+ *
+ * @param d
+ */
+void boids::display_free(boids::Display &d)
+{
+	fprintf(stderr, "Display: drew %ld of %ld published steps, %ld overwritten before the canvas took them\n",
+			d.drawn, d.published, d.overwritten);
+	if (d.draw.samples > 0)
+		fprintf(stderr, "\tupdating the drawables took p50 %.3f, p90 %.3f, p99 %.3f, p99.9 %.3f, max %.3f ms per frame\n",
+				1e3 * boids::histogram_percentile(d.draw, 0.5), 1e3 * boids::histogram_percentile(d.draw, 0.9),
+				1e3 * boids::histogram_percentile(d.draw, 0.99), 1e3 * boids::histogram_percentile(d.draw, 0.999),
+				1e3 * d.draw.max * 1e-9);
+
+	for (int k = 0; k < 3; k++)
+	{
+		delete[] d.frames[k].x;
+		delete[] d.frames[k].y;
+		delete[] d.frames[k].vx;
+		delete[] d.frames[k].vy;
+		delete[] d.owners[k];
+	}
+}
@@ -0,0 +1,58 @@
+/*
+    Handing finished steps from the simulation thread to the canvas.
+
+    The simulation runs on its own thread, as fast as its backend goes,
+    and the canvas draws at display rate. They share a triple buffer of
+    frames: the simulation fills its back frame (in parallel, reordered
+    to boid id order) and swaps it with the middle one in one atomic
+    exchange; the canvas swaps its front frame with the middle one
+    whenever that holds a frame it has not drawn yet. Neither side ever
+    waits for the other, and the canvas always gets the latest step; the
+    ones it was too slow for are simply overwritten in the middle.
+*/
+#ifndef DISPLAY_HPP
+#define DISPLAY_HPP
+
+#include <atomic>
+#include "boids.hpp"
+#include "latency.hpp"
+#include "trajectory.hpp"
+
+/* Bit of Display::middle: the frame there has not been taken yet. */
+#define DISPLAY_FRESH 4
+
+namespace boids {
+
+    /**
+     * @brief The three frames and which side owns which.
+     *
+     * back belongs to the simulation thread and front to the canvas; the
+     * middle frame's index (with DISPLAY_FRESH) is the only shared word.
+     */
+    struct Display
+    {
+        TrajectoryFrame frames[3];
+        int *owners[3];                // simulation thread of each boid of the frame
+        int back;
+        int front;
+        std::atomic<int> middle;
+
+        // Statistics, reported by display_free
+        long published, overwritten;   // of the simulation thread
+        long drawn;                    // of the canvas
+        Histogram draw;                // time to update the drawables per frame
+    };
+
+    void display_init(Display &d, struct Params p);
+
+    void display_publish(Display &d, struct Params p, const int *ids,
+                         const float *xp, const float *yp, const float *xv, const float *yv);
+
+    const TrajectoryFrame *display_take(Display &d);
+
+    const int *display_owners(const Display &d);
+
+    void display_free(Display &d);
+
+}
+#endif
@@ -0,0 +1,470 @@
+/*
+    Uniform-grid neighbor search for the boids.
+
+    The brute-force boids::compute_new_headings compares every boid with
+    every other boid over nine periodic images. Here the wrapped world is cut
+    into cells at least as wide as the largest rule radius, the boids are
+    counting-sorted into those cells, and each boid only looks at its own
+    cell and the eight cells around it (wrapping at the borders). The rules
+    themselves are the same ones in rules.hpp, so the headings match the
+    brute-force ones up to float rounding.
+*/
+
+#include <cmath>
+#include <stdio.h>
+#include <stdlib.h>
+#include <omp.h>
+#include "misc.h"
+#include "boids.hpp"
+#include "rules.hpp"
+#include "grid.hpp"
+#include "balance.hpp"
+#include "prof.hpp"
+
+
+/**
+ * @brief Size the grid for the world and rule radii in p and allocate it.
+ *
+ * @param p
+ * @param g
+ * @param cell smallest allowed cell size, 0 for the largest rule radius
+ */
+void boids::grid_init(struct boids::Params p, boids::Grid &g, float cell)
+{
+	float maxr = (cell > 0) ? cell : rule_consts(p).maxr;
+
+	/* With every radius 0 no boid reaches another, so cells of one pixel do;
+	 * this also keeps p.width / maxr a finite int.
+	 */
+	maxr = MAX(maxr, 1.0f);
+
+	g.ncx = MAX(1, (int)(p.width / maxr));
+	g.ncy = MAX(1, (int)(p.height / maxr));
+	g.cw = (float)p.width / g.ncx;
+	g.ch = (float)p.height / g.ncy;
+
+	#if defined(OMP)
+	g.threads = MAX(1, p.threads);
+	#else
+	g.threads = 1;
+	#endif
+
+	g.cellStart = new int[g.ncx * g.ncy + 1];
+	g.cellBoids = new int[p.num];
+	g.boidCell = new int[p.num];
+	g.counts = new int[(size_t)g.ncx * g.ncy * g.threads];
+	g.blockSums = new int[g.threads];
+
+	g.ftmp = new float[p.num];
+	g.itmp = new int[p.num];
+}
+
+/**
+ * @brief Release the memory of a grid made by grid_init.
+ *
+ * @param g
+ */
+void boids::grid_free(boids::Grid &g)
+{
+	delete[] g.cellStart;
+	delete[] g.cellBoids;
+	delete[] g.boidCell;
+	delete[] g.counts;
+	delete[] g.blockSums;
+	delete[] g.ftmp;
+	delete[] g.itmp;
+	g.cellStart = g.cellBoids = g.boidCell = g.counts = g.blockSums = g.itmp = NULL;
+	g.ftmp = NULL;
+}
+
+/**
+ * @brief Counting-sort the boids into the cells of the grid.
+ *
+ * Must be called whenever positions have changed, before
+ * compute_new_headings_grid.
+ *
+ * Every pass is parallel: each thread bins a static block of the boids
+ * into its own histogram, the histograms are turned into each thread's
+ * offset within every cell, the cell totals are prefix-summed in blocks of
+ * cells, and each thread scatters its block after the boids of the threads
+ * before it. The boids of a cell therefore stay in index order, as with a
+ * serial counting sort, for any number of threads.
+ *
+ * @param p
+ * @param g
+ * @param xp
+ * @param yp
+ */
+void boids::grid_build(struct boids::Params p, boids::Grid &g, float *xp, float *yp)
+{
+	int ncells = g.ncx * g.ncy;
+
+	#if defined(OMP)
+	#pragma omp parallel shared(xp, yp, g) num_threads(g.threads)
+	#endif
+	{
+		// The team may be smaller than asked for; only its histograms are used
+		#if defined(OMP)
+		int team = omp_get_num_threads(), t = omp_get_thread_num();
+		#else
+		int team = 1, t = 0;
+		#endif
+		int *count = &g.counts[(size_t)t * ncells];
+		int begin = (int)((long)p.num * t / team), end = (int)((long)p.num * (t + 1) / team);
+		int cbegin = (int)((long)ncells * t / team), cend = (int)((long)ncells * (t + 1) / team);
+
+		/* Histogram of this thread's boids. */
+		for (int c = 0; c < ncells; c++)
+			count[c] = 0;
+		for (int i = begin; i < end; i++)
+		{
+			int cx = (int)((xp[i] + p.width / 2) / g.cw);
+			int cy = (int)((yp[i] + p.height / 2) / g.ch);
+			cx = MIN(MAX(cx, 0), g.ncx - 1);
+			cy = MIN(MAX(cy, 0), g.ncy - 1);
+			g.boidCell[i] = cy * g.ncx + cx;
+			count[g.boidCell[i]]++;
+		}
+		#if defined(OMP)
+		#pragma omp barrier
+		#endif
+
+		/* Per cell, where each thread's boids start within it, and the
+		 * cell's total in cellStart until the prefix sum below.
+		 */
+		for (int c = cbegin; c < cend; c++)
+		{
+			int sum = 0;
+
+			for (int u = 0; u < team; u++)
+			{
+				int n = g.counts[(size_t)u * ncells + c];
+				g.counts[(size_t)u * ncells + c] = sum;
+				sum += n;
+			}
+			g.cellStart[c] = sum;
+		}
+
+		/* Exclusive prefix sum of the cell totals: each thread sums its
+		 * block of cells, then offsets it by the blocks before it.
+		 */
+		int total = 0;
+		for (int c = cbegin; c < cend; c++)
+			total += g.cellStart[c];
+		g.blockSums[t] = total;
+		#if defined(OMP)
+		#pragma omp barrier
+		#endif
+
+		int offset = 0;
+		for (int u = 0; u < t; u++)
+			offset += g.blockSums[u];
+		for (int c = cbegin; c < cend; c++)
+		{
+			int n = g.cellStart[c];
+			g.cellStart[c] = offset;
+			offset += n;
+		}
+		#if defined(OMP)
+		#pragma omp barrier
+		#endif
+
+		/* Scatter this thread's boids. */
+		for (int i = begin; i < end; i++)
+		{
+			int c = g.boidCell[i];
+			g.cellBoids[g.cellStart[c] + count[c]++] = i;
+		}
+	}
+	g.cellStart[ncells] = p.num;
+}
+
+/**
+ * @brief Gather one array into cell order, then trade it with the scratch buffer.
+ *
+ * Afterwards *arr holds the sorted values and tmp holds the old buffer,
+ * which is the same size and becomes the scratch for the next array.
+ */
+template <typename T>
+static void gather_swap(struct boids::Params p, const int *order, T **arr, T **tmp)
+{
+	T *src = *arr;
+	T *dst = *tmp;
+
+	#if defined(OMP)
+	#pragma omp parallel for shared(src, dst, order) num_threads(p.threads)
+	#endif
+	for (int k = 0; k < p.num; k++)
+		dst[k] = src[order[k]];
+
+	*tmp = src;
+	*arr = dst;
+}
+
+/**
+ * @brief Reorder the boid state arrays so boids in the same cell are
+ * adjacent in memory.
+ *
+ * The order is the one counting sort left in g.cellBoids by grid_build, so
+ * this must follow a grid_build on the current positions. Afterwards the
+ * grid describes the reordered arrays and can be used straight away.
+ *
+ * The array pointers are swapped with the grid's scratch buffers rather
+ * than copied back. ids[k] keeps the original index of the boid now in
+ * slot k, so drawables and output can keep using stable boid IDs. The
+ * new velocities are not reordered: every heading kernel overwrites them.
+ *
+ * @param p
+ * @param g
+ * @param ids
+ * @param xp
+ * @param yp
+ * @param xv
+ * @param yv
+ */
+void boids::grid_reorder(
+	struct boids::Params p, boids::Grid &g, int **ids,
+	float **xp, float **yp,
+	float **xv, float **yv)
+{
+	const int *order = g.cellBoids;
+
+	gather_swap(p, order, xp, &g.ftmp);
+	gather_swap(p, order, yp, &g.ftmp);
+	gather_swap(p, order, xv, &g.ftmp);
+	gather_swap(p, order, yv, &g.ftmp);
+	gather_swap(p, order, ids, &g.itmp);
+	gather_swap(p, order, &g.boidCell, &g.itmp);
+
+	/* g.itmp now holds the old boidCell and is free to become the new
+	 * identity cell list; cellStart is unchanged by the reordering.
+	 */
+	int *identity = g.itmp;
+	g.itmp = g.cellBoids;
+	g.cellBoids = identity;
+
+	#if defined(OMP)
+	#pragma omp parallel for shared(g) num_threads(p.threads)
+	#endif
+	for (int k = 0; k < p.num; k++)
+		g.cellBoids[k] = k;
+}
+
+/**
+ * @brief compute_new_headings_grid for one rule mask and precision.
+ */
+template <unsigned RULES, typename Real>
+struct GridKernel
+{
+	/**
+	 * @brief Fused step of boid(which).
+	 *
+	 * @return the number of candidates tested, the work done for this boid
+	 */
+	#if defined(MC) || defined(GPU)
+	#pragma acc routine seq
+	#endif
+	static inline int heading(
+		const boids::Params &p, const boids::RuleConsts &c, const boids::Grid &g,
+		int which, const int *ids,
+		float *xp, float *yp,
+		float *xv, float *yv,
+		float *xnv, float *ynv,
+		float *xnp, float *ynp)
+	{
+		boids::Accum<Real> a = {0, 0, 0, 0, 0, 0, 0, 0, 0};
+		int cell = g.boidCell[which];
+		int cx = cell % g.ncx;
+		int cy = cell / g.ncx;
+		int tested = 0;
+
+		/* With fewer than three cells along an axis the 3x3 stencil would
+		 * visit a cell twice, so just visit every cell of that axis once.
+		 */
+		int spanx = MIN(g.ncx, 3);
+		int spany = MIN(g.ncy, 3);
+
+		for (int oy = 0; oy < spany; oy++)
+		{
+			int row = (g.ncy < 3) ? oy : (cy - 1 + oy + g.ncy) % g.ncy;
+
+			for (int ox = 0; ox < spanx; ox++)
+			{
+				int col = (g.ncx < 3) ? ox : (cx - 1 + ox + g.ncx) % g.ncx;
+				int nc = row * g.ncx + col;
+
+				tested += g.cellStart[nc + 1] - g.cellStart[nc];
+
+				for (int k = g.cellStart[nc]; k < g.cellStart[nc + 1]; k++)
+				{
+					int i = g.cellBoids[k];
+					Real dx, dy, dist;
+
+					if (i == which)
+						continue;
+
+					dx = boids::min_image(xp[i] - xp[which], p.width);
+					dy = boids::min_image(yp[i] - yp[which], p.height);
+					dist = LEN(dx, dy);
+					if (dist > c.maxr)
+						continue;
+
+					boids::accumulate_pair<RULES, Real>(p, c, a, dx, dy, dist,
+							xv[which], yv[which], xv[i], yv[i]);
+				}
+			}
+		}
+
+		boids::finish_heading<RULES, Real>(p, a, ids[which], xv[which], yv[which], &xnv[which], &ynv[which]);
+
+		/* With back buffers, also move the boid: one fused pass per step. */
+		if (xnp != NULL)
+			boids::integrate(p, xp[which], yp[which], xnv[which], ynv[which], &xnp[which], &ynp[which]);
+
+		PROF_COUNT(boids::PROF_TESTED, tested);
+		return tested;
+	}
+
+	static void run(
+		struct boids::Params p, boids::Grid &g, const int *ids,
+		float *xp, float *yp,
+		float *xv, float *yv,
+		float *xnv, float *ynv,
+		float *xnp, float *ynp,
+		boids::Balance *b)
+	{
+		boids::RuleConsts c = boids::rule_consts(p);
+
+		#if defined(OMP)
+		if (b != NULL)
+		{
+			boids::balanced_for(p, *b, [&](int which) {
+				return heading(p, c, g, which, ids, xp, yp, xv, yv, xnv, ynv, xnp, ynp);
+			});
+			return;
+		}
+		#endif
+
+		#if defined(PROFILE)
+		if (boids::prof_trace)
+		{
+			boids::traced_for(p, "share", [&](int which) {
+				heading(p, c, g, which, ids, xp, yp, xv, yv, xnv, ynv, xnp, ynp);
+			});
+			return;
+		}
+		#endif
+
+		#if defined(OMP)
+		#pragma omp parallel for collapse(1) shared(ids, xp, yp, xv, yv, xnv, ynv, xnp, ynp, g) num_threads(p.threads)
+		#elif defined(MC)
+		#pragma acc parallel loop independent collapse(1) num_gangs(p.threads)
+		#elif defined(GPU)
+		#pragma acc kernels loop independent collapse(1)
+		#endif
+		for (int which = 0; which < p.num; which++)
+		{
+			heading(p, c, g, which, ids, xp, yp, xv, yv, xnv, ynv, xnp, ynp);
+		}
+	}
+};
+
+/**
+ * @brief Computes the headings for all boids using the cell list.
+ *
+ * Same result as boids::compute_new_headings within float tolerance;
+ * grid_build must have been called for the current positions.
+ *
+ * @param p
+ * @param g
+ * @param ids stable id of the boid in each slot, keys the wrand noise
+ * @param xp
+ * @param yp
+ * @param xv
+ * @param yv
+ * @param xnv
+ * @param ynv
+ * @param xnp back buffer for the new x positions, or NULL to only compute headings
+ * @param ynp back buffer for the new y positions
+ * @param b split the boids by the cost of the last step, or NULL for equal blocks
+ */
+void boids::compute_new_headings_grid(
+	struct boids::Params p, boids::Grid &g, const int *ids,
+	float *xp, float *yp,
+	float *xv, float *yv,
+	float *xnv, float *ynv,
+	float *xnp, float *ynp,
+	boids::Balance *b)
+{
+	boids::select_kernel<GridKernel>(p)(p, g, ids, xp, yp, xv, yv, xnv, ynv, xnp, ynp, b);
+}
+
+/**
+ * @brief Count the pairs within the largest rule radius that
+ * compute_new_headings_grid did not test.
+ *
+ * Walks the same cells as the kernel and checks them against every other
+ * boid, so it costs O(num^2) and is for validation only. Anything but 0
+ * means the grid lost neighbors.
+ *
+ * @param p
+ * @param g as built for the step
+ * @param xp the positions of that step, in the same slots
+ * @param yp
+ */
+long boids::grid_missed(struct boids::Params p, const boids::Grid &g, const float *xp, const float *yp)
+{
+	float maxr = boids::rule_consts(p).maxr;
+	int spanx = MIN(g.ncx, 3);
+	int spany = MIN(g.ncy, 3);
+	long missed = 0;
+
+	#if defined(OMP)
+	#pragma omp parallel reduction(+:missed) num_threads(p.threads)
+	#endif
+	{
+		// The last boid that tested each candidate
+		int *seen = new int[p.num];
+		for (int i = 0; i < p.num; i++)
+			seen[i] = -1;
+
+		#if defined(OMP)
+		#pragma omp for schedule(dynamic, 64)
+		#endif
+		for (int which = 0; which < p.num; which++)
+		{
+			int cell = g.boidCell[which];
+			int cx = cell % g.ncx;
+			int cy = cell / g.ncx;
+
+			for (int oy = 0; oy < spany; oy++)
+			{
+				int row = (g.ncy < 3) ? oy : (cy - 1 + oy + g.ncy) % g.ncy;
+
+				for (int ox = 0; ox < spanx; ox++)
+				{
+					int col = (g.ncx < 3) ? ox : (cx - 1 + ox + g.ncx) % g.ncx;
+					int nc = row * g.ncx + col;
+
+					for (int k = g.cellStart[nc]; k < g.cellStart[nc + 1]; k++)
+						seen[g.cellBoids[k]] = which;
+				}
+			}
+
+			for (int i = 0; i < p.num; i++)
+			{
+				if (i == which || seen[i] == which)
+					continue;
+
+				float dx = boids::min_image(xp[i] - xp[which], p.width);
+				float dy = boids::min_image(yp[i] - yp[which], p.height);
+				if (LEN(dx, dy) <= maxr)
+					missed++;
+			}
+		}
+
+		delete[] seen;
+	}
+
+	return missed;
+}
@@ -0,0 +1,48 @@
+/*
+    Toroidal uniform grid for neighbor search.
+*/
+#ifndef GRID_HPP
+#define GRID_HPP
+
+#include "boids.hpp"
+#include "balance.hpp"
+
+namespace boids {
+
+    /**
+     * @brief A cell list over the wrapped world.
+     *
+     * Cells are at least maxr wide, so every boid a rule can act on lies in
+     * the 3x3 block of cells around the boid. The boids of cell c are
+     * cellBoids[cellStart[c] .. cellStart[c + 1]).
+     */
+    struct Grid
+    {
+        int ncx, ncy;     // number of cells along x and y
+        float cw, ch;     // cell width and height
+        int *cellStart;   // ncx * ncy + 1 offsets into cellBoids
+        int *cellBoids;   // boid indices sorted by cell
+        int *boidCell;    // cell index of each boid
+
+        int threads;      // copies in counts, at most this many are used
+        int *counts;      // per thread: its boids in each cell, then their offset in it
+        int *blockSums;   // per thread: its boids in its block of cells
+
+        float *ftmp;      // p.num scratch floats for grid_reorder
+        int *itmp;        // p.num scratch ints for grid_reorder
+    };
+
+    void grid_init(struct Params p, Grid &g, float cell = 0);
+
+    void grid_free(Grid &g);
+
+    void grid_build(struct Params p, Grid &g, float *xp, float *yp);
+
+    void grid_reorder(struct Params p, Grid &g, int **ids, float **xp, float **yp, float **xv, float **yv);
+
+    long grid_missed(struct Params p, const Grid &g, const float *xp, const float *yp);
+
+    void compute_new_headings_grid(struct Params p, Grid &g, const int* ids, float* xp, float* yp, float* xv, float* yv, float* xnv, float* ynv, float* xnp = NULL, float* ynp = NULL, Balance* b = NULL);
+
+}
+#endif
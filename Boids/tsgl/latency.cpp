@@ -0,0 +1,198 @@
+/*
+    Log-linear latency histograms and their percentile reports.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <initializer_list>
+#include "misc.h"
+#include "boids.hpp"
+#include "latency.hpp"
+
+static const char *partNames[boids::LATENCY_PARTS] = {"step", "simulate", "draw"};
+
+
+/**
+ * @brief Bucket of a latency in nanoseconds.
+ *
+ * Values below LATENCY_SUB_BUCKETS get a bucket each; above, the top
+ * LATENCY_SUB_BITS + 1 bits of the value pick the bucket within its
+ * power of two.
+ */
+static int bucket_of(uint64_t ns)
+{
+	int top, shift;
+
+	if (ns < LATENCY_SUB_BUCKETS)
+		return (int)ns;
+
+	top = 63 - __builtin_clzll(ns);
+	shift = top - LATENCY_SUB_BITS;
+	return ((shift + 1) << LATENCY_SUB_BITS) + (int)((ns >> shift) - LATENCY_SUB_BUCKETS);
+}
+
+/**
+ * @brief Largest latency in nanoseconds that falls into bucket b.
+ */
+static uint64_t bucket_top(int b)
+{
+	int shift;
+
+	if (b < LATENCY_SUB_BUCKETS)
+		return b;
+
+	shift = (b >> LATENCY_SUB_BITS) - 1;
+	return ((uint64_t)((b & (LATENCY_SUB_BUCKETS - 1)) + LATENCY_SUB_BUCKETS + 1) << shift) - 1;
+}
+
+/**
+ * @brief Empty a histogram.
+ *
+ * @param h
+ */
+void boids::histogram_clear(boids::Histogram &h)
+{
+	memset(&h, 0, sizeof(h));
+}
+
+/**
+ * @brief Count one latency.
+ *
+ * @param h
+ * @param seconds
+ */
+void boids::histogram_record(boids::Histogram &h, double seconds)
+{
+	uint64_t ns = (seconds > 0) ? (uint64_t)(seconds * 1e9) : 0;
+
+	h.counts[bucket_of(ns)]++;
+	h.samples++;
+	h.max = MAX(h.max, ns);
+}
+
+/**
+ * @brief The latency below which a fraction q of the samples lie.
+ *
+ * Reported as the top of the bucket holding that sample (never above the
+ * exact maximum), so it may overstate by up to 1 / LATENCY_SUB_BUCKETS.
+ *
+ * @param h
+ * @param q in [0, 1]
+ * @return seconds, 0 for an empty histogram
+ */
+double boids::histogram_percentile(const boids::Histogram &h, double q)
+{
+	long rank = (long)(q * h.samples + 0.5), seen = 0;
+
+	if (h.samples == 0)
+		return 0;
+	rank = MIN(MAX(rank, 1), h.samples);
+
+	for (int b = 0; b < LATENCY_BUCKETS; b++)
+	{
+		seen += h.counts[b];
+		if (seen >= rank)
+			return MIN(bucket_top(b), h.max) * 1e-9;
+	}
+	return h.max * 1e-9;
+}
+
+/**
+ * @brief Start empty.
+ *
+ * @param l
+ * @param every steps between reports of the latest window, 0 for only at exit
+ * @param first the first step that will be recorded (p.step, e.g. after -restart)
+ */
+void boids::latency_init(boids::Latency &l, int every, int first)
+{
+	for (int k = 0; k < LATENCY_PARTS; k++)
+	{
+		histogram_clear(l.run[k]);
+		histogram_clear(l.window[k]);
+	}
+	l.every = every;
+	l.first = first;
+}
+
+/**
+ * @brief Print p50 .. max of each part that has samples.
+ */
+static void print_table(const char *title, const boids::Histogram *h)
+{
+	fprintf(stderr, "%s (ms)\n", title);
+	fprintf(stderr, "\t%-9s %9s %9s %9s %9s %9s\n", "", "p50", "p90", "p99", "p99.9", "max");
+	for (int k = 0; k < boids::LATENCY_PARTS; k++)
+	{
+		if (h[k].samples == 0)
+			continue;
+		fprintf(stderr, "\t%-9s %9.3f %9.3f %9.3f %9.3f %9.3f\n", partNames[k],
+				1e3 * boids::histogram_percentile(h[k], 0.5),
+				1e3 * boids::histogram_percentile(h[k], 0.9),
+				1e3 * boids::histogram_percentile(h[k], 0.99),
+				1e3 * boids::histogram_percentile(h[k], 0.999),
+				1e3 * h[k].max * 1e-9);
+	}
+}
+
+/**
+ * @brief Count one step, and report the window if it is complete.
+ *
+ * Simulation thread only.
+ *
+ * @param l
+ * @param step the step just finished
+ * @param total seconds of the whole step
+ * @param simulate seconds of it spent simulating
+ */
+void boids::latency_record(boids::Latency &l, int step, double total, double simulate)
+{
+	for (Histogram *h : {l.run, l.window})
+	{
+		histogram_record(h[LATENCY_STEP], total);
+		histogram_record(h[LATENCY_SIMULATE], simulate);
+	}
+
+	if (l.every > 0 && step + 1 - l.first >= l.every)
+	{
+		std::lock_guard<std::mutex> guard(l.drawLock);
+		char title[64];
+
+		// The draw window holds the frames drawn while these steps ran
+		snprintf(title, sizeof(title), "Latency of steps %d-%d", l.first, step);
+		print_table(title, l.window);
+		for (int k = 0; k < LATENCY_PARTS; k++)
+			histogram_clear(l.window[k]);
+		l.first = step + 1;
+	}
+}
+
+/**
+ * @brief Count one frame of the canvas.
+ *
+ * Drawer thread only; it runs beside the simulation, so frames are not
+ * tied to steps.
+ *
+ * @param l
+ * @param draw seconds spent updating the drawables
+ */
+void boids::latency_record_draw(boids::Latency &l, double draw)
+{
+	std::lock_guard<std::mutex> guard(l.drawLock);
+
+	histogram_record(l.run[LATENCY_DRAW], draw);
+	histogram_record(l.window[LATENCY_DRAW], draw);
+}
+
+/**
+ * @brief Print the percentiles of the whole run.
+ *
+ * @param l
+ */
+void boids::latency_report(const boids::Latency &l)
+{
+	char title[64];
+
+	snprintf(title, sizeof(title), "Latency of all %ld steps", l.run[LATENCY_STEP].samples);
+	print_table(title, l.run);
+}
@@ -0,0 +1,68 @@
+/*
+    Per-step latency histograms, in constant memory.
+
+    Total runtime hides the slow steps that make the canvas stutter. Each
+    step's latency goes into a log-linear (HDR-style) histogram instead of
+    a list: buckets double in width every power of two of nanoseconds and
+    each power of two is cut into LATENCY_SUB_BUCKETS, so any latency from
+    a nanosecond to hours lands in a bucket within 1 / LATENCY_SUB_BUCKETS
+    of its value, with a fixed LATENCY_BUCKETS counters per histogram.
+*/
+#ifndef LATENCY_HPP
+#define LATENCY_HPP
+
+#include <stdint.h>
+#include <mutex>
+#include "boids.hpp"
+
+/* log2 of the sub-buckets per power of two; 5 keeps values within 3%. */
+#define LATENCY_SUB_BITS 5
+#define LATENCY_SUB_BUCKETS (1 << LATENCY_SUB_BITS)
+#define LATENCY_BUCKETS ((64 - LATENCY_SUB_BITS + 1) * LATENCY_SUB_BUCKETS)
+
+namespace boids {
+
+    struct Histogram
+    {
+        long counts[LATENCY_BUCKETS];
+        long samples;
+        uint64_t max;   // exact, in nanoseconds
+    };
+
+    /* What one step is split into. */
+    enum LatencyPart
+    {
+        LATENCY_STEP,       // the whole step: simulating, publishing, output
+        LATENCY_SIMULATE,   // reorder and the backend's step
+        LATENCY_DRAW,       // updating the drawables for a frame, on the drawer's thread
+        LATENCY_PARTS
+    };
+
+    /**
+     * @brief Histograms of the whole run and of the steps since the last report.
+     */
+    struct Latency
+    {
+        Histogram run[LATENCY_PARTS];
+        Histogram window[LATENCY_PARTS];
+        int every;      // steps between reports, 0 for only at exit
+        int first;      // first step of the window
+        std::mutex drawLock; // guards the LATENCY_DRAW histograms against the report
+    };
+
+    void histogram_clear(Histogram &h);
+
+    void histogram_record(Histogram &h, double seconds);
+
+    double histogram_percentile(const Histogram &h, double q);
+
+    void latency_init(Latency &l, int every, int first);
+
+    void latency_record(Latency &l, int step, double total, double simulate);
+
+    void latency_record_draw(Latency &l, double draw);
+
+    void latency_report(const Latency &l);
+
+}
+#endif
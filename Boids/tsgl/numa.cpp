@@ -0,0 +1,296 @@
+/*
+    NUMA-aware placement for multi-socket runs (Linux).
+
+    Linux puts a page on the node of the thread that first writes it. The
+    state arrays come from new[], which leaves large allocations untouched,
+    so if the serial initialization writes them first every page lands on
+    one socket and half the threads read remote memory for the whole run.
+    first_touch writes each array with the same static block split that the
+    kernels' "omp parallel for" uses, so every thread's boids sit on its own
+    node. That only holds while threads stay put, hence pin_threads.
+
+    The topology comes from sysfs and placement is queried with the
+    move_pages system call, so no libnuma is needed.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <omp.h>
+#include <vector>
+#include "misc.h"
+#include "boids.hpp"
+#include "numa.hpp"
+
+/* CPUs of each node that this process may run on. */
+typedef std::vector<std::vector<int>> Topology;
+
+/* The calling thread's mask before and after pin_threads, for pin_release. */
+static bool pinned = false;
+static cpu_set_t unpinnedSet, pinnedSet;
+
+
+/**
+ * @brief Parse a sysfs CPU list such as "0-3,8-11" into cpus.
+ */
+static void parse_cpulist(const char *s, std::vector<int> &cpus)
+{
+	while (*s)
+	{
+		char *end;
+		int lo = strtol(s, &end, 10), hi = lo;
+
+		if (end == s)
+			break;
+		if (*end == '-')
+			hi = strtol(end + 1, &end, 10);
+		for (int c = lo; c <= hi; c++)
+			cpus.push_back(c);
+		s = (*end == ',') ? end + 1 : end;
+	}
+}
+
+/**
+ * @brief Read the nodes and their CPUs, keeping only CPUs in our affinity mask.
+ *
+ * Falls back to one node holding every allowed CPU when sysfs has no nodes.
+ */
+static Topology read_topology()
+{
+	Topology topo;
+	cpu_set_t allowed;
+	char path[64], line[4096];
+
+	CPU_ZERO(&allowed);
+	sched_getaffinity(0, sizeof(allowed), &allowed);
+
+	for (int node = 0;; node++)
+	{
+		std::vector<int> cpus, usable;
+		FILE *f;
+
+		snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+		if ((f = fopen(path, "r")) == NULL)
+			break;
+		if (fgets(line, sizeof(line), f) != NULL)
+			parse_cpulist(line, cpus);
+		fclose(f);
+
+		for (int c : cpus)
+		{
+			if (CPU_ISSET(c, &allowed))
+				usable.push_back(c);
+		}
+		if (!usable.empty())
+			topo.push_back(usable);
+	}
+
+	if (topo.empty())
+	{
+		std::vector<int> all;
+		for (int c = 0; c < CPU_SETSIZE; c++)
+		{
+			if (CPU_ISSET(c, &allowed))
+				all.push_back(c);
+		}
+		topo.push_back(all);
+	}
+
+	return topo;
+}
+
+/**
+ * @brief Node of a CPU, or -1.
+ */
+static int node_of(const Topology &topo, int cpu)
+{
+	for (size_t n = 0; n < topo.size(); n++)
+	{
+		for (int c : topo[n])
+		{
+			if (c == cpu)
+				return n;
+		}
+	}
+	return -1;
+}
+
+/**
+ * @brief First boid of thread t in an "omp parallel for schedule(static)" over n.
+ */
+static int static_begin(int n, int threads, int t)
+{
+	int q = n / threads, r = n % threads;
+	return t * q + MIN(t, r);
+}
+
+/**
+ * @brief Print the nodes and usable CPUs of this machine.
+ *
+ * @param p
+ */
+void boids::numa_report(struct boids::Params p)
+{
+	Topology topo = read_topology();
+	int cpus = 0;
+
+	for (auto &node : topo)
+		cpus += node.size();
+
+	fprintf(stderr, "NUMA topology: %d node(s), %d usable CPUs, %d threads\n",
+			(int)topo.size(), cpus, p.threads);
+	for (size_t n = 0; n < topo.size(); n++)
+	{
+		fprintf(stderr, "\tnode %d: %d CPUs, first %d last %d\n", (int)n,
+				(int)topo[n].size(), topo[n].front(), topo[n].back());
+	}
+}
+
+/**
+ * @brief Bind each thread of a p.threads team to one CPU, as chosen by p.pin.
+ *
+ * The OpenMP runtime keeps reusing the same threads for teams of this size,
+ * so the binding holds for every later parallel region of the run. Thread 0
+ * is the calling thread, so anything it spawns afterwards inherits its one
+ * CPU; see pin_release.
+ *
+ * @param p
+ */
+void boids::pin_threads(struct boids::Params p)
+{
+	Topology topo = read_topology();
+	std::vector<int> order;
+	std::vector<int> cpuOf(p.threads, -1);
+
+	if (p.pin == PIN_COMPACT)
+	{
+		for (auto &node : topo)
+			order.insert(order.end(), node.begin(), node.end());
+	}
+	else
+	{
+		size_t longest = 0;
+		for (auto &node : topo)
+			longest = MAX(longest, node.size());
+
+		for (size_t k = 0; k < longest; k++)
+		{
+			for (auto &node : topo)
+			{
+				if (k < node.size())
+					order.push_back(node[k]);
+			}
+		}
+	}
+
+	CPU_ZERO(&unpinnedSet);
+	sched_getaffinity(0, sizeof(unpinnedSet), &unpinnedSet);
+
+	#pragma omp parallel num_threads(p.threads)
+	{
+		int t = omp_get_thread_num();
+		cpu_set_t set;
+
+		CPU_ZERO(&set);
+		CPU_SET(order[t % order.size()], &set);
+		if (sched_setaffinity(0, sizeof(set), &set) == 0)
+			cpuOf[t] = sched_getcpu();
+	}
+
+	CPU_ZERO(&pinnedSet);
+	sched_getaffinity(0, sizeof(pinnedSet), &pinnedSet);
+	pinned = true;
+
+	fprintf(stderr, "Pinned threads (%s):", p.pin == PIN_COMPACT ? "compact" : "scatter");
+	for (int t = 0; t < p.threads; t++)
+		fprintf(stderr, " %d->%d/n%d", t, cpuOf[t], node_of(topo, cpuOf[t]));
+	fprintf(stderr, "\n");
+	if ((int)order.size() < p.threads)
+		fprintf(stderr, "More threads than usable CPUs, some share a CPU\n");
+}
+
+/**
+ * @brief Give the calling thread back every CPU it had before pin_threads.
+ *
+ * For the thread that called pin_threads, before it spawns threads that
+ * are not part of the simulation (trajectory writer, drawer, TSGL), which
+ * would otherwise all share the CPU of team thread 0. No-op without -pin.
+ */
+void boids::pin_release()
+{
+	if (pinned)
+		sched_setaffinity(0, sizeof(unpinnedSet), &unpinnedSet);
+}
+
+/**
+ * @brief Pin the calling thread again after pin_release.
+ */
+void boids::pin_restore()
+{
+	if (pinned)
+		sched_setaffinity(0, sizeof(pinnedSet), &pinnedSet);
+}
+
+/**
+ * @brief Write a fresh array with the kernels' static split, placing its pages.
+ *
+ * Must come before anything else writes a (e.g. initiateBoidArrays).
+ *
+ * @param p
+ * @param a
+ * @param n
+ */
+void boids::first_touch(struct boids::Params p, float *a, int n)
+{
+	#pragma omp parallel for schedule(static) num_threads(p.threads)
+	for (int i = 0; i < n; i++)
+		a[i] = 0;
+}
+
+/**
+ * @brief first_touch for an int array.
+ */
+void boids::first_touch(struct boids::Params p, int *a, int n)
+{
+	#pragma omp parallel for schedule(static) num_threads(p.threads)
+	for (int i = 0; i < n; i++)
+		a[i] = 0;
+}
+
+/**
+ * @brief Print the node holding the first page of each thread's block of a.
+ *
+ * @param p
+ * @param name of the array, for the message
+ * @param a
+ * @param n
+ */
+void boids::placement_report(struct boids::Params p, const char *name, float *a, int n)
+{
+	long page = sysconf(_SC_PAGESIZE);
+	std::vector<void *> pages(p.threads);
+	std::vector<int> status(p.threads, -1);
+
+	for (int t = 0; t < p.threads; t++)
+		pages[t] = (void *)((unsigned long)&a[static_begin(n, p.threads, t)] & ~(page - 1));
+
+	/* With no target nodes, move_pages only reports where the pages are. */
+	if (syscall(SYS_move_pages, 0, (unsigned long)p.threads, pages.data(), NULL, status.data(), 0) != 0)
+	{
+		fprintf(stderr, "Placement of %s unavailable\n", name);
+		return;
+	}
+
+	fprintf(stderr, "Placement of %s by thread block:", name);
+	for (int t = 0; t < p.threads; t++)
+	{
+		if (status[t] >= 0)
+			fprintf(stderr, " %d->n%d", t, status[t]);
+		else
+			fprintf(stderr, " %d->?", t);
+	}
+	fprintf(stderr, "\n");
+}
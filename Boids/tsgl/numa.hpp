@@ -0,0 +1,34 @@
+/*
+    NUMA placement of the state arrays and pinning of the OpenMP threads.
+*/
+#ifndef NUMA_HPP
+#define NUMA_HPP
+
+#include "boids.hpp"
+
+namespace boids {
+
+    /* Where pin_threads puts thread t. */
+    enum Pin
+    {
+        PIN_NONE,       // leave placement to the OS (and OMP_PROC_BIND)
+        PIN_COMPACT,    // fill the CPUs of node 0 first, then node 1, ...
+        PIN_SCATTER     // deal the threads round-robin over the nodes
+    };
+
+    void numa_report(struct Params p);
+
+    void pin_threads(struct Params p);
+
+    void pin_release();
+
+    void pin_restore();
+
+    void first_touch(struct Params p, float *a, int n);
+
+    void first_touch(struct Params p, int *a, int n);
+
+    void placement_report(struct Params p, const char *name, float *a, int n);
+
+}
+#endif
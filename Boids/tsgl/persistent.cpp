@@ -0,0 +1,168 @@
+/*
+    Brute-force steps run by one long-lived team of threads.
+
+    Every other kernel opens a fresh "omp parallel for" per step. For small
+    flocks (a few hundred to a thousand boids) a step is only tens of
+    microseconds of arithmetic, so waking the team and joining it again
+    costs as much as the step itself. Here the team is created once for a
+    whole run of steps: each thread owns a fixed block of boids, writes
+    their new state to the back buffers, and meets the others at a spinning
+    barrier before every thread swaps its private copies of the buffer
+    pointers. One barrier per step is enough, because a step only writes the
+    buffers that no thread reads until after the next barrier.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <omp.h>
+#include <atomic>
+#include <thread>
+#include <utility>
+#include "misc.h"
+#include "boids.hpp"
+#include "simd.hpp"
+#include "persistent.hpp"
+#include "prof.hpp"
+
+/* Spins before a waiting thread starts yielding its core. */
+#define BARRIER_SPINS 4096
+
+
+/**
+ * @brief Sense-reversing barrier for the threads of one team.
+ *
+ * Cheaper than waking sleeping threads when the wait is short; after
+ * BARRIER_SPINS polls a waiter yields, so oversubscribed runs still progress.
+ */
+struct SpinBarrier
+{
+	std::atomic<int> waiting;
+	std::atomic<int> sense;
+	int threads;
+
+	SpinBarrier(int threads) : waiting(threads), sense(0), threads(threads)
+	{
+	}
+
+	/**
+	 * @brief Wait until all threads have arrived.
+	 *
+	 * @param local the calling thread's sense, flipped on every call
+	 */
+	void wait(int &local)
+	{
+		local = !local;
+
+		if (waiting.fetch_sub(1, std::memory_order_acq_rel) == 1)
+		{
+			waiting.store(threads, std::memory_order_relaxed);
+			sense.store(local, std::memory_order_release);
+			return;
+		}
+
+		for (int spins = 0; sense.load(std::memory_order_acquire) != local; spins++)
+		{
+			if (spins >= BARRIER_SPINS)
+				std::this_thread::yield();
+		}
+	}
+};
+
+/**
+ * @brief Runs steps brute-force steps with one parallel region.
+ *
+ * Uses the vector kernel of p.simd (as returned by simd_select). With
+ * SIMD_OFF there is no range kernel to share out, so each step runs the
+ * reference loop of boids.cpp, as the simd backend does; the results then
+ * match it bitwise, but every step opens its own parallel region. On
+ * return the pointers have been swapped so that *xp .. *yv hold the state
+ * after the last step, exactly as if each step had been followed by a swap
+ * of the front and back buffers.
+ *
+ * @param p p.step is the time step of the first step run
+ * @param steps number of steps to run
+ * @param ids stable id of the boid in each slot, keys the wrand noise
+ * @param xp
+ * @param yp
+ * @param xv
+ * @param yv
+ * @param xnp
+ * @param ynp
+ * @param xnv
+ * @param ynv
+ */
+void boids::run_persistent(
+	struct boids::Params p, int steps, const int *ids,
+	float **xp, float **yp,
+	float **xv, float **yv,
+	float **xnp, float **ynp,
+	float **xnv, float **ynv)
+{
+	if (p.simd == boids::SIMD_OFF)
+	{
+		for (int step = 0; step < steps; step++)
+		{
+			boids::Params q = p;
+			q.step = p.step + step;
+
+			PROF_BEGIN(heading);
+			boids::compute_new_headings(q, ids, *xp, *yp, *xv, *yv, *xnv, *ynv, *xnp, *ynp);
+			PROF_END(heading, boids::PROF_HEADING);
+
+			std::swap(*xp, *xnp);
+			std::swap(*yp, *ynp);
+			std::swap(*xv, *xnv);
+			std::swap(*yv, *ynv);
+		}
+		return;
+	}
+
+	SpinBarrier barrier(p.threads);
+
+	#pragma omp parallel num_threads(p.threads)
+	{
+		int nt = omp_get_num_threads();
+		int t = omp_get_thread_num();
+		int begin = (int)((long)p.num * t / nt);
+		int end = (int)((long)p.num * (t + 1) / nt);
+		int sense = 0;
+		boids::Params q = p;
+
+		float *x = *xp, *y = *yp, *vx = *xv, *vy = *yv;
+		float *nx = *xnp, *ny = *ynp, *nvx = *xnv, *nvy = *ynv;
+
+		/* The runtime may give us fewer threads than asked for. */
+		#pragma omp single
+		barrier.waiting = barrier.threads = nt;
+
+		for (int step = 0; step < steps; step++)
+		{
+			q.step = p.step + step;
+
+			PROF_BEGIN(heading);
+			boids::compute_new_headings_simd_range(q, q.simd, begin, end, ids, x, y, vx, vy, nvx, nvy, nx, ny);
+			PROF_END(heading, boids::PROF_HEADING);
+
+			PROF_BEGIN(wait);
+			barrier.wait(sense);
+			PROF_END(wait, boids::PROF_WAIT);
+
+			std::swap(x, nx);
+			std::swap(y, ny);
+			std::swap(vx, nvx);
+			std::swap(vy, nvy);
+		}
+
+		#pragma omp single nowait
+		{
+			*xp = x;
+			*yp = y;
+			*xv = vx;
+			*yv = vy;
+			*xnp = nx;
+			*ynp = ny;
+			*xnv = nvx;
+			*ynv = nvy;
+		}
+	}
+}
@@ -0,0 +1,14 @@
+/*
+    Many steps inside one OpenMP parallel region.
+*/
+#ifndef PERSISTENT_HPP
+#define PERSISTENT_HPP
+
+#include "boids.hpp"
+
+namespace boids {
+
+    void run_persistent(struct Params p, int steps, const int *ids, float **xp, float **yp, float **xv, float **yv, float **xnp, float **ynp, float **xnv, float **ynv);
+
+}
+#endif
@@ -0,0 +1,555 @@
+/*
+    Summary and per-step CSV of the prof.hpp timers and counters.
+
+    The counters only ever grow; prof_step turns them into one CSV row per
+    call by remembering the totals it last wrote.
+
+    The hardware counters are one perf_event_open group per thread, led by
+    the cycle counter, so all four events are scheduled on the PMU together
+    and read with one system call. Each thread opens its own group (pid 0
+    is the calling thread), but any thread may read it.
+
+    Trace spans are appended to a vector per thread, which only that thread
+    touches until prof_report writes them all out.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include <vector>
+#include "misc.h"
+#include "boids.hpp"
+#include "prof.hpp"
+
+boids::ProfThread boids::prof_threads[PROF_SLOTS];
+bool boids::prof_perf = false;
+bool boids::prof_trace = false;
+
+const char *const boids::prof_phase_names[boids::PROF_PHASES] = {
+	"reorder", "search", "heading", "wait", "draw", "output"};
+
+static const char *countNames[boids::PROF_COUNTS] = {
+	"tested", "hits", "cent", "copy", "void", "viso", "rebuilds"};
+
+static FILE *csv = NULL;
+static long profSteps = 0;
+static double lastTime[boids::PROF_PHASES];
+static long lastCount[boids::PROF_COUNTS];
+static long lastPerf[boids::PERF_EVENTS];
+
+/* Threads whose counter groups are open. */
+static int perfThreads = 0;
+
+/* One span of a thread's timeline, in seconds of omp_get_wtime. */
+struct TraceSpan
+{
+	const char *name;
+	double begin, end;
+	int step;
+};
+
+/* Spans per thread, padded apart so the appends do not share lines. */
+struct alignas(64) TraceBuffer
+{
+	std::vector<TraceSpan> spans;
+};
+
+static TraceBuffer traceBuffers[PROF_SLOTS];
+static const char *tracePath = NULL;
+static double traceStart;
+static int traceStep = 0;
+
+
+/**
+ * @brief Longest time any thread spent in each phase, the wall time of the phase.
+ *
+ * The drawer only ever has draw time, so it counts like one more thread.
+ */
+static void phase_times(int threads, double *time)
+{
+	for (int ph = 0; ph < boids::PROF_PHASES; ph++)
+	{
+		time[ph] = boids::prof_threads[PROF_DRAWER].time[ph];
+		for (int t = 0; t < threads; t++)
+			time[ph] = MAX(time[ph], boids::prof_threads[t].time[ph]);
+	}
+}
+
+/**
+ * @brief Each counter summed over the threads.
+ */
+static void count_totals(int threads, long *count)
+{
+	for (int k = 0; k < boids::PROF_COUNTS; k++)
+	{
+		count[k] = 0;
+		for (int t = 0; t < threads; t++)
+			count[k] += boids::prof_threads[t].count[k];
+	}
+}
+
+/**
+ * @brief Each hardware event summed over the phases and threads.
+ */
+static void perf_totals(int threads, long *perf)
+{
+	for (int e = 0; e < boids::PERF_EVENTS; e++)
+	{
+		perf[e] = 0;
+		for (int t = 0; t < threads; t++)
+		{
+			for (int ph = 0; ph < boids::PROF_PHASES; ph++)
+				perf[e] += boids::prof_threads[t].perf[ph][e];
+		}
+	}
+}
+
+/**
+ * @brief Open one event of the calling thread, user space only.
+ *
+ * @param config a PERF_COUNT_HW_* event
+ * @param group the group leader, or -1 to open a (disabled) leader
+ * @return the file descriptor, or -1 with errno set
+ */
+static int perf_event(unsigned long long config, int group)
+{
+	struct perf_event_attr a;
+
+	memset(&a, 0, sizeof(a));
+	a.size = sizeof(a);
+	a.type = PERF_TYPE_HARDWARE;
+	a.config = config;
+	a.disabled = (group == -1);
+	a.exclude_kernel = 1;
+	a.exclude_hv = 1;
+	a.read_format = PERF_FORMAT_GROUP;
+
+	return syscall(SYS_perf_event_open, &a, 0, -1, group, 0);
+}
+
+/**
+ * @brief Read the current event counts of one thread's group.
+ */
+static void perf_read(int fd, long *counts)
+{
+	uint64_t buf[1 + boids::PERF_EVENTS];
+
+	if (fd < 0 || read(fd, buf, sizeof(buf)) != sizeof(buf))
+		return;
+	for (int e = 0; e < boids::PERF_EVENTS; e++)
+		counts[e] = buf[1 + e];
+}
+
+/**
+ * @brief Start counting hardware events on every thread of a p.threads team.
+ *
+ * Must run before the first phase, after anything that changes p.threads.
+ *
+ * @param p
+ * @return false (after saying why) if the events cannot be counted here,
+ * e.g. in a VM without a virtual PMU or with perf_event_paranoid above 2
+ */
+bool boids::prof_perf_init(struct boids::Params p)
+{
+	static const unsigned long long events[PERF_EVENTS] = {
+		PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+		PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES};
+	int threads = MIN(MAX(p.threads, 1), PROF_MAX_THREADS);
+	int failed = 0;
+
+	for (int t = 0; t < PROF_MAX_THREADS; t++)
+		prof_threads[t].perfFd = -1;
+
+	#pragma omp parallel num_threads(threads) reduction(max : failed)
+	{
+		ProfThread &self = prof_self();
+		int leader = perf_event(events[0], -1);
+
+		if (leader < 0)
+			failed = errno;
+		else
+		{
+			for (int e = 1; e < PERF_EVENTS; e++)
+			{
+				if (perf_event(events[e], leader) < 0)
+					failed = errno;
+			}
+			ioctl(leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+			self.perfFd = leader;
+		}
+	}
+
+	if (failed)
+	{
+		fprintf(stderr, "Hardware counters unavailable (%s), ignoring -perf\n", strerror(failed));
+		for (int t = 0; t < threads; t++)
+		{
+			if (prof_threads[t].perfFd >= 0)
+				close(prof_threads[t].perfFd);
+			prof_threads[t].perfFd = -1;
+		}
+		return false;
+	}
+
+	perfThreads = threads;
+	prof_perf = true;
+	fprintf(stderr, "Counting cycles, instructions, cache and branch misses on %d threads\n", threads);
+	return true;
+}
+
+/**
+ * @brief Remember the event counts at the start of a phase.
+ *
+ * Outside of a parallel region that is every thread of the team, inside
+ * only the calling thread.
+ */
+void boids::prof_perf_mark()
+{
+	if (omp_in_parallel())
+	{
+		ProfThread &self = prof_self();
+		perf_read(self.perfFd, self.perfMark);
+		return;
+	}
+
+	for (int t = 0; t < perfThreads; t++)
+		perf_read(prof_threads[t].perfFd, prof_threads[t].perfMark);
+}
+
+/**
+ * @brief Charge the events since prof_perf_mark to phase.
+ */
+void boids::prof_perf_add(int phase)
+{
+	int first = 0, last = perfThreads;
+	long now[PERF_EVENTS];
+
+	if (omp_in_parallel())
+	{
+		first = MIN(omp_get_thread_num(), PROF_MAX_THREADS - 1);
+		last = first + 1;
+	}
+
+	for (int t = first; t < last; t++)
+	{
+		ProfThread &th = prof_threads[t];
+
+		memcpy(now, th.perfMark, sizeof(now));
+		perf_read(th.perfFd, now);
+		for (int e = 0; e < PERF_EVENTS; e++)
+			th.perf[phase][e] += now[e] - th.perfMark[e];
+	}
+}
+
+/**
+ * @brief Record spans from now on, to be written to p.trace by prof_report.
+ *
+ * @param p after the backend's init, so that p.threads is final
+ * @return false if the file cannot be written
+ */
+bool boids::prof_trace_open(struct boids::Params p)
+{
+	FILE *f;
+
+	// Fail now rather than after the run
+	if ((f = fopen(p.trace, "w")) == NULL)
+		return false;
+	fclose(f);
+
+	// Only the team's and the drawer's buffers fill up; the others grow if
+	// ever used
+	for (int t = 0; t < MIN(p.threads, PROF_MAX_THREADS); t++)
+		traceBuffers[t].spans.reserve(1024);
+	traceBuffers[PROF_DRAWER].spans.reserve(1024);
+
+	tracePath = p.trace;
+	traceStart = omp_get_wtime();
+	prof_trace = true;
+	return true;
+}
+
+/**
+ * @brief Append a span to the calling thread's timeline.
+ *
+ * @param name a string that lives until prof_report
+ * @param begin omp_get_wtime at its start
+ * @param end omp_get_wtime at its end
+ */
+void boids::prof_trace_span(const char *name, double begin, double end)
+{
+	int t = MIN(omp_get_thread_num(), PROF_MAX_THREADS - 1);
+
+	traceBuffers[t].spans.push_back({name, begin, end, traceStep});
+}
+
+/**
+ * @brief Charge a frame of the live canvas to PROF_DRAW, and trace it.
+ *
+ * Drawer thread only. It has a slot of its own, since its OpenMP thread
+ * number is 0 like the simulation's, and no hardware counters.
+ *
+ * @param step the step the frame shows
+ * @param begin omp_get_wtime at its start
+ * @param end omp_get_wtime at its end
+ */
+void boids::prof_draw(int step, double begin, double end)
+{
+	prof_threads[PROF_DRAWER].time[PROF_DRAW] += end - begin;
+	if (prof_trace)
+		traceBuffers[PROF_DRAWER].spans.push_back({prof_phase_names[PROF_DRAW], begin, end, step});
+}
+
+/**
+ * @brief Write every recorded span as Chrome trace events and free them.
+ */
+static void trace_write(struct boids::Params p)
+{
+	FILE *f = fopen(tracePath, "w");
+	long spans = 0;
+
+	if (f == NULL)
+	{
+		fprintf(stderr, "Cannot write %s\n", tracePath);
+		return;
+	}
+
+	fprintf(f, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+	fprintf(f, "{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": 0, "
+			   "\"args\": {\"name\": \"boids, %d boids, %d threads\"}}", p.num, p.threads);
+
+	for (int t = 0; t < PROF_SLOTS; t++)
+	{
+		std::vector<TraceSpan> &v = traceBuffers[t].spans;
+		char name[32];
+
+		if (v.empty())
+			continue;
+
+		if (t == PROF_DRAWER)
+			snprintf(name, sizeof(name), "drawer");
+		else
+			snprintf(name, sizeof(name), "thread %d", t);
+		fprintf(f, ",\n{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %d, "
+				   "\"args\": {\"name\": \"%s\"}}", t, name);
+
+		// Complete events: a begin and a duration, in microseconds
+		for (const TraceSpan &s : v)
+		{
+			fprintf(f, ",\n{\"name\": \"%s\", \"ph\": \"X\", \"pid\": 1, \"tid\": %d, "
+					   "\"ts\": %.3f, \"dur\": %.3f, \"args\": {\"step\": %d}}",
+					s.name, t, 1e6 * (s.begin - traceStart), 1e6 * (s.end - s.begin), s.step);
+		}
+		spans += v.size();
+		std::vector<TraceSpan>().swap(v);
+	}
+
+	fprintf(f, "\n]}\n");
+	fclose(f);
+	fprintf(stderr, "Wrote %ld trace spans to %s\n", spans, tracePath);
+}
+
+/**
+ * @brief Start writing a per-step CSV to path.
+ *
+ * @param path
+ * @return false if the file cannot be written
+ */
+bool boids::prof_open(const char *path)
+{
+	if ((csv = fopen(path, "w")) == NULL)
+		return false;
+
+	fprintf(csv, "step,steps");
+	for (int ph = 0; ph < PROF_PHASES; ph++)
+		fprintf(csv, ",%s_s", boids::prof_phase_names[ph]);
+	for (int k = 0; k < PROF_COUNTS; k++)
+		fprintf(csv, ",%s", countNames[k]);
+	fprintf(csv, ",cycles,instructions,cache_misses,branch_misses\n");
+	return true;
+}
+
+/**
+ * @brief Close the last steps steps, writing their CSV row if one was asked for.
+ *
+ * Must be called from serial code, after the step's parallel regions.
+ *
+ * @param p p.step is the step after the last one closed
+ * @param steps
+ */
+void boids::prof_step(struct boids::Params p, int steps)
+{
+	int threads = MIN(MAX(p.threads, 1), PROF_MAX_THREADS);
+	double time[PROF_PHASES];
+	long count[PROF_COUNTS], perf[PERF_EVENTS];
+
+	profSteps += steps;
+	traceStep = p.step;
+	if (csv == NULL)
+		return;
+
+	phase_times(threads, time);
+	count_totals(threads, count);
+	perf_totals(threads, perf);
+
+	fprintf(csv, "%d,%d", p.step - steps, steps);
+	for (int ph = 0; ph < PROF_PHASES; ph++)
+		fprintf(csv, ",%.9f", time[ph] - lastTime[ph]);
+	for (int k = 0; k < PROF_COUNTS; k++)
+		fprintf(csv, ",%ld", count[k] - lastCount[k]);
+	for (int e = 0; e < PERF_EVENTS; e++)
+		fprintf(csv, ",%ld", perf[e] - lastPerf[e]);
+	fprintf(csv, "\n");
+
+	memcpy(lastTime, time, sizeof(lastTime));
+	memcpy(lastCount, count, sizeof(lastCount));
+	memcpy(lastPerf, perf, sizeof(lastPerf));
+}
+
+/**
+ * @brief Print the hardware events of each phase and close the groups.
+ *
+ * Misses per pair test are only given for the heading phase, the one
+ * that tests the pairs.
+ *
+ * @param threads
+ * @param tested pairs tested over the run
+ */
+static void perf_report(int threads, long tested)
+{
+	fprintf(stderr, "%-10s %14s %14s %6s %9s %9s %12s %12s %12s %12s\n",
+			"phase", "cycles", "instructions", "IPC", "IPC min", "IPC max",
+			"cache miss", "branch miss", "cache/pair", "branch/pair");
+
+	for (int ph = 0; ph < boids::PROF_PHASES; ph++)
+	{
+		long sum[boids::PERF_EVENTS] = {0};
+		double lo = 0, hi = 0;
+		bool any = false;
+
+		for (int t = 0; t < threads; t++)
+		{
+			const long *e = boids::prof_threads[t].perf[ph];
+			double ipc;
+
+			for (int k = 0; k < boids::PERF_EVENTS; k++)
+				sum[k] += e[k];
+			if (e[boids::PERF_CYCLES] == 0)
+				continue;
+
+			// Spread between threads: low IPC on one thread is the imbalance
+			ipc = (double)e[boids::PERF_INSTRUCTIONS] / e[boids::PERF_CYCLES];
+			lo = any ? MIN(lo, ipc) : ipc;
+			hi = any ? MAX(hi, ipc) : ipc;
+			any = true;
+		}
+		if (!any)
+			continue;
+
+		fprintf(stderr, "%-10s %14ld %14ld %6.2f %9.2f %9.2f %12ld %12ld",
+				boids::prof_phase_names[ph], sum[boids::PERF_CYCLES], sum[boids::PERF_INSTRUCTIONS],
+				(double)sum[boids::PERF_INSTRUCTIONS] / sum[boids::PERF_CYCLES], lo, hi,
+				sum[boids::PERF_CACHE_MISSES], sum[boids::PERF_BRANCH_MISSES]);
+		if (ph == boids::PROF_HEADING && tested > 0)
+		{
+			fprintf(stderr, " %12.5f %12.5f\n",
+					(double)sum[boids::PERF_CACHE_MISSES] / tested,
+					(double)sum[boids::PERF_BRANCH_MISSES] / tested);
+		}
+		else
+			fprintf(stderr, " %12s %12s\n", "-", "-");
+	}
+
+	// Closing a leader leaves its members open until exit; they are few
+	for (int t = 0; t < perfThreads; t++)
+	{
+		if (boids::prof_threads[t].perfFd >= 0)
+			close(boids::prof_threads[t].perfFd);
+		boids::prof_threads[t].perfFd = -1;
+	}
+	boids::prof_perf = false;
+}
+
+/**
+ * @brief Print the phase and counter tables to stderr and close the CSV.
+ *
+ * @param p
+ */
+void boids::prof_report(struct boids::Params p)
+{
+	int threads = MIN(MAX(p.threads, 1), PROF_MAX_THREADS);
+	double time[PROF_PHASES], total = 0;
+	long count[PROF_COUNTS];
+	double boidSteps = (double)profSteps * p.num;
+
+	phase_times(threads, time);
+	count_totals(threads, count);
+	for (int ph = 0; ph < PROF_PHASES; ph++)
+		total += time[ph];
+
+	fprintf(stderr, "\nProfile of %ld steps on %d threads\n", profSteps, threads);
+	fprintf(stderr, "%-10s %12s %12s %7s %12s %12s\n",
+			"phase", "seconds", "us/step", "share", "thread min", "thread max");
+	for (int ph = 0; ph < PROF_PHASES; ph++)
+	{
+		double lo = prof_threads[0].time[ph], hi = lo;
+
+		if (time[ph] == 0)
+			continue;
+		for (int t = 1; t < threads; t++)
+		{
+			lo = MIN(lo, prof_threads[t].time[ph]);
+			hi = MAX(hi, prof_threads[t].time[ph]);
+		}
+		if (prof_threads[PROF_DRAWER].time[ph] > 0)
+		{
+			lo = MIN(lo, prof_threads[PROF_DRAWER].time[ph]);
+			hi = MAX(hi, prof_threads[PROF_DRAWER].time[ph]);
+		}
+		fprintf(stderr, "%-10s %12.6f %12.3f %6.1f%% %12.6f %12.6f\n",
+				boids::prof_phase_names[ph], time[ph], profSteps ? 1e6 * time[ph] / profSteps : 0.0,
+				total > 0 ? 100 * time[ph] / total : 0.0, lo, hi);
+	}
+
+	fprintf(stderr, "%-10s %12s %12s %12s %12s %12s\n",
+			"counter", "total", "per step", "per boid", "thread min", "thread max");
+	for (int k = 0; k < PROF_COUNTS; k++)
+	{
+		long lo = prof_threads[0].count[k], hi = lo;
+
+		for (int t = 1; t < threads; t++)
+		{
+			lo = MIN(lo, prof_threads[t].count[k]);
+			hi = MAX(hi, prof_threads[t].count[k]);
+		}
+		fprintf(stderr, "%-10s %12ld %12.1f %12.3f %12ld %12ld\n",
+				countNames[k], count[k], profSteps ? (double)count[k] / profSteps : 0.0,
+				boidSteps > 0 ? count[k] / boidSteps : 0.0, lo, hi);
+	}
+
+	// How much of the candidate scan was wasted on boids out of reach
+	if (count[PROF_TESTED] > 0)
+	{
+		fprintf(stderr, "%.1f%% of tested pairs were in range\n",
+				100.0 * count[PROF_HITS] / count[PROF_TESTED]);
+	}
+
+	if (prof_perf)
+		perf_report(threads, count[PROF_TESTED]);
+
+	if (prof_trace)
+	{
+		trace_write(p);
+		prof_trace = false;
+	}
+
+	if (csv != NULL)
+	{
+		fclose(csv);
+		csv = NULL;
+	}
+}
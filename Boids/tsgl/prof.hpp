@@ -0,0 +1,191 @@
+/*
+    Phase timers and event counters for the step loop.
+
+    Compiled in only with -DPROFILE (make PROFILE=1 omp), so the normal
+    builds carry no trace of them: every macro below expands to nothing.
+    Each thread adds to its own cache line of prof_threads, indexed by its
+    OpenMP thread number, so counting needs no atomics. The live canvas's
+    drawer runs outside the team and charges its frames to a slot of its
+    own, PROF_DRAWER, through prof_draw. Phases timed from
+    serial code land on thread 0; the persistent backend times each of its
+    threads, which shows how long they wait for each other.
+
+    With -perf 1 every phase also reads the hardware counters of each
+    thread (perf_event_open, Linux only). A phase timed from serial code
+    reads the counters of the whole team, since its parallel loops run on
+    the other threads; one timed inside a parallel region reads its own.
+
+    With -trace every phase is also recorded as a span on its thread's
+    timeline, and the heading loops record each thread's share of the
+    boids, so a straggling thread shows up as a longer bar. Spans go to a
+    buffer per thread and are only written out (as Chrome trace JSON, for
+    chrome://tracing or ui.perfetto.dev) when the run ends.
+*/
+#ifndef PROF_HPP
+#define PROF_HPP
+
+#include <stdio.h>
+#include <omp.h>
+#include "boids.hpp"
+
+#if defined(PROFILE) && (defined(MC) || defined(GPU))
+#error "PROFILE needs the OpenMP build"
+#endif
+
+/* Threads with their own counters; higher thread numbers share the last. */
+#define PROF_MAX_THREADS 256
+
+/* Slot of the canvas's drawer thread, after those of the team. */
+#define PROF_DRAWER PROF_MAX_THREADS
+#define PROF_SLOTS (PROF_MAX_THREADS + 1)
+
+namespace boids {
+
+    /* Where the time of a step goes. */
+    enum ProfPhase
+    {
+        PROF_REORDER,   // sorting the state arrays by cell
+        PROF_SEARCH,    // grid binning and Verlet list checks and rebuilds
+        PROF_HEADING,   // candidate scan, rules and integration (one fused pass)
+        PROF_WAIT,      // waiting at the step barrier (persistent backend)
+        PROF_DRAW,      // updating the canvas drawables (-replay here, the live canvas on PROF_DRAWER)
+        PROF_OUTPUT,    // writing state to files
+        PROF_PHASES
+    };
+
+    /* What happened during a step. */
+    enum ProfCount
+    {
+        PROF_TESTED,    // candidate pairs whose distance was tested
+        PROF_HITS,      // pairs within the largest rule radius
+        PROF_CENT,      // centering activations
+        PROF_COPY,      // copying activations
+        PROF_VOID,      // avoidance activations
+        PROF_VISO,      // visual avoidance activations
+        PROF_REBUILDS,  // grid or Verlet list builds
+        PROF_COUNTS
+    };
+
+    /* Hardware events read around every phase with -perf 1. */
+    enum ProfEvent
+    {
+        PERF_CYCLES,
+        PERF_INSTRUCTIONS,
+        PERF_CACHE_MISSES,  // last-level cache
+        PERF_BRANCH_MISSES,
+        PERF_EVENTS
+    };
+
+    struct alignas(64) ProfThread
+    {
+        double time[PROF_PHASES];
+        long count[PROF_COUNTS];
+        long perf[PROF_PHASES][PERF_EVENTS]; // events of this thread in each phase
+        long perfMark[PERF_EVENTS];          // its events when the current phase began
+        int perfFd;                          // its event group, -1 if not counting
+    };
+
+    extern ProfThread prof_threads[PROF_SLOTS];
+
+    extern bool prof_perf;
+
+    extern bool prof_trace;
+
+    extern const char *const prof_phase_names[PROF_PHASES];
+
+    /**
+     * @brief The counters of the calling thread.
+     */
+    inline ProfThread &prof_self()
+    {
+        return prof_threads[MIN(omp_get_thread_num(), PROF_MAX_THREADS - 1)];
+    }
+
+    bool prof_perf_init(struct Params p);
+
+    bool prof_trace_open(struct Params p);
+
+    void prof_trace_span(const char *name, double begin, double end);
+
+    void prof_draw(int step, double begin, double end);
+
+    void prof_perf_mark();
+
+    void prof_perf_add(int phase);
+
+    /**
+     * @brief Start timing a phase.
+     */
+    inline double prof_begin()
+    {
+        if (prof_perf)
+            prof_perf_mark();
+        return omp_get_wtime();
+    }
+
+    /**
+     * @brief Charge the time (and events) since begin to phase.
+     */
+    inline void prof_end(double begin, int phase)
+    {
+        double end = omp_get_wtime();
+
+        prof_self().time[phase] += end - begin;
+        if (prof_perf)
+            prof_perf_add(phase);
+        if (prof_trace)
+            prof_trace_span(prof_phase_names[phase], begin, end);
+    }
+
+    /**
+     * @brief "omp parallel for" over the boids that traces each thread's share.
+     *
+     * Same static schedule as the plain loop; for the kernels to use while
+     * -trace is on.
+     *
+     * @param p
+     * @param name of the spans
+     * @param body callable void(int which)
+     */
+    template <typename Body>
+    inline void traced_for(const Params &p, const char *name, Body body)
+    {
+        #pragma omp parallel num_threads(p.threads)
+        {
+            double begin = omp_get_wtime();
+
+            #pragma omp for schedule(static) nowait
+            for (int which = 0; which < p.num; which++)
+                body(which);
+
+            prof_trace_span(name, begin, omp_get_wtime());
+        }
+    }
+
+    bool prof_open(const char *path);
+
+    void prof_step(struct Params p, int steps);
+
+    void prof_report(struct Params p);
+
+}
+
+#if defined(PROFILE)
+#define PROF_ONLY(...) __VA_ARGS__
+#define PROF_BEGIN(t) double t = boids::prof_begin()
+#define PROF_END(t, phase) boids::prof_end(t, phase)
+#define PROF_COUNT(counter, n) (boids::prof_self().count[counter] += (n))
+#define PROF_STEP(p, steps) boids::prof_step(p, steps)
+#define PROF_TRACE_BEGIN(t) double t = boids::prof_trace ? omp_get_wtime() : 0
+#define PROF_TRACE_END(t, name) (boids::prof_trace ? boids::prof_trace_span(name, t, omp_get_wtime()) : (void)0)
+#else
+#define PROF_ONLY(...)
+#define PROF_BEGIN(t)
+#define PROF_END(t, phase)
+#define PROF_COUNT(counter, n)
+#define PROF_STEP(p, steps)
+#define PROF_TRACE_BEGIN(t)
+#define PROF_TRACE_END(t, name)
+#endif
+
+#endif
@@ -0,0 +1,73 @@
+/*
+    Counter-based random numbers (Philox4x32-10, Salmon et al., SC'11).
+
+    random() keeps one hidden state that every caller advances, so it can
+    only be used from one thread and its numbers depend on call order.
+    Philox instead hashes a counter under a key: the numbers for
+    (seed, boid, step) are the same no matter which thread asks, in what
+    order, or on which device, so parallel initialization and the noise
+    rule give bitwise identical results for any thread count.
+*/
+#ifndef RNG_HPP
+#define RNG_HPP
+
+#include <stdint.h>
+
+namespace boids {
+
+    /* Independent streams drawn from the same (seed, boid, step). */
+    enum RngStream
+    {
+        RNG_INIT,   // initial positions and velocities
+        RNG_NOISE   // the wrand rule
+    };
+
+    /**
+     * @brief Ten Philox rounds of ctr under key, in place.
+     */
+    #if defined(MC) || defined(GPU)
+    #pragma acc routine seq
+    #endif
+    inline void philox4x32(uint32_t ctr[4], uint32_t k0, uint32_t k1)
+    {
+        for (int round = 0; round < 10; round++)
+        {
+            uint64_t p0 = (uint64_t)0xD2511F53u * ctr[0];
+            uint64_t p1 = (uint64_t)0xCD9E8D57u * ctr[2];
+            uint32_t c1 = ctr[1], c3 = ctr[3];
+
+            ctr[0] = (uint32_t)(p1 >> 32) ^ c1 ^ k0;
+            ctr[1] = (uint32_t)p1;
+            ctr[2] = (uint32_t)(p0 >> 32) ^ c3 ^ k1;
+            ctr[3] = (uint32_t)p0;
+
+            k0 += 0x9E3779B9u;
+            k1 += 0xBB67AE85u;
+        }
+    }
+
+    /**
+     * @brief Four uniform floats in [0, 1) for one (seed, boid, step, stream).
+     *
+     * @param seed
+     * @param id index of the boid
+     * @param step time step
+     * @param stream one of boids::RngStream
+     * @param u where to store the four numbers
+     */
+    #if defined(MC) || defined(GPU)
+    #pragma acc routine seq
+    #endif
+    inline void rng_uniform4(uint32_t seed, uint32_t id, uint32_t step, uint32_t stream, float u[4])
+    {
+        uint32_t ctr[4] = {id, step, stream, 0};
+
+        philox4x32(ctr, seed, 0);
+
+        /* The top 24 bits fill a float mantissa exactly. */
+        for (int k = 0; k < 4; k++)
+            u[k] = (ctr[k] >> 8) * (1.0f / 16777216.0f);
+    }
+
+}
+#endif
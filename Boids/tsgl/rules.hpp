@@ -0,0 +1,361 @@
+/*
+    Per-pair rule evaluation shared by the neighbor-search kernels.
+
+    boids::compute_new_headings keeps the original monolithic loop so it can
+    serve as the reference; the faster kernels (grid, ...) only differ in how
+    they find candidate boids, so the rule math lives here once.
+
+    The rule functions are templated on a mask of the active rules and on
+    the precision of the arithmetic. A rule whose weight is 0 cannot change
+    the heading, so kernels instantiated without it skip its math entirely;
+    select_kernel picks the instantiation that matches a boids::Params.
+*/
+#ifndef RULES_HPP
+#define RULES_HPP
+
+#include <cmath>
+#include "boids.hpp"
+#include "rng.hpp"
+#include "prof.hpp"
+
+namespace boids {
+
+    /* Bits of a rule mask. */
+    enum Rule
+    {
+        RULE_CENT = 1,  // centering
+        RULE_COPY = 2,  // copying
+        RULE_VOID = 4,  // avoidance
+        RULE_VISO = 8,  // visual avoidance
+        RULE_ALL = 15
+    };
+
+    /**
+     * @brief The rules with a non-zero weight in p.
+     */
+    inline unsigned active_rules(const Params &p)
+    {
+        return (p.wcent != 0 ? RULE_CENT : 0) |
+               (p.wcopy != 0 ? RULE_COPY : 0) |
+               (p.wvoid != 0 ? RULE_VOID : 0) |
+               (p.wviso != 0 ? RULE_VISO : 0);
+    }
+
+    /**
+     * @brief The accumulated change vectors for the four rules of one boid.
+     */
+    template <typename Real = float>
+    struct Accum
+    {
+        Real xa, ya; // centering
+        Real xb, yb; // copying
+        Real xc, yc; // avoidance
+        Real xd, yd; // visual avoidance
+        int numcent;
+        #if defined(PROFILE)
+        int hits, cent, copy, avoid, viso; // see prof.hpp, zeroed with the rest
+        #endif
+    };
+
+    /**
+     * @brief Values of the rules that do not change from boid to boid.
+     */
+    struct RuleConsts
+    {
+        float maxr;
+        float cosangle;
+        float cosvangle;
+    };
+
+    /**
+     * @brief The rule constants for p.
+     *
+     * maxr only covers the active rules, so a disabled rule with a large
+     * radius does not widen the neighbor search. With no rule active it
+     * falls back to every radius.
+     */
+    inline RuleConsts rule_consts(const Params &p)
+    {
+        RuleConsts c;
+        unsigned rules = active_rules(p);
+
+        c.maxr = 0;
+        if (rules & RULE_CENT)
+            c.maxr = MAX(c.maxr, p.rcent);
+        if (rules & RULE_COPY)
+            c.maxr = MAX(c.maxr, p.rcopy);
+        if (rules & RULE_VOID)
+            c.maxr = MAX(c.maxr, p.rvoid);
+        if (rules & RULE_VISO)
+            c.maxr = MAX(c.maxr, p.rviso);
+        if (c.maxr == 0)
+            c.maxr = MAX(p.rviso, MAX(p.rcopy, MAX(p.rcent, p.rvoid)));
+
+        c.cosangle = cos(p.angle / 2);
+        c.cosvangle = cos(p.vangle / 2);
+        return c;
+    }
+
+    /**
+     * @brief Wrap a displacement onto the nearest periodic image.
+     *
+     * Equivalent to picking the closest of the three displacements
+     * d - size, d, d + size as the nine-image search does per axis.
+     */
+    #if defined(MC) || defined(GPU)
+    #pragma acc routine seq
+    #endif
+    inline float min_image(float d, float size)
+    {
+        if (d > size * 0.5f)
+            d -= size;
+        else if (d < -size * 0.5f)
+            d += size;
+        return d;
+    }
+
+    /**
+     * @brief Destructively normalize a vector if it is longer than 1.
+     */
+    #if defined(MC) || defined(GPU)
+    #pragma acc routine seq
+    #endif
+    template <typename Real>
+    inline void clamp_length(Real *x, Real *y)
+    {
+        Real len = LEN(*x, *y);
+        if (len > 1.0)
+        {
+            *x /= len;
+            *y /= len;
+        }
+    }
+
+    /**
+     * @brief Apply the rules for boid(which) looking at one other boid.
+     *
+     * @tparam RULES mask of boids::Rule to evaluate
+     * @tparam Real precision of the rule arithmetic
+     * @param dx, dy minimum-image vector from boid(which) to the other boid
+     * @param dist length of (dx, dy), already known to be <= maxr
+     * @param xv, yv velocity of boid(which)
+     * @param ox, oy velocity of the other boid
+     */
+    #if defined(MC) || defined(GPU)
+    #pragma acc routine seq
+    #endif
+    template <unsigned RULES = RULE_ALL, typename Real = float>
+    inline void accumulate_pair(
+        const Params &p, const RuleConsts &c, Accum<Real> &a,
+        Real dx, Real dy, Real dist,
+        Real xv, Real yv, Real ox, Real oy)
+    {
+        Real costemp, u, v, d;
+
+        PROF_ONLY(a.hits++);
+
+        /* Can boid(which) see the other boid at all? */
+        costemp = DOT(xv, yv, dx, dy) / (LEN(xv, yv) * LEN(dx, dy));
+        if (costemp < c.cosangle)
+            return;
+
+        /* Centering, outside of the avoidance radius. */
+        if ((RULES & RULE_CENT) && dist <= p.rcent && dist > p.rvoid)
+        {
+            a.xa += dx;
+            a.ya += dy;
+            a.numcent++;
+            PROF_ONLY(a.cent++);
+        }
+
+        /* Copying, outside of the avoidance radius. */
+        if ((RULES & RULE_COPY) && dist <= p.rcopy && dist > p.rvoid)
+        {
+            a.xb += ox;
+            a.yb += oy;
+            PROF_ONLY(a.copy++);
+        }
+
+        /* Avoidance, inversely proportional to the distance. */
+        if ((RULES & RULE_VOID) && dist <= p.rvoid)
+        {
+            d = 1 / LEN(dx, dy);
+            a.xc -= dx * d;
+            a.yc -= dy * d;
+            PROF_ONLY(a.avoid++);
+        }
+
+        /* Visual avoidance: sidestep the boid blocking the view. */
+        if ((RULES & RULE_VISO) && dist <= p.rviso && c.cosvangle < costemp)
+        {
+            Real xtemp = -dx, ytemp = -dy;
+
+            u = v = 0;
+            if (xtemp != 0 && ytemp != 0)
+            {
+                u = sqrt(SQR(ytemp / xtemp) / (1 + SQR(ytemp / xtemp)));
+                v = -xtemp * u / ytemp;
+            }
+            else if (xtemp != 0)
+                u = 1;
+            else if (ytemp != 0)
+                v = 1;
+            if ((xv * u + yv * v) < 0)
+            {
+                u = -u;
+                v = -v;
+            }
+
+            u = xtemp + u;
+            v = ytemp + v;
+
+            d = LEN(xtemp, ytemp);
+            if (d != 0)
+            {
+                u /= d;
+                v /= d;
+            }
+            a.xd += u;
+            a.yd += v;
+            PROF_ONLY(a.viso++);
+        }
+    }
+
+    /**
+     * @brief Combine the accumulated rules into the new velocity of a boid.
+     *
+     * @tparam RULES mask of boids::Rule that were accumulated
+     * @tparam Real precision of the rule arithmetic
+     * @param id stable id of the boid (not its slot), keys the wrand noise
+     */
+    #if defined(MC) || defined(GPU)
+    #pragma acc routine seq
+    #endif
+    template <unsigned RULES = RULE_ALL, typename Real = float>
+    inline void finish_heading(
+        const Params &p, Accum<Real> &a, int id,
+        float xv, float yv, float *xnv, float *ynv)
+    {
+        Real xt = 0, yt = 0, nx, ny, d;
+
+        #if defined(PROFILE)
+        ProfThread &prof = prof_self();
+        prof.count[PROF_HITS] += a.hits;
+        prof.count[PROF_CENT] += a.cent;
+        prof.count[PROF_COPY] += a.copy;
+        prof.count[PROF_VOID] += a.avoid;
+        prof.count[PROF_VISO] += a.viso;
+        #endif
+
+        /* Avoid centering on only one other boid. */
+        if (a.numcent < 2)
+            a.xa = a.ya = 0;
+
+        /* Normalize all big vectors and compute the composite trajectory
+         * based on the active rules.
+         */
+        if (RULES & RULE_CENT)
+        {
+            clamp_length(&a.xa, &a.ya);
+            xt += a.xa * p.wcent;
+            yt += a.ya * p.wcent;
+        }
+        if (RULES & RULE_COPY)
+        {
+            clamp_length(&a.xb, &a.yb);
+            xt += a.xb * p.wcopy;
+            yt += a.yb * p.wcopy;
+        }
+        if (RULES & RULE_VOID)
+        {
+            clamp_length(&a.xc, &a.yc);
+            xt += a.xc * p.wvoid;
+            yt += a.yc * p.wvoid;
+        }
+        if (RULES & RULE_VISO)
+        {
+            clamp_length(&a.xd, &a.yd);
+            xt += a.xd * p.wviso;
+            yt += a.yd * p.wviso;
+        }
+
+        /* Noise is rare enough to stay a run-time branch. */
+        if (p.wrand > 0)
+        {
+            float u[4];
+            rng_uniform4(p.seed, id, p.step, RNG_NOISE, u);
+            xt += (2 * u[0] - 1) * p.wrand;
+            yt += (2 * u[1] - 1) * p.wrand;
+        }
+
+        /* Update the velocity and renormalize if it is too small. */
+        nx = xv * p.ddt + xt * (1 - p.ddt);
+        ny = yv * p.ddt + yt * (1 - p.ddt);
+        d = LEN(nx, ny);
+        if (d < p.minv)
+        {
+            nx *= p.minv / d;
+            ny *= p.minv / d;
+        }
+        *xnv = nx;
+        *ynv = ny;
+    }
+
+    /**
+     * @brief Pick the instantiation of a kernel for the rules and precision of p.
+     *
+     * Kernel<RULES, Real>::run must be a static function with the same
+     * signature for every instantiation.
+     *
+     * @tparam Kernel the kernel template
+     * @tparam R first rule mask to try
+     */
+    template <template <unsigned, typename> class Kernel, unsigned R = 0>
+    inline decltype(&Kernel<RULE_ALL, float>::run) select_kernel(const Params &p)
+    {
+        if (active_rules(p) == R)
+        {
+            if (p.precision == PRECISION_DOUBLE)
+                return &Kernel<R, double>::run;
+            return &Kernel<R, float>::run;
+        }
+
+        if constexpr (R < RULE_ALL)
+            return select_kernel<Kernel, R + 1>(p);
+        else
+            return &Kernel<RULE_ALL, float>::run;
+    }
+
+    /**
+     * @brief Move a boid along its new velocity, wrapping around the screen.
+     *
+     * @param x, y current position
+     * @param xnv, ynv new velocity
+     * @param xnp, ynp where to store the new position
+     */
+    #if defined(MC) || defined(GPU)
+    #pragma acc routine seq
+    #endif
+    inline void integrate(
+        const Params &p, float x, float y,
+        float xnv, float ynv, float *xnp, float *ynp)
+    {
+        x += xnv * p.dt;
+        y += ynv * p.dt;
+
+        if (x < -p.width / 2)
+            x += p.width;
+        else if (x >= p.width / 2)
+            x -= p.width;
+
+        if (y < -p.height / 2)
+            y += p.height;
+        else if (y >= p.height / 2)
+            y -= p.height;
+
+        *xnp = x;
+        *ynp = y;
+    }
+}
+
+#endif
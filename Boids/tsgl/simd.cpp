@@ -0,0 +1,521 @@
+/*
+    AVX2 and AVX-512 versions of the brute-force heading kernel.
+
+    The scalar loop in boids::compute_new_headings branches out of every
+    pair and searches nine periodic images, so the compiler cannot vectorize
+    it. Here each boid looks at 8 (AVX2) or 16 (AVX-512) candidates at once:
+    the minimum image is taken per axis with compares and masks, distances
+    are compared squared, and the four rules are accumulated under lane
+    masks instead of branches. The rule math is the same as in rules.hpp,
+    so the headings match the scalar ones within float tolerance, and like
+    the kernels there both are instantiated per mask of active rules, so a
+    rule with weight 0 costs nothing in the inner loop.
+
+    Both kernels are compiled with target attributes and picked at runtime
+    from what the CPU reports, so one binary runs on every node and falls
+    back to the scalar loop where neither is available.
+*/
+
+#include <cmath>
+#include <stdio.h>
+#include <stdlib.h>
+#include <omp.h>
+#include <immintrin.h>
+#include "misc.h"
+#include "boids.hpp"
+#include "rules.hpp"
+#include "simd.hpp"
+#include "prof.hpp"
+
+
+/**
+ * @brief Resolve a requested SIMD level to one this CPU can run.
+ *
+ * SIMD_AUTO becomes the widest supported level; an explicit level the CPU
+ * lacks falls back to the next narrower one, down to SIMD_OFF.
+ *
+ * @param requested one of boids::Simd
+ * @return int the level to pass to compute_new_headings_simd
+ */
+int boids::simd_select(int requested)
+{
+	bool avx512 = __builtin_cpu_supports("avx512f");
+	bool avx2 = __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+
+	if ((requested == SIMD_AUTO || requested == SIMD_AVX512) && avx512)
+		return SIMD_AVX512;
+	if (requested != SIMD_OFF && avx2)
+		return SIMD_AVX2;
+	return SIMD_OFF;
+}
+
+/**
+ * @brief Name of a SIMD level for messages.
+ *
+ * @param level
+ * @return const char*
+ */
+const char *boids::simd_name(int level)
+{
+	switch (level)
+	{
+	case SIMD_AUTO:
+		return "auto";
+	case SIMD_AVX2:
+		return "avx2";
+	case SIMD_AVX512:
+		return "avx512";
+	default:
+		return "off";
+	}
+}
+
+__attribute__((target("avx2,fma")))
+static inline float hsum256(__m256 v)
+{
+	__m128 s = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+	s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+	s = _mm_add_ss(s, _mm_movehdup_ps(s));
+	return _mm_cvtss_f32(s);
+}
+
+/**
+ * @brief New heading of boid(which), eight candidates at a time.
+ *
+ * @tparam RULES mask of boids::Rule to evaluate, as in rules.hpp
+ */
+template <unsigned RULES>
+__attribute__((target("avx2,fma")))
+static void heading_avx2(
+	const boids::Params &p, const boids::RuleConsts &c, int which, const int *ids,
+	const float *xp, const float *yp,
+	const float *xv, const float *yv,
+	float *xnv, float *ynv,
+	float *xnp, float *ynp)
+{
+	const __m256 sign = _mm256_set1_ps(-0.0f);
+	const __m256 zero = _mm256_setzero_ps();
+	const __m256 one = _mm256_set1_ps(1.0f);
+	const __m256 w = _mm256_set1_ps(p.width);
+	const __m256 h = _mm256_set1_ps(p.height);
+	const __m256 hw = _mm256_set1_ps(0.5f * p.width);
+	const __m256 hh = _mm256_set1_ps(0.5f * p.height);
+	const __m256 maxr2 = _mm256_set1_ps(SQR(c.maxr));
+	const __m256 cosangle = _mm256_set1_ps(c.cosangle);
+	const __m256 cosvangle = _mm256_set1_ps(c.cosvangle);
+	const __m256 rcent = _mm256_set1_ps(p.rcent);
+	const __m256 rcopy = _mm256_set1_ps(p.rcopy);
+	const __m256 rvoid = _mm256_set1_ps(p.rvoid);
+	const __m256 rviso = _mm256_set1_ps(p.rviso);
+	const __m256i lane = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+	const __m256i self = _mm256_set1_epi32(which);
+	const __m256i num = _mm256_set1_epi32(p.num);
+
+	const __m256 px = _mm256_set1_ps(xp[which]);
+	const __m256 py = _mm256_set1_ps(yp[which]);
+	const __m256 vx = _mm256_set1_ps(xv[which]);
+	const __m256 vy = _mm256_set1_ps(yv[which]);
+	const __m256 vlen = _mm256_set1_ps(LEN(xv[which], yv[which]));
+
+	__m256 xa = zero, ya = zero, xb = zero, yb = zero;
+	__m256 xc = zero, yc = zero, xd = zero, yd = zero;
+	int numcent = 0;
+	PROF_ONLY(int hits = 0, cent = 0, copy = 0, avoid = 0, viso = 0);
+
+	for (int base = 0; base < p.num; base += 8)
+	{
+		__m256i idx = _mm256_add_epi32(_mm256_set1_epi32(base), lane);
+		__m256i inb = _mm256_cmpgt_epi32(num, idx);
+		__m256 x, y, ox, oy;
+
+		if (base + 8 <= p.num)
+		{
+			x = _mm256_loadu_ps(xp + base);
+			y = _mm256_loadu_ps(yp + base);
+			ox = _mm256_loadu_ps(xv + base);
+			oy = _mm256_loadu_ps(yv + base);
+		}
+		else
+		{
+			x = _mm256_maskload_ps(xp + base, inb);
+			y = _mm256_maskload_ps(yp + base, inb);
+			ox = _mm256_maskload_ps(xv + base, inb);
+			oy = _mm256_maskload_ps(yv + base, inb);
+		}
+
+		/* Minimum image: shift by one world size where past half of it. */
+		__m256 dx = _mm256_sub_ps(x, px);
+		__m256 dy = _mm256_sub_ps(y, py);
+		dx = _mm256_sub_ps(dx, _mm256_and_ps(_mm256_cmp_ps(dx, hw, _CMP_GT_OQ), w));
+		dx = _mm256_add_ps(dx, _mm256_and_ps(_mm256_cmp_ps(dx, _mm256_sub_ps(zero, hw), _CMP_LT_OQ), w));
+		dy = _mm256_sub_ps(dy, _mm256_and_ps(_mm256_cmp_ps(dy, hh, _CMP_GT_OQ), h));
+		dy = _mm256_add_ps(dy, _mm256_and_ps(_mm256_cmp_ps(dy, _mm256_sub_ps(zero, hh), _CMP_LT_OQ), h));
+
+		__m256 d2 = _mm256_fmadd_ps(dx, dx, _mm256_mul_ps(dy, dy));
+		__m256 valid = _mm256_castsi256_ps(_mm256_andnot_si256(_mm256_cmpeq_epi32(idx, self), inb));
+		__m256 active = _mm256_and_ps(valid, _mm256_cmp_ps(d2, maxr2, _CMP_LE_OQ));
+		if (_mm256_movemask_ps(active) == 0)
+			continue;
+		PROF_ONLY(hits += __builtin_popcount(_mm256_movemask_ps(active)));
+
+		__m256 dist = _mm256_sqrt_ps(d2);
+		__m256 inv = _mm256_div_ps(one, dist);
+		__m256 costemp = _mm256_div_ps(_mm256_fmadd_ps(vx, dx, _mm256_mul_ps(vy, dy)),
+									   _mm256_mul_ps(vlen, dist));
+
+		/* Can boid(which) see them? (NLT keeps NaN lanes like the scalar test) */
+		active = _mm256_and_ps(active, _mm256_cmp_ps(costemp, cosangle, _CMP_NLT_UQ));
+		__m256 outvoid = _mm256_cmp_ps(dist, rvoid, _CMP_GT_OQ);
+
+		/* Centering */
+		__m256 m;
+		if (RULES & boids::RULE_CENT)
+		{
+			m = _mm256_and_ps(_mm256_and_ps(active, outvoid), _mm256_cmp_ps(dist, rcent, _CMP_LE_OQ));
+			xa = _mm256_add_ps(xa, _mm256_and_ps(m, dx));
+			ya = _mm256_add_ps(ya, _mm256_and_ps(m, dy));
+			numcent += __builtin_popcount(_mm256_movemask_ps(m));
+			PROF_ONLY(cent += __builtin_popcount(_mm256_movemask_ps(m)));
+		}
+
+		/* Copying */
+		if (RULES & boids::RULE_COPY)
+		{
+			m = _mm256_and_ps(_mm256_and_ps(active, outvoid), _mm256_cmp_ps(dist, rcopy, _CMP_LE_OQ));
+			xb = _mm256_add_ps(xb, _mm256_and_ps(m, ox));
+			yb = _mm256_add_ps(yb, _mm256_and_ps(m, oy));
+			PROF_ONLY(copy += __builtin_popcount(_mm256_movemask_ps(m)));
+		}
+
+		/* Avoidance */
+		if (RULES & boids::RULE_VOID)
+		{
+			m = _mm256_andnot_ps(outvoid, active);
+			xc = _mm256_sub_ps(xc, _mm256_and_ps(m, _mm256_mul_ps(dx, inv)));
+			yc = _mm256_sub_ps(yc, _mm256_and_ps(m, _mm256_mul_ps(dy, inv)));
+			PROF_ONLY(avoid += __builtin_popcount(_mm256_movemask_ps(m)));
+		}
+
+		/* Visual avoidance */
+		if (!(RULES & boids::RULE_VISO))
+			continue;
+		m = _mm256_and_ps(_mm256_and_ps(active, _mm256_cmp_ps(dist, rviso, _CMP_LE_OQ)),
+						  _mm256_cmp_ps(cosvangle, costemp, _CMP_LT_OQ));
+		PROF_ONLY(viso += __builtin_popcount(_mm256_movemask_ps(m)));
+		if (_mm256_movemask_ps(m) != 0)
+		{
+			/* Orthogonal to (-dx, -dy): (|dy|, -dx * sign(dy)) / dist, with
+			 * the scalar loop's special cases when dx or dy is zero.
+			 */
+			__m256 xz = _mm256_cmp_ps(dx, zero, _CMP_EQ_OQ);
+			__m256 yz = _mm256_cmp_ps(dy, zero, _CMP_EQ_OQ);
+			__m256 u = _mm256_mul_ps(_mm256_andnot_ps(sign, dy), inv);
+			__m256 v = _mm256_xor_ps(_mm256_mul_ps(_mm256_sub_ps(zero, dx), inv), _mm256_and_ps(sign, dy));
+			u = _mm256_blendv_ps(u, _mm256_andnot_ps(xz, one), yz);
+			v = _mm256_blendv_ps(v, zero, yz);
+			u = _mm256_blendv_ps(u, zero, xz);
+			v = _mm256_blendv_ps(v, _mm256_andnot_ps(yz, one), xz);
+
+			/* Point it the way boid(which) is going. */
+			__m256 back = _mm256_and_ps(sign, _mm256_cmp_ps(_mm256_fmadd_ps(vx, u, _mm256_mul_ps(vy, v)), zero, _CMP_LT_OQ));
+			u = _mm256_xor_ps(u, back);
+			v = _mm256_xor_ps(v, back);
+
+			u = _mm256_sub_ps(u, dx);
+			v = _mm256_sub_ps(v, dy);
+			__m256 dz = _mm256_cmp_ps(dist, zero, _CMP_EQ_OQ);
+			u = _mm256_blendv_ps(_mm256_mul_ps(u, inv), u, dz);
+			v = _mm256_blendv_ps(_mm256_mul_ps(v, inv), v, dz);
+
+			xd = _mm256_add_ps(xd, _mm256_and_ps(m, u));
+			yd = _mm256_add_ps(yd, _mm256_and_ps(m, v));
+		}
+	}
+
+	boids::Accum<float> a = {hsum256(xa), hsum256(ya), hsum256(xb), hsum256(yb),
+					  hsum256(xc), hsum256(yc), hsum256(xd), hsum256(yd), numcent};
+	PROF_ONLY(a.hits = hits; a.cent = cent; a.copy = copy; a.avoid = avoid; a.viso = viso);
+	PROF_COUNT(boids::PROF_TESTED, p.num - 1);
+	boids::finish_heading<RULES>(p, a, ids[which], xv[which], yv[which], &xnv[which], &ynv[which]);
+
+	if (xnp != NULL)
+		boids::integrate(p, xp[which], yp[which], xnv[which], ynv[which], &xnp[which], &ynp[which]);
+}
+
+/* GCC 12 reports the _mm512_undefined_ps() inside some AVX-512 intrinsics
+ * as uninitialized once they are inlined into the kernel below.
+ */
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wuninitialized"
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+
+/**
+ * @brief New heading of boid(which), sixteen candidates at a time.
+ *
+ * @tparam RULES mask of boids::Rule to evaluate, as in rules.hpp
+ */
+template <unsigned RULES>
+__attribute__((target("avx512f")))
+static void heading_avx512(
+	const boids::Params &p, const boids::RuleConsts &c, int which, const int *ids,
+	const float *xp, const float *yp,
+	const float *xv, const float *yv,
+	float *xnv, float *ynv,
+	float *xnp, float *ynp)
+{
+	const __m512 zero = _mm512_setzero_ps();
+	const __m512 one = _mm512_set1_ps(1.0f);
+	const __m512 w = _mm512_set1_ps(p.width);
+	const __m512 h = _mm512_set1_ps(p.height);
+	const __m512 hw = _mm512_set1_ps(0.5f * p.width);
+	const __m512 hh = _mm512_set1_ps(0.5f * p.height);
+	const __m512 nhw = _mm512_set1_ps(-0.5f * p.width);
+	const __m512 nhh = _mm512_set1_ps(-0.5f * p.height);
+	const __m512 maxr2 = _mm512_set1_ps(SQR(c.maxr));
+	const __m512 cosangle = _mm512_set1_ps(c.cosangle);
+	const __m512 cosvangle = _mm512_set1_ps(c.cosvangle);
+	const __m512 rcent = _mm512_set1_ps(p.rcent);
+	const __m512 rcopy = _mm512_set1_ps(p.rcopy);
+	const __m512 rvoid = _mm512_set1_ps(p.rvoid);
+	const __m512 rviso = _mm512_set1_ps(p.rviso);
+
+	const __m512 px = _mm512_set1_ps(xp[which]);
+	const __m512 py = _mm512_set1_ps(yp[which]);
+	const __m512 vx = _mm512_set1_ps(xv[which]);
+	const __m512 vy = _mm512_set1_ps(yv[which]);
+	const __m512 vlen = _mm512_set1_ps(LEN(xv[which], yv[which]));
+
+	__m512 xa = zero, ya = zero, xb = zero, yb = zero;
+	__m512 xc = zero, yc = zero, xd = zero, yd = zero;
+	int numcent = 0;
+	PROF_ONLY(int hits = 0, cent = 0, copy = 0, avoid = 0, viso = 0);
+
+	for (int base = 0; base < p.num; base += 16)
+	{
+		__mmask16 valid = (p.num - base >= 16) ? 0xffff : (__mmask16)((1u << (p.num - base)) - 1);
+		if (which >= base && which < base + 16)
+			valid &= (__mmask16)~(1u << (which - base));
+
+		__m512 x = _mm512_maskz_loadu_ps(valid, xp + base);
+		__m512 y = _mm512_maskz_loadu_ps(valid, yp + base);
+
+		/* Minimum image: shift by one world size where past half of it. */
+		__m512 dx = _mm512_sub_ps(x, px);
+		__m512 dy = _mm512_sub_ps(y, py);
+		dx = _mm512_mask_sub_ps(dx, _mm512_cmp_ps_mask(dx, hw, _CMP_GT_OQ), dx, w);
+		dx = _mm512_mask_add_ps(dx, _mm512_cmp_ps_mask(dx, nhw, _CMP_LT_OQ), dx, w);
+		dy = _mm512_mask_sub_ps(dy, _mm512_cmp_ps_mask(dy, hh, _CMP_GT_OQ), dy, h);
+		dy = _mm512_mask_add_ps(dy, _mm512_cmp_ps_mask(dy, nhh, _CMP_LT_OQ), dy, h);
+
+		__m512 d2 = _mm512_fmadd_ps(dx, dx, _mm512_mul_ps(dy, dy));
+		__mmask16 active = _mm512_mask_cmp_ps_mask(valid, d2, maxr2, _CMP_LE_OQ);
+		if (active == 0)
+			continue;
+		PROF_ONLY(hits += __builtin_popcount(active));
+
+		__m512 dist = _mm512_sqrt_ps(d2);
+		__m512 inv = _mm512_div_ps(one, dist);
+		__m512 costemp = _mm512_div_ps(_mm512_fmadd_ps(vx, dx, _mm512_mul_ps(vy, dy)),
+									   _mm512_mul_ps(vlen, dist));
+
+		/* Can boid(which) see them? (NLT keeps NaN lanes like the scalar test) */
+		active = _mm512_mask_cmp_ps_mask(active, costemp, cosangle, _CMP_NLT_UQ);
+		__mmask16 outvoid = _mm512_mask_cmp_ps_mask(active, dist, rvoid, _CMP_GT_OQ);
+
+		/* Centering */
+		__mmask16 m;
+		if (RULES & boids::RULE_CENT)
+		{
+			m = _mm512_mask_cmp_ps_mask(outvoid, dist, rcent, _CMP_LE_OQ);
+			xa = _mm512_mask_add_ps(xa, m, xa, dx);
+			ya = _mm512_mask_add_ps(ya, m, ya, dy);
+			numcent += __builtin_popcount(m);
+			PROF_ONLY(cent += __builtin_popcount(m));
+		}
+
+		/* Copying */
+		if (RULES & boids::RULE_COPY)
+		{
+			m = _mm512_mask_cmp_ps_mask(outvoid, dist, rcopy, _CMP_LE_OQ);
+			__m512 ox = _mm512_maskz_loadu_ps(m, xv + base);
+			__m512 oy = _mm512_maskz_loadu_ps(m, yv + base);
+			xb = _mm512_mask_add_ps(xb, m, xb, ox);
+			yb = _mm512_mask_add_ps(yb, m, yb, oy);
+			PROF_ONLY(copy += __builtin_popcount(m));
+		}
+
+		/* Avoidance */
+		if (RULES & boids::RULE_VOID)
+		{
+			m = active & ~outvoid;
+			xc = _mm512_mask_sub_ps(xc, m, xc, _mm512_mul_ps(dx, inv));
+			yc = _mm512_mask_sub_ps(yc, m, yc, _mm512_mul_ps(dy, inv));
+			PROF_ONLY(avoid += __builtin_popcount(m));
+		}
+
+		/* Visual avoidance */
+		if (!(RULES & boids::RULE_VISO))
+			continue;
+		m = _mm512_mask_cmp_ps_mask(active, dist, rviso, _CMP_LE_OQ);
+		m = _mm512_mask_cmp_ps_mask(m, cosvangle, costemp, _CMP_LT_OQ);
+		PROF_ONLY(viso += __builtin_popcount(m));
+		if (m != 0)
+		{
+			/* Orthogonal to (-dx, -dy): (|dy|, -dx * sign(dy)) / dist, with
+			 * the scalar loop's special cases when dx or dy is zero.
+			 */
+			__mmask16 xz = _mm512_cmp_ps_mask(dx, zero, _CMP_EQ_OQ);
+			__mmask16 yz = _mm512_cmp_ps_mask(dy, zero, _CMP_EQ_OQ);
+			__mmask16 yneg = _mm512_cmp_ps_mask(dy, zero, _CMP_LT_OQ);
+			__m512 u = _mm512_mul_ps(_mm512_abs_ps(dy), inv);
+			__m512 v = _mm512_mul_ps(_mm512_sub_ps(zero, dx), inv);
+			v = _mm512_mask_sub_ps(v, yneg, zero, v);
+			u = _mm512_mask_mov_ps(u, yz & ~xz, one);
+			v = _mm512_mask_mov_ps(v, yz, zero);
+			u = _mm512_mask_mov_ps(u, xz, zero);
+			v = _mm512_mask_mov_ps(v, xz & ~yz, one);
+
+			/* Point it the way boid(which) is going. */
+			__mmask16 back = _mm512_cmp_ps_mask(_mm512_fmadd_ps(vx, u, _mm512_mul_ps(vy, v)), zero, _CMP_LT_OQ);
+			u = _mm512_mask_sub_ps(u, back, zero, u);
+			v = _mm512_mask_sub_ps(v, back, zero, v);
+
+			u = _mm512_sub_ps(u, dx);
+			v = _mm512_sub_ps(v, dy);
+			__mmask16 dnz = _mm512_cmp_ps_mask(dist, zero, _CMP_NEQ_UQ);
+			u = _mm512_mask_mul_ps(u, dnz, u, inv);
+			v = _mm512_mask_mul_ps(v, dnz, v, inv);
+
+			xd = _mm512_mask_add_ps(xd, m, xd, u);
+			yd = _mm512_mask_add_ps(yd, m, yd, v);
+		}
+	}
+
+	boids::Accum<float> a = {_mm512_reduce_add_ps(xa), _mm512_reduce_add_ps(ya),
+					  _mm512_reduce_add_ps(xb), _mm512_reduce_add_ps(yb),
+					  _mm512_reduce_add_ps(xc), _mm512_reduce_add_ps(yc),
+					  _mm512_reduce_add_ps(xd), _mm512_reduce_add_ps(yd), numcent};
+	PROF_ONLY(a.hits = hits; a.cent = cent; a.copy = copy; a.avoid = avoid; a.viso = viso);
+	PROF_COUNT(boids::PROF_TESTED, p.num - 1);
+	boids::finish_heading<RULES>(p, a, ids[which], xv[which], yv[which], &xnv[which], &ynv[which]);
+
+	if (xnp != NULL)
+		boids::integrate(p, xp[which], yp[which], xnv[which], ynv[which], &xnp[which], &ynp[which]);
+}
+
+#pragma GCC diagnostic pop
+
+/* One boid's heading with the candidates of one kernel above. */
+typedef void (*Heading)(const boids::Params &, const boids::RuleConsts &, int, const int *,
+						const float *, const float *, const float *, const float *,
+						float *, float *, float *, float *);
+
+/**
+ * @brief The instantiation of the kernel of a SIMD level for the rules of p,
+ * like boids::select_kernel (the vector kernels only come in float).
+ *
+ * @tparam R first rule mask to try
+ * @param p
+ * @param level SIMD_AVX2 or SIMD_AVX512
+ */
+template <unsigned R = 0>
+static Heading select_heading(const boids::Params &p, int level)
+{
+	if (boids::active_rules(p) == R)
+		return (level == boids::SIMD_AVX512) ? &heading_avx512<R> : &heading_avx2<R>;
+
+	if constexpr (R < boids::RULE_ALL)
+		return select_heading<R + 1>(p, level);
+	else
+	{
+		// active_rules never returns more than RULE_ALL
+		fprintf(stderr, "No vector kernel for rule mask %u\n", boids::active_rules(p));
+		abort();
+	}
+}
+
+/**
+ * @brief Computes the headings for all boids with the vectorized kernel.
+ *
+ * Same result as boids::compute_new_headings within float tolerance.
+ * Falls back to that loop when level is SIMD_OFF.
+ *
+ * @param p
+ * @param level a level returned by simd_select
+ * @param ids stable id of the boid in each slot, keys the wrand noise
+ * @param xp
+ * @param yp
+ * @param xv
+ * @param yv
+ * @param xnv
+ * @param ynv
+ * @param xnp back buffer for the new x positions, or NULL to only compute headings
+ * @param ynp back buffer for the new y positions
+ */
+void boids::compute_new_headings_simd(
+	struct boids::Params p, int level, const int *ids,
+	float *xp, float *yp,
+	float *xv, float *yv,
+	float *xnv, float *ynv,
+	float *xnp, float *ynp)
+{
+	if (level != SIMD_AVX512 && level != SIMD_AVX2)
+	{
+		boids::compute_new_headings(p, ids, xp, yp, xv, yv, xnv, ynv, xnp, ynp);
+		return;
+	}
+
+	Heading heading = select_heading(p, level);
+
+	boids::RuleConsts c = rule_consts(p);
+
+	#if defined(PROFILE)
+	if (boids::prof_trace)
+	{
+		boids::traced_for(p, "share", [&](int which) {
+			heading(p, c, which, ids, xp, yp, xv, yv, xnv, ynv, xnp, ynp);
+		});
+		return;
+	}
+	#endif
+
+	#pragma omp parallel for collapse(1) shared(ids, xp, yp, xv, yv, xnv, ynv, xnp, ynp) num_threads(p.threads)
+	for (int which = 0; which < p.num; which++)
+	{
+		heading(p, c, which, ids, xp, yp, xv, yv, xnv, ynv, xnp, ynp);
+	}
+}
+
+/**
+ * @brief Computes the headings of boids [begin, end) on the calling thread.
+ *
+ * For callers that already run inside a parallel region and split the
+ * boids themselves. level must be SIMD_AVX2 or SIMD_AVX512.
+ *
+ * @param p
+ * @param level a level returned by simd_select, not SIMD_OFF
+ * @param begin first boid
+ * @param end one past the last boid
+ * @param ids stable id of the boid in each slot, keys the wrand noise
+ * @param xp
+ * @param yp
+ * @param xv
+ * @param yv
+ * @param xnv
+ * @param ynv
+ * @param xnp back buffer for the new x positions, or NULL to only compute headings
+ * @param ynp back buffer for the new y positions
+ */
+void boids::compute_new_headings_simd_range(
+	struct boids::Params p, int level, int begin, int end, const int *ids,
+	float *xp, float *yp,
+	float *xv, float *yv,
+	float *xnv, float *ynv,
+	float *xnp, float *ynp)
+{
+	boids::RuleConsts c = rule_consts(p);
+	Heading heading = select_heading(p, level);
+
+	for (int which = begin; which < end; which++)
+		heading(p, c, which, ids, xp, yp, xv, yv, xnv, ynv, xnp, ynp);
+}
@@ -0,0 +1,20 @@
+/*
+    Hand-vectorized brute-force heading kernel with runtime CPU dispatch.
+*/
+#ifndef SIMD_HPP
+#define SIMD_HPP
+
+#include "boids.hpp"
+
+namespace boids {
+
+    int simd_select(int requested);
+
+    const char *simd_name(int level);
+
+    void compute_new_headings_simd(struct Params p, int level, const int* ids, float* xp, float* yp, float* xv, float* yv, float* xnv, float* ynv, float* xnp = NULL, float* ynp = NULL);
+
+    void compute_new_headings_simd_range(struct Params p, int level, int begin, int end, const int* ids, float* xp, float* yp, float* xv, float* yv, float* xnv, float* ynv, float* xnp = NULL, float* ynp = NULL);
+
+}
+#endif
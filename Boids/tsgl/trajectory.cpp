@@ -0,0 +1,264 @@
+/*
+    The frame pool and writer thread of trajectory.hpp.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <omp.h>
+#include <initializer_list>
+#include "misc.h"
+#include "boids.hpp"
+#include "trajectory.hpp"
+
+/* Largest multiple of the output interval decimation goes up to. */
+#define TRAJECTORY_MAX_STRIDE (1 << 20)
+
+
+/**
+ * @brief Write one frame, in the layout of trajectory.hpp or codec.hpp.
+ */
+static bool write_frame(boids::Trajectory &t, const boids::TrajectoryFrame &f)
+{
+	if (t.format == boids::OUTPUT_COMPACT)
+		return boids::encoder_frame(t.encoder, t.file, f.step, f.x, f.y, f.vx, f.vy);
+
+	int32_t step = f.step;
+	bool ok = fwrite(&step, sizeof(step), 1, t.file) == 1;
+
+	for (const float *a : {f.x, f.y, f.vx, f.vy})
+		ok = ok && fwrite(a, sizeof(float), t.num, t.file) == (size_t)t.num;
+	return ok;
+}
+
+/**
+ * @brief The writer thread: drain the queue until trajectory_close.
+ *
+ * A frame stays at the head of the queue while it is written, so the
+ * queue length counts it until it is free again.
+ */
+static void writer_main(boids::Trajectory *t)
+{
+	std::unique_lock<std::mutex> guard(t->lock);
+
+	while (true)
+	{
+		t->queued.wait(guard, [t] { return t->queueCount > 0 || t->closing; });
+		if (t->queueCount == 0)
+			break;
+
+		int f = t->queueRing[t->queueHead];
+		guard.unlock();
+
+		double begin = omp_get_wtime();
+		bool ok = write_frame(*t, t->frames[f]);
+		double end = omp_get_wtime();
+
+		guard.lock();
+		t->writeTime += end - begin;
+		if (ok)
+			t->written++;
+		else if (!t->failed)
+		{
+			perror("Writing the trajectory");
+			t->failed = true;
+		}
+
+		t->queueHead = (t->queueHead + 1) % t->nframes;
+		t->queueCount--;
+		t->freeRing[(t->freeHead + t->freeCount) % t->nframes] = f;
+		t->freeCount++;
+
+		// Caught up, so try a shorter interval again
+		if (t->policy == boids::OUTPUT_DECIMATE && t->queueCount == 0 && t->stride > 1)
+			t->stride = t->stride / 2;
+
+		t->freed.notify_one();
+	}
+}
+
+/**
+ * @brief Create path, allocate the frames and start the writer.
+ *
+ * @param t
+ * @param path
+ * @param p p.outputFrames frames of p.num boids, one every p.outputEvery steps
+ * @return false, with a message on stderr, if path could not be created
+ */
+bool boids::trajectory_open(boids::Trajectory &t, const char *path, struct boids::Params p)
+{
+	boids::TrajectoryHeader h;
+
+	t.file = fopen(path, "wb");
+	if (t.file == NULL)
+	{
+		perror(path);
+		return false;
+	}
+	// One frame is four whole arrays, so hand the writes through in large pieces
+	setvbuf(t.file, NULL, _IOFBF, 1 << 20);
+
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, TRAJECTORY_MAGIC, sizeof(h.magic));
+	h.version = TRAJECTORY_VERSION;
+	h.num = p.num;
+	h.width = p.width;
+	h.height = p.height;
+	h.every = p.outputEvery;
+	h.first = p.step;
+	t.format = p.outputFormat;
+	if (t.format == OUTPUT_COMPACT ? !boids::encoder_open(t.encoder, t.file, p) : fwrite(&h, sizeof(h), 1, t.file) != 1)
+	{
+		perror(path);
+		fclose(t.file);
+		return false;
+	}
+
+	t.nframes = MAX(1, p.outputFrames);
+	t.num = p.num;
+	t.every = MAX(1, p.outputEvery);
+	t.policy = p.outputPolicy;
+	t.stride = 1;
+	t.frames = new boids::TrajectoryFrame[t.nframes];
+	t.freeRing = new int[t.nframes];
+	t.queueRing = new int[t.nframes];
+	for (int f = 0; f < t.nframes; f++)
+	{
+		t.frames[f].x = new float[p.num];
+		t.frames[f].y = new float[p.num];
+		t.frames[f].vx = new float[p.num];
+		t.frames[f].vy = new float[p.num];
+		t.freeRing[f] = f;
+	}
+	t.freeHead = 0;
+	t.freeCount = t.nframes;
+	t.queueHead = 0;
+	t.queueCount = 0;
+	t.closing = false;
+
+	t.written = t.dropped = t.bytes = 0;
+	t.maxQueued = 0;
+	t.maxStride = 1;
+	t.writeTime = t.waitTime = 0;
+	t.failed = false;
+
+	t.writer = std::thread(writer_main, &t);
+	return true;
+}
+
+/**
+ * @brief Whether the state after step steps should be written.
+ *
+ * @param t
+ * @param step
+ */
+bool boids::trajectory_due(const boids::Trajectory &t, int step)
+{
+	return step % (t.every * t.stride) == 0;
+}
+
+/**
+ * @brief Queue the current state for the writer, or apply the policy.
+ *
+ * @param t
+ * @param p p.step is the step of the state
+ * @param ids stable id of the boid in each slot
+ * @param xp
+ * @param yp
+ * @param xv
+ * @param yv
+ */
+void boids::trajectory_push(
+	boids::Trajectory &t, struct boids::Params p, const int *ids,
+	const float *xp, const float *yp, const float *xv, const float *yv)
+{
+	std::unique_lock<std::mutex> guard(t.lock);
+
+	if (t.freeCount == 0 && t.policy == OUTPUT_BLOCK && !t.failed)
+	{
+		double begin = omp_get_wtime();
+		t.freed.wait(guard, [&t] { return t.freeCount > 0; });
+		t.waitTime += omp_get_wtime() - begin;
+	}
+	if (t.freeCount == 0 || t.failed)
+	{
+		t.dropped++;
+		if (t.policy == OUTPUT_DECIMATE && !t.failed)
+		{
+			t.stride = MIN(2 * t.stride, TRAJECTORY_MAX_STRIDE);
+			t.maxStride = MAX(t.maxStride, (int)t.stride);
+		}
+		return;
+	}
+
+	int f = t.freeRing[t.freeHead];
+	t.freeHead = (t.freeHead + 1) % t.nframes;
+	t.freeCount--;
+	guard.unlock();
+
+	boids::TrajectoryFrame &frame = t.frames[f];
+	frame.step = p.step;
+
+	#if defined(OMP)
+	#pragma omp parallel for num_threads(p.threads)
+	#endif
+	for (int i = 0; i < p.num; i++)
+	{
+		frame.x[ids[i]] = xp[i];
+		frame.y[ids[i]] = yp[i];
+		frame.vx[ids[i]] = xv[i];
+		frame.vy[ids[i]] = yv[i];
+	}
+
+	guard.lock();
+	t.queueRing[(t.queueHead + t.queueCount) % t.nframes] = f;
+	t.queueCount++;
+	t.maxQueued = MAX(t.maxQueued, t.queueCount);
+	guard.unlock();
+	t.queued.notify_one();
+}
+
+/**
+ * @brief Write the queued frames, stop the writer and report.
+ *
+ * @param t
+ */
+void boids::trajectory_close(boids::Trajectory &t)
+{
+	{
+		std::lock_guard<std::mutex> guard(t.lock);
+		t.closing = true;
+	}
+	t.queued.notify_one();
+	t.writer.join();
+
+	if (t.format == OUTPUT_COMPACT && !boids::encoder_close(t.encoder, t.file) && !t.failed)
+	{
+		perror("Writing the trajectory index");
+		t.failed = true;
+	}
+	t.bytes = ftell(t.file);
+	if (fclose(t.file) != 0 && !t.failed)
+	{
+		perror("Writing the trajectory");
+		t.failed = true;
+	}
+
+	fprintf(stderr, "Trajectory: %ld frames (%.1f MB, %.2f bytes per boid), %ld dropped, queue peaked at %d of %d frames\n",
+			t.written, t.bytes / 1e6, t.written ? (double)t.bytes / t.written / t.num : 0.0,
+			t.dropped, t.maxQueued, t.nframes);
+	fprintf(stderr, "\twriter busy %.3f s, step loop waited %.3f s for frames\n", t.writeTime, t.waitTime);
+	if (t.maxStride > 1)
+		fprintf(stderr, "\tdecimation stretched the interval up to %d steps\n", t.every * t.maxStride);
+
+	for (int f = 0; f < t.nframes; f++)
+	{
+		delete[] t.frames[f].x;
+		delete[] t.frames[f].y;
+		delete[] t.frames[f].vx;
+		delete[] t.frames[f].vy;
+	}
+	delete[] t.frames;
+	delete[] t.freeRing;
+	delete[] t.queueRing;
+}
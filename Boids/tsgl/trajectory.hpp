@@ -0,0 +1,115 @@
+/*
+    Streaming the state of every few steps to a file, off the step loop.
+
+    The step loop only copies the state into a free frame of a fixed pool
+    (in parallel, reordered to boid id order) and queues it; one writer
+    thread drains the queue to disk. A slow disk therefore never stalls a
+    step, unless the pool runs out of free frames, where -outputPolicy
+    decides:
+
+      block     wait for the writer, every frame is kept
+      drop      skip this frame, the next due one may fit again
+      decimate  skip it and double the output interval; the interval
+                halves again whenever the writer empties the queue
+
+    With -outputFormat raw the file is a TrajectoryHeader, then per frame
+    its step (int32) and the x, y, vx and vy arrays of num floats each, in
+    native byte order. With compact the writer thread also encodes the
+    frames, see codec.hpp.
+*/
+#ifndef TRAJECTORY_HPP
+#define TRAJECTORY_HPP
+
+#include <stdio.h>
+#include <stdint.h>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include "boids.hpp"
+#include "codec.hpp"
+
+#define TRAJECTORY_VERSION 1
+#define TRAJECTORY_MAGIC "BOIDSTRJ"
+
+namespace boids {
+
+    /* What the step loop does when every frame is still queued. */
+    enum OutputPolicy
+    {
+        OUTPUT_BLOCK,
+        OUTPUT_DROP,
+        OUTPUT_DECIMATE
+    };
+
+    /* How frames are stored. */
+    enum OutputFormat
+    {
+        OUTPUT_RAW,         // floats, see above
+        OUTPUT_COMPACT      // quantized and delta-coded, see codec.hpp
+    };
+
+    struct TrajectoryHeader
+    {
+        char magic[8];
+        uint32_t version;
+        uint32_t num;
+        int32_t width, height;
+        int32_t every;      // steps between frames, as asked for
+        int32_t first;      // step of the state the run started from
+    };
+
+    /**
+     * @brief A snapshot of the state, indexed by boid id.
+     */
+    struct TrajectoryFrame
+    {
+        int step;
+        float *x, *y, *vx, *vy;
+    };
+
+    /**
+     * @brief The frame pool, its queues and the writer thread.
+     *
+     * Frames cycle free -> queued -> free; both queues are rings of frame
+     * indices guarded by lock.
+     */
+    struct Trajectory
+    {
+        FILE *file;
+        TrajectoryFrame *frames;
+        int nframes;
+        int num;
+        int every;
+        int policy;                 // one of OutputPolicy
+        int format;                 // one of OutputFormat
+        Encoder encoder;            // of the compact format, used by the writer only
+        std::atomic<int> stride;    // current multiple of every, > 1 only when decimating
+
+        int *freeRing, freeHead, freeCount;
+        int *queueRing, queueHead, queueCount;
+        bool closing;
+        std::mutex lock;
+        std::condition_variable freed;   // a frame went back to the free ring
+        std::condition_variable queued;  // a frame was queued, or closing was set
+        std::thread writer;
+
+        // Statistics, reported by trajectory_close
+        long written, dropped, bytes;
+        int maxQueued, maxStride;
+        double writeTime;           // of the writer thread
+        double waitTime;            // of the step loop, blocking for frames
+        bool failed;                // a write failed; later frames are dropped
+    };
+
+    bool trajectory_open(Trajectory &t, const char *path, struct Params p);
+
+    bool trajectory_due(const Trajectory &t, int step);
+
+    void trajectory_push(Trajectory &t, struct Params p, const int *ids,
+                         const float *xp, const float *yp, const float *xv, const float *yv);
+
+    void trajectory_close(Trajectory &t);
+
+}
+#endif
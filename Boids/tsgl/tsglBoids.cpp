@@ -7,81 +7,202 @@ ethanScheelk@gmail.com
 
 #include <tsgl.h>
 #include "boids.hpp"
+#include "backends.hpp"
+#include "numa.hpp"
+#include "prof.hpp"
+#include "latency.hpp"
+#include "checkpoint.hpp"
+#include "trajectory.hpp"
+#include "display.hpp"
+#include "density.hpp"
 #include "misc.h"
 #include <omp.h>
 #include "GetArguments.hpp"
 
 #include <stdio.h>
 #include <stdlib.h>
-#include <vector>
 #include <memory>
+#include <functional>
+#include <atomic>
+#include <thread>
 
 using namespace tsgl;
 
-class boid
-{
-private:
-    std::unique_ptr<Arrow> _arrow;
-    Canvas &_can;
+/* Size of a boid's triangle on the canvas, in pixels */
+#define BOID_LENGTH 20
+#define BOID_WIDTH 12
 
+/* Frames in a row over -lodBudget before the canvas draws the density */
+#define LOD_SLOW_FRAMES 3
+/* Density frames between trial updates of the hidden boids */
+#define LOD_PROBE_FRAMES 60
+/* Share of -lodBudget that LOD_SLOW_FRAMES trials in a row must stay under
+   before the canvas draws the boids again */
+#define LOD_FAST_SHARE 0.5
+
+/**
+ * @brief Every boid as one TSGL shape: a triangle per boid, pointing the way
+ * it flies, all in one vertex array that the canvas uploads and draws with a
+ * single call per frame.
+ *
+ * One Arrow per boid cost a drawable each, and three calls per boid per step
+ * that each took the arrow's lock. Here the drawing thread takes the lock
+ * once, writes the vertices of every boid straight from the state arrays,
+ * and hands the whole frame over when it unlocks.
+ */
+class BoidBatch : public Shape
+{
 public:
     /**
-     * @brief Construct a new boid object, which is only ever stored on the CPU.
-     * We use pointer arrays so we don't have to send my boid objects to the GPU.
+     * @brief Construct the vertex and color arrays for num boids, all at the
+     * origin until the first update
      *
-     * All actual boid calculations are used on the pointer arrays. Once those
-     * calculations are complete, update all "physical" boids (this class).
-     *
-     * @param x
-     * @param y
-     * @param can
+     * @param num
      */
-    boid(float x, float y, int index, Canvas &can) : _can(can)
+    BoidBatch(int num) : Shape(0, 0, 0, 0, 0, 0)
     {
-        _arrow = std::make_unique<Arrow>(
-            x, y, 0,
-            20, 20,
-            0, 0, 0,
-            CYAN);
-        _can.add(_arrow.get()); // Unfortunately the canvas wants a Drawable* rather than a smart pointer :|
+        numberOfVertices = 3 * num;
+        geometryType = GL_TRIANGLES;
+        vertices = new GLfloat[numberOfVertices * 3]();
+        colors = new GLfloat[numberOfVertices * 4]();
+        init = true;
     }
 
     /**
-     * @brief Destroy the boid object
-     *
+     * @brief Hold off the canvas while a frame is written.
      */
-    ~boid()
+    void lock()
     {
-        _can.remove(_arrow.get());
+        attribMutex.lock();
     }
 
-    void setColor(tsgl::ColorFloat color)
+    void unlock()
     {
-        color.A = 0.9;
-        _arrow->setColor(color);
+        attribMutex.unlock();
     }
 
-    void updatePosition(float x, float y)
+    void setColor(int i, tsgl::ColorFloat color)
     {
-        _arrow->setCenter(x, y, 0);
+        GLfloat *c = &colors[12 * i];
+
+        for (int k = 0; k < 3; k++)
+        {
+            c[4 * k] = color.R;
+            c[4 * k + 1] = color.G;
+            c[4 * k + 2] = color.B;
+            c[4 * k + 3] = 0.9;
+        }
     }
 
     /**
-     * @brief Update's the boid's rotation to be facing the correct way based on given velocity.
+     * @brief Move boid i's triangle to (x, y), its tip along the velocity.
      *
      * The TSGL canvas has 0,0 in the center where the top right corner has (positive, positive) coordinates (Quadrant I)
      *
+     * @param i
+     * @param x
+     * @param y
      * @param velx
      * @param vely
      */
-    void updateDirection(float velx, float vely)
+    void update(int i, float x, float y, float velx, float vely)
     {
-        float yaw = atan(vely / velx) * 180. / PI;
-        if (velx > 0)
+        GLfloat *v = &vertices[9 * i];
+        float speed = sqrtf(velx * velx + vely * vely);
+        float ux = (speed > 0) ? velx / speed : 1;  // heading
+        float uy = (speed > 0) ? vely / speed : 0;
+        float hx = ux * (BOID_LENGTH / 2.0f), hy = uy * (BOID_LENGTH / 2.0f);
+        float wx = -uy * (BOID_WIDTH / 2.0f), wy = ux * (BOID_WIDTH / 2.0f);
+
+        // Tip, then the two corners of the tail
+        v[0] = x + hx;
+        v[1] = y + hy;
+        v[2] = 0;
+        v[3] = x - hx + wx;
+        v[4] = y - hy + wy;
+        v[5] = 0;
+        v[6] = x - hx - wx;
+        v[7] = y - hy - wy;
+        v[8] = 0;
+    }
+};
+
+/**
+ * @brief The density of the boids as one TSGL shape: two triangles per cell
+ * of a density.hpp grid, which stay put while their colors are rewritten
+ * once per frame.
+ */
+class DensityMap : public Shape
+{
+private:
+    boids::Density _density;
+
+public:
+    /**
+     * @brief Construct the grid of p.lodCell pixel cells over the world
+     *
+     * @param p
+     */
+    DensityMap(boids::Params p) : Shape(0, 0, 0, 0, 0, 0)
+    {
+        boids::density_init(_density, p, p.lodCell);
+        numberOfVertices = 6 * _density.cols * _density.rows;
+        geometryType = GL_TRIANGLES;
+        vertices = new GLfloat[numberOfVertices * 3];
+        colors = new GLfloat[numberOfVertices * 4]();
+        init = true;
+
+        // Row-major from the bottom left, as density_shade writes the colors
+        GLfloat *v = vertices;
+        for (int row = 0; row < _density.rows; row++)
         {
-            yaw += 180;
+            for (int col = 0; col < _density.cols; col++)
+            {
+                float x0 = -p.width / 2 + col * _density.cell, x1 = MIN(x0 + _density.cell, p.width / 2.0f);
+                float y0 = -p.height / 2 + row * _density.cell, y1 = MIN(y0 + _density.cell, p.height / 2.0f);
+                float corners[6][2] = {{x0, y0}, {x1, y0}, {x1, y1}, {x0, y0}, {x1, y1}, {x0, y1}};
+
+                for (auto &c : corners)
+                {
+                    *v++ = c[0];
+                    *v++ = c[1];
+                    *v++ = 0;
+                }
+            }
         }
-        _arrow->setYaw(yaw);
+    }
+
+    ~DensityMap()
+    {
+        boids::density_free(_density);
+    }
+
+    int cols()
+    {
+        return _density.cols;
+    }
+
+    int rows()
+    {
+        return _density.rows;
+    }
+
+    /**
+     * @brief Splat a frame, then recolor every cell under the shape's lock.
+     *
+     * @param p
+     * @param x
+     * @param y
+     * @param vx
+     * @param vy
+     */
+    void update(boids::Params p, const float *x, const float *y, const float *vx, const float *vy)
+    {
+        boids::density_splat(_density, p, x, y, vx, vy);
+
+        attribMutex.lock();
+        boids::density_shade(_density, p, p.lodHeading, colors, 6);
+        attribMutex.unlock();
     }
 };
 
@@ -93,8 +214,33 @@ float *xp; // x, y positions
 float *yp;
 float *xv; // x, y velocities
 float *yv;
-float *xnv; // new x, y velocities
+float *xnp; // new x, y positions (back buffer)
+float *ynp;
+float *xnv; // new x, y velocities (back buffer)
 float *ynv;
+int *ids;  // ids[i] is the stable id (and drawable) of the boid in slot i
+
+// The step kernel chosen with -backend and the structures it keeps
+const boids::Backend *backend;
+boids::Workspace work;
+
+// Step latency histograms, with -latency
+boids::Latency latency;
+
+// Step of the last checkpoint written, with -checkpoint
+int checkpointed = -1;
+
+// Frame pool and writer thread, with -output
+boids::Trajectory trajectory;
+
+// The compact trajectory being drawn, with -replay
+boids::Decoder replay;
+
+// The steps handed from the simulation to the drawing thread, on the canvas
+boids::Display display;
+
+// Set by the drawing thread once the window is closed, to stop the simulation
+std::atomic<bool> stopSimulation(false);
 
 // An array of TSGL colors
 ColorFloat arr[] = {WHITE, BLUE, CYAN, YELLOW, GREEN, ORANGE, BROWN, PURPLE};
@@ -113,110 +259,95 @@ void initiateBoidArrays(
     float *xp, float *yp,
     float *xv, float *yv)
 {
-    for (int i = 0; i < p.num; ++i)
-    {
-        xp[i] = random_range(-p.width / 2, p.width / 2);
-        yp[i] = random_range(-p.height / 2, p.height / 2);
-        xv[i] = random_range(-1., 1.);
-        yv[i] = random_range(-1., 1.);
-        boids::norm(&xv[i], &yv[i]);
-    }
+    // Parallel and independent of the thread count, see rng.hpp
+    boids::random_boids(p, xp, yp, xv, yv);
 }
 
 /**
- * @brief Once all the arrays have filled, fill the array of boid class objects for drawing
+ * @brief Place the pages of the freshly allocated global arrays on the NUMA
+ * node of the thread that will compute them, before anything else writes them
  *
  * @param p
- * @param boidDraw
- * @param xp
- * @param yp
- * @param xv
- * @param yv
- * @param canvasP
  */
-void initiateBoidDraw(
-    struct boids::Params p,
-    std::vector<std::unique_ptr<boid>> &boidDraw,
-    float *xp, float *yp,
-    float *xv, float *yv,
-    Canvas &canvasP)
+void placeBoidArrays(struct boids::Params p)
 {
-    for (int i = 0; i < p.num; ++i)
+    float *arrays[] = {xp, yp, xv, yv, xnp, ynp, xnv, ynv};
+
+    for (float *a : arrays)
     {
-        boidDraw[i] = std::make_unique<boid>(xp[i], yp[i], i, canvasP);
-        boidDraw[i]->updateDirection(xv[i], yv[i]);
+        boids::first_touch(p, a, p.num);
     }
+    boids::first_touch(p, ids, p.num);
+
+    boids::placement_report(p, "xp", xp, p.num);
 }
 
 /**
- * @brief Compute a single iteration of boid movement. No draw updates.
- * Intended for speed testing.
+ * @brief Snapshot the global state to p.checkpoint every p.checkpointEvery
+ * steps, or now if final
  *
  * @param p
- * @param xp
- * @param yp
- * @param xv
- * @param yv
- * @param xnv
- * @param ynv
+ * @param final write even between periods, e.g. at exit
  */
-void boidIteration(
-    boids::Params p,
-    float *xp, float *yp,
-    float *xv, float *yv,
-    float *xnv, float *ynv)
+void checkpointBoids(boids::Params p, bool final)
 {
-    boids::compute_new_headings(p, xp, yp, xv, yv, xnv, ynv);
-
-    for (int i = 0; i < p.num; ++i)
+    if (p.checkpoint == NULL || p.step == checkpointed)
+    {
+        return;
+    }
+    if (!final && (p.checkpointEvery <= 0 || p.step % p.checkpointEvery != 0))
     {
-        xv[i] = xnv[i];
-        yv[i] = ynv[i];
-        xp[i] += xv[i] * p.dt;
-        yp[i] += yv[i] * p.dt;
+        return;
+    }
 
-        // Wrap around screen coordinates
-        if (xp[i] < -p.width / 2)
-        {
-            xp[i] += p.width;
-        }
-        else if (xp[i] >= p.width / 2)
-        {
-            xp[i] -= p.width;
-        }
+    PROF_BEGIN(output);
+    double t = omp_get_wtime();
+    if (boids::checkpoint_write(p.checkpoint, p, ids, xp, yp, xv, yv))
+    {
+        fprintf(stderr, "Checkpoint of step %d written to %s in %.3f s\n",
+                p.step, p.checkpoint, omp_get_wtime() - t);
+        checkpointed = p.step;
+    }
+    PROF_END(output, boids::PROF_OUTPUT);
+}
 
-        if (yp[i] < -p.height / 2)
-        {
-            yp[i] += p.height;
-        }
-        else if (yp[i] >= p.height / 2)
-        {
-            yp[i] -= p.height;
-        }
+/**
+ * @brief Hand the global state to the trajectory writer if a frame is due
+ *
+ * @param p
+ */
+void outputBoids(boids::Params p)
+{
+    if (p.output == NULL || !boids::trajectory_due(trajectory, p.step))
+    {
+        return;
     }
+
+    PROF_BEGIN(output);
+    boids::trajectory_push(trajectory, p, ids, xp, yp, xv, yv);
+    PROF_END(output, boids::PROF_OUTPUT);
 }
 
 /**
- * @brief Compute a single iteration of movement, with draw updates to the canvas.
+ * @brief Update the canvas drawables from a frame of the state in boid id
+ * order, as published to the display or read from a trajectory.
  *
  * @param p
- * @param xp
- * @param yp
- * @param xv
- * @param yv
- * @param xnv
+ * @param xnp the x positions of the frame
+ * @param ynp
+ * @param xnv the x velocities of the frame
  * @param ynv
- * @param boidDraw vector of boids, pre-created to exact size, to be passed by reference
+ * @param owner the simulation thread of each boid, or NULL to color by the
+ *        thread updating it here
+ * @param boidDraw the shape of all boids, locked for the whole frame
  */
 void boidDrawIteration(
     boids::Params p,
-    float *xp, float *yp,
-    float *xv, float *yv,
-    float *xnv, float *ynv,
-    std::vector<std::unique_ptr<boid>> &boidDraw)
+    const float *xnp, const float *ynp,
+    const float *xnv, const float *ynv,
+    const int *owner,
+    BoidBatch &boidDraw)
 {
-    boids::compute_new_headings(p, xp, yp, xv, yv, xnv, ynv);
-
 /// \todo Make boid colors display
 /*
     The student should do this by adding something along the lines of the following:
@@ -227,7 +358,7 @@ void boidDrawIteration(
         #pragma acc parallel loop independent collapse(1) num_gangs(p.threads)
 
     Additionally, to set the color of the boids they must add the line:
-        boidDraw[i]->setColor(arr[omp_get_thread_num() % 8]);
+        boidDraw.setColor(i, arr[omp_get_thread_num() % 8]);
         (or something like it, must access thread num and set color based on it)
 
     This properly shows which CPU thread is updating which boid since we
@@ -236,81 +367,345 @@ void boidDrawIteration(
     the same boid, due to default implementation of block-splitting.
 
     Do not do this on the GPU.
+
+    Now that the canvas draws on its own thread, the simulation publishes
+    which of its threads copied each boid (see display_publish) and that
+    is the color; replays have no such record and keep the above.
 */
+    boidDraw.lock();
+
     #if defined(OMP) && !defined(MC)
-    #pragma omp parallel for shared(xp, yp, xv, yv, xnv, ynv) collapse(1) num_threads(p.threads)
+    #pragma omp parallel for shared(xnp, ynp, xnv, ynv) collapse(1) num_threads(p.threads)
     #elif defined(MC) && !defined(OMP)
     #pragma acc parallel loop independent collapse(1) num_gangs(p.threads)
     #endif
     for (int i = 0; i < p.num; ++i)
     {
-        xv[i] = xnv[i];
-        yv[i] = ynv[i];
-        xp[i] += xv[i] * p.dt;
-        yp[i] += yv[i] * p.dt;
+        boidDraw.update(i, xnp[i], ynp[i], xnv[i], ynv[i]);
+
+        // debug: use print below with small numer of boids and small iterations
+        // printf("t %d\n", omp_get_thread_num());
+        // color of boid based on version
+        #if defined(OMP) || defined(MC)
+            boidDraw.setColor(i, arr[(owner != NULL ? owner[i] : omp_get_thread_num()) % 8]);
+	    #elif defined(GPU)
+            boidDraw.setColor(i, arr[0]);
+	    #endif
+
+    }
+
+    boidDraw.unlock();
+}
+
+/**
+ * @brief What the canvas shows of the boids: their triangles or, from -lod
+ * boids on or while the triangles overrun -lodBudget, their density.
+ *
+ * Both shapes are kept once made and only the one shown is on the canvas.
+ * A switch for the budget waits for a few frames in a row either way, and
+ * going back waits for the triangles to fit well within it, so the view
+ * does not flicker between the two around the budget.
+ */
+class BoidView
+{
+private:
+    Canvas &_can;
+    std::unique_ptr<BoidBatch> _boids;
+    std::unique_ptr<DensityMap> _density;
+    bool _dense;  // the density is on the canvas rather than the boids
+    bool _probe;  // it is there for -lodBudget, so try the boids now and then
+    int _slow;    // boid frames in a row over -lodBudget
+    int _fast;    // trials in a row well within it
+    int _frames;  // density frames since the last trial
+
+    void showDensity(boids::Params p)
+    {
+        if (!_density)
+        {
+            _density = std::make_unique<DensityMap>(p);
+        }
+        if (_boids && !_dense)
+        {
+            _can.remove(_boids.get());
+        }
+        _can.add(_density.get());
+        _dense = true;
+        _fast = _frames = 0;
+        fprintf(stderr, "Drawing the density of %d boids in %dx%d cells\n", p.num, _density->cols(), _density->rows());
+    }
 
-        // Wrap around screen coordinates
-        if (xp[i] < -p.width / 2)
+    void showBoids(boids::Params p)
+    {
+        if (!_boids)
         {
-            xp[i] += p.width;
+            _boids = std::make_unique<BoidBatch>(p.num);
         }
-        else if (xp[i] >= p.width / 2)
+        if (_density && _dense)
         {
-            xp[i] -= p.width;
+            _can.remove(_density.get());
         }
+        _can.add(_boids.get()); // Unfortunately the canvas wants a Drawable* rather than a smart pointer :|
+        _dense = false;
+        _slow = 0;
+    }
 
-        if (yp[i] < -p.height / 2)
+public:
+    /**
+     * @brief Once all the arrays have filled, create the shape to draw, show
+     * the state of the arrays and add it to the canvas
+     *
+     * @param p
+     * @param xp
+     * @param yp
+     * @param xv
+     * @param yv
+     * @param canvasP
+     */
+    BoidView(boids::Params p,
+             const float *xp, const float *yp,
+             const float *xv, const float *yv,
+             Canvas &canvasP) : _can(canvasP), _dense(false), _probe(false), _slow(0), _fast(0), _frames(0)
+    {
+        if (p.lod > 0 && p.num >= p.lod)
         {
-            yp[i] += p.height;
+            showDensity(p);
         }
-        else if (yp[i] >= p.height / 2)
+        else
         {
-            yp[i] -= p.height;
+            showBoids(p);
         }
+        draw(p, xp, yp, xv, yv);
+    }
 
-        boidDraw[i]->updatePosition(xp[i], yp[i]);
-        boidDraw[i]->updateDirection(xv[i], yv[i]);
+    ~BoidView()
+    {
+        _can.remove(_dense ? (Drawable *)_density.get() : _boids.get());
+    }
 
-        // debug: use print below with small numer of boids and small iterations
-        // printf("t %d\n", omp_get_thread_num());
-        // color of boid based on version
-        #if defined(OMP) || defined(MC)
-            boidDraw[i]->setColor(arr[omp_get_thread_num() % 8]);
-	    #elif defined(GPU)
-            boidDraw[i]->setColor(arr[0]);
-	    #endif
+    /**
+     * @brief Show a frame of the state in boid id order.
+     *
+     * @param p
+     * @param xnp
+     * @param ynp
+     * @param xnv
+     * @param ynv
+     * @param owner the simulation thread of each boid, if known
+     */
+    void draw(boids::Params p,
+              const float *xnp, const float *ynp,
+              const float *xnv, const float *ynv,
+              const int *owner = NULL)
+    {
+        if (_dense && !(_probe && ++_frames >= LOD_PROBE_FRAMES))
+        {
+            _density->update(p, xnp, ynp, xnv, ynv);
+            return;
+        }
 
+        double t = omp_get_wtime();
+        boidDrawIteration(p, xnp, ynp, xnv, ynv, owner, *_boids);
+        t = omp_get_wtime() - t;
+
+        if (_dense)
+        {
+            // A trial on the hidden boids, which now hold this frame too
+            _frames = 0;
+            _fast = (1e3 * t < LOD_FAST_SHARE * p.lodBudget) ? _fast + 1 : 0;
+            if (_fast >= LOD_SLOW_FRAMES)
+            {
+                fprintf(stderr, "Updating the boids took %.1f ms per frame, well within -lodBudget %.1f\n", 1e3 * t, p.lodBudget);
+                showBoids(p);
+            }
+            else
+            {
+                _density->update(p, xnp, ynp, xnv, ynv);
+            }
+            return;
+        }
+
+        // A few slow frames in a row, not one hiccup
+        _slow = (p.lodBudget > 0 && 1e3 * t > p.lodBudget) ? _slow + 1 : 0;
+        if (_slow >= LOD_SLOW_FRAMES)
+        {
+            fprintf(stderr, "Updating the boids took %.1f ms per frame, over -lodBudget %.1f\n", 1e3 * t, p.lodBudget);
+            showDensity(p);
+            _probe = true;
+            // Not the empty grid until the next frame
+            _density->update(p, xnp, ynp, xnv, ynv);
+        }
+    }
+};
+
+/**
+ * @brief Run the remaining steps on the global state, writing latency,
+ * trajectory frames and checkpoints along the way
+ *
+ * @param show publish every step to the display instead of printing progress
+ */
+void simulate(bool show)
+{
+    for (int i = 0; i < p.steps && !stopSimulation;)
+    {
+        // Every step up to the next progress message in one call, so
+        // backends with a run entry point keep their threads alive;
+        // one step per call when each step is timed or shown on its own
+        int n = (p.latency > 0 || show) ? 1 : MIN((i + 49) / 50 * 50, p.steps - 1) - i + 1;
+        if (p.checkpointEvery > 0)
+        {
+            // Stop at the next checkpoint too
+            n = MIN(n, p.checkpointEvery - p.step % p.checkpointEvery);
+        }
+        if (p.output != NULL)
+        {
+            // and at the next frame
+            n = MIN(n, p.outputEvery - p.step % p.outputEvery);
+        }
+        double s = omp_get_wtime();
+        boids::backend_advance(backend, p, work, n, &ids, &xp, &yp, &xv, &yv, &xnp, &ynp, &xnv, &ynv);
+        double simulated = omp_get_wtime() - s;
+        if (show)
+        {
+            boids::display_publish(display, p, ids, xp, yp, xv, yv);
+        }
+        outputBoids(p);
+        checkpointBoids(p, false);
+        if (p.latency > 0)
+        {
+            boids::latency_record(latency, p.step - 1, omp_get_wtime() - s, simulated);
+        }
+        i += n;
+        if (!show && (i - 1) % 50 == 0)
+        {
+            fprintf(stderr, "\tit %d done\n", i - 1);
+        }
+    }
+}
+
+/**
+ * @brief The drawing thread: show the latest published step once per display
+ * frame until the window is closed, then stop the simulation
+ *
+ * @param canvas
+ * @param view
+ * @param p a copy, the simulation keeps changing the global one
+ */
+void drawBoids(Canvas &canvas, BoidView &view, boids::Params p)
+{
+    while (canvas.isOpen())
+    {
+        const boids::TrajectoryFrame *frame = boids::display_take(display);
+        if (frame != NULL)
+        {
+            double t = omp_get_wtime();
+            view.draw(p, frame->x, frame->y, frame->vx, frame->vy, boids::display_owners(display));
+            double end = omp_get_wtime();
+
+            // All on this thread's own histograms and profile slot
+            boids::histogram_record(display.draw, end - t);
+            if (p.latency > 0)
+            {
+                boids::latency_record_draw(latency, end - t);
+            }
+            #if defined(PROFILE)
+            boids::prof_draw(frame->step, t, end);
+            #endif
+        }
+        // Wait for the next display frame rather than spin, also once the
+        // simulation is done
+        canvas.sleep();
     }
+    stopSimulation = true;
 }
 
 /**
  * @brief The function that the canvas runs when it is created (passed as function pointer)
  *
+ * Simulates on this thread at full speed while drawBoids draws on its own,
+ * so neither waits for the other (see display.hpp).
+ *
  * @param canvas
  */
 void tsglScreen(Canvas &canvas)
 {
-    initiateBoidArrays(p, xp, yp, xv, yv);
+    BoidView view(p, xp, yp, xv, yv, canvas);
+
+    boids::display_init(display, p);
+    std::thread drawer(drawBoids, std::ref(canvas), std::ref(view), p);
+    #if defined(OMP)
+    boids::pin_restore();
+    #endif
+
+    simulate(true);
+
+    // The drawer keeps the last step on screen until the window is closed
+    drawer.join();
+    boids::display_free(display);
+}
+
+/**
+ * @brief The function the canvas runs with -replay: draw the frames of the
+ * trajectory, one per display frame, instead of simulating
+ *
+ * @param canvas
+ */
+void tsglReplay(Canvas &canvas)
+{
+    int frame = boids::decoder_find(replay, p.replayFrom);
+    int frames = replay.index.size();
+
+    if (frame < 0 || !boids::decoder_read(replay, frame, xp, yp, xv, yv))
+    {
+        fprintf(stderr, "%s has no frame to replay\n", p.replay);
+        return;
+    }
 
-    std::vector<std::unique_ptr<boid>> boidDraw(p.num);
-    initiateBoidDraw(p, boidDraw, xp, yp, xv, yv, canvas);
+    BoidView view(p, xp, yp, xv, yv, canvas);
 
-    int step = 0;
-    unsigned complete = 0;
     while (canvas.isOpen())
     {
-        if (!complete) {
-        /*
-            Slows down the canvas.
-            Keep if testing low boid counts
-        */
-        // canvas.sleep();
+        if (++frame < frames)
+        {
+            if (!boids::decoder_read(replay, frame, xp, yp, xv, yv))
+            {
+                fprintf(stderr, "%s is damaged at step %d\n", p.replay, replay.index[frame].step);
+                frames = frame;
+                continue;
+            }
+            PROF_BEGIN(draw);
+            view.draw(p, xp, yp, xv, yv);
+            PROF_END(draw, boids::PROF_DRAW);
+        }
+        // Wait for the next display frame rather than spin
+        canvas.sleep();
+    }
+}
 
-            boidDrawIteration(p, xp, yp, xv, yv, xnv, ynv, boidDraw);
+/**
+ * @brief Decode the frames of the -replay trajectory without drawing them,
+ * and report how fast that goes
+ *
+ * @param p
+ */
+void replayNoDraw(boids::Params p)
+{
+    int first = boids::decoder_find(replay, p.replayFrom);
+    int frames = replay.index.size();
+    double t1 = omp_get_wtime();
 
-            if (step++ > p.steps) complete = 1;
+    for (int frame = MAX(first, 0); first >= 0 && frame < frames; frame++)
+    {
+        if (!boids::decoder_read(replay, frame, xp, yp, xv, yv))
+        {
+            fprintf(stderr, "%s is damaged at step %d\n", p.replay, replay.index[frame].step);
+            frames = frame;
         }
     }
+
+    double t2 = omp_get_wtime();
+    int decoded = frames - MAX(first, 0);
+    fprintf(stderr, "Decoded %d frames of %d boids in %lf seconds (%.0f frames/s)\n",
+            decoded, p.num, t2 - t1, decoded / (t2 - t1));
 }
 
 /**
@@ -347,45 +742,219 @@ int main(int argc, char *argv[])
 
     // Type -help at runtime for description of inputs
     get_arguments(argc, argv, p, noDraw);
-    srandom(p.seed);
+
+    if (p.replay != NULL)
+    {
+        // The trajectory decides the boids and the world
+        if (!boids::decoder_open(replay, p.replay))
+        {
+            exit(1);
+        }
+        p.num = replay.header.num;
+        p.width = replay.header.width;
+        p.height = replay.header.height;
+        if (p.restart != NULL || p.checkpoint != NULL || p.output != NULL)
+        {
+            fprintf(stderr, "-restart, -checkpoint and -output do not apply to a replay, ignoring them\n");
+            p.restart = NULL;
+            p.checkpoint = NULL;
+            p.output = NULL;
+        }
+        fprintf(stderr, "Replaying %zu frames of %d boids from %s\n", replay.index.size(), p.num, p.replay);
+    }
+
+    boids::Checkpoint restart;
+    if (p.restart != NULL)
+    {
+        // The boid count and world size must be known before allocating
+        if (!boids::checkpoint_open(p.restart, restart))
+        {
+            exit(1);
+        }
+        p = boids::checkpoint_params(restart, p);
+        fprintf(stderr, "Restarting from %s at step %d, with its %d boids and rules\n",
+                p.restart, p.step, p.num);
+    }
+
+    #if defined(OMP)
+    if (p.numa || p.pin != boids::PIN_NONE)
+    {
+        boids::numa_report(p);
+    }
+    if (p.pin != boids::PIN_NONE)
+    {
+        boids::pin_threads(p);
+    }
+    #else
+    if (p.numa || p.pin != boids::PIN_NONE)
+    {
+        fprintf(stderr, "-numa and -pin need the OpenMP build, ignoring them\n");
+        p.numa = 0;
+        p.pin = boids::PIN_NONE;
+    }
+    #endif
+
+    backend = boids::backend_get(p.backend);
+    fprintf(stderr, "Backend %s: %s\n", backend->name, backend->help);
+    backend->init(p, work);
+
+    if (p.reorder > 0 && backend->reorder == NULL)
+    {
+        fprintf(stderr, "-reorder needs the grid or verlet backend, ignoring it\n");
+        p.reorder = 0;
+    }
+
+    #if defined(PROFILE)
+    if (p.profile != NULL && !boids::prof_open(p.profile))
+    {
+        fprintf(stderr, "Cannot write %s\n", p.profile);
+        exit(1);
+    }
+    if (p.trace != NULL && !boids::prof_trace_open(p))
+    {
+        fprintf(stderr, "Cannot write %s\n", p.trace);
+        exit(1);
+    }
+    if (p.perf)
+    {
+        // After the backend's init, which may change the thread count
+        boids::prof_perf_init(p);
+    }
+    #else
+    if (p.profile != NULL || p.trace != NULL || p.perf)
+    {
+        fprintf(stderr, "-profile, -trace and -perf need a build with PROFILE=1, ignoring them\n");
+        p.profile = NULL;
+        p.trace = NULL;
+        p.perf = 0;
+    }
+    #endif
 
     xp = new float[p.num];
     yp = new float[p.num];
     xv = new float[p.num];
     yv = new float[p.num];
+    xnp = new float[p.num];
+    ynp = new float[p.num];
     xnv = new float[p.num];
     ynv = new float[p.num];
+    ids = new int[p.num];
+
+    #if defined(OMP)
+    if (p.numa)
+    {
+        placeBoidArrays(p);
+    }
+    #endif
+
+    if (p.restart != NULL)
+    {
+        boids::checkpoint_load(restart, p, ids, xp, yp, xv, yv);
+        boids::checkpoint_close(restart);
+    }
+    else
+    {
+        for (int i = 0; i < p.num; ++i)
+        {
+            ids[i] = i;
+        }
+        initiateBoidArrays(p, xp, yp, xv, yv);
+    }
+
+    if (p.latency > 0)
+    {
+        boids::latency_init(latency, p.latency, p.step);
+    }
+
+    if (p.output != NULL)
+    {
+        p.outputEvery = MAX(1, p.outputEvery);
+        #if defined(OMP)
+        // The writer thread should not share the simulation's pinned CPU
+        boids::pin_release();
+        #endif
+        if (!boids::trajectory_open(trajectory, p.output, p))
+        {
+            exit(1);
+        }
+        #if defined(OMP)
+        boids::pin_restore();
+        #endif
+        outputBoids(p);
+    }
+
+    if (p.replay != NULL)
+    {
+        if (noDraw)
+        {
+            replayNoDraw(p);
+        }
+        else
+        {
+            #if defined(OMP)
+            boids::pin_release();
+            #endif
+            Canvas can(-1, -1, p.width, p.height, "Boids", BLACK);
+            can.run(tsglReplay);
+        }
+        boids::decoder_close(replay);
+    }
 
     // Run with -noDraw flag for timing
-    if (noDraw)
+    else if (noDraw)
     {
         // Testing, run without canvas for true speed tests
-        initiateBoidArrays(p, xp, yp, xv, yv);
         fprintf(stderr, "Boid size of %d starting\n", p.num);
         double t1 = omp_get_wtime();
-        for (int i = 0; i < p.steps; ++i)
-        {
-            boidIteration(p, xp, yp, xv, yv, xnv, ynv);
-            if (i % 50 == 0)
-            {
-                fprintf(stderr, "\tit %d done\n", i);
-            }
-        }
+        simulate(false);
         double t2 = omp_get_wtime();
         fprintf(stderr, "\n%lf seconds (stdout below)\n\n", t2 - t1);
         fprintf(stdout, "%lf", t2 - t1);
+
+        if (backend->allPairs)
+        {
+            // Every boid is tested against every other boid each step
+            double pairs = (double)p.steps * p.num * (p.num - 1);
+            fprintf(stderr, "\n%.3e pair interactions per second\n", pairs / (t2 - t1));
+        }
     }
 
     else
     {
+        #if defined(OMP)
+        // TSGL's threads and the drawer's take every CPU; tsglScreen pins
+        // this thread again once they are started
+        boids::pin_release();
+        #endif
         Canvas can(-1, -1, p.width, p.height, "Boids", BLACK);
         can.run(tsglScreen);
     }
 
+    checkpointBoids(p, true);
+
+    if (p.output != NULL)
+    {
+        boids::trajectory_close(trajectory);
+    }
+
     delete[] xp;
     delete[] yp;
     delete[] xv;
     delete[] yv;
+    delete[] xnp;
+    delete[] ynp;
     delete[] xnv;
     delete[] ynv;
+    delete[] ids;
+
+    if (p.latency > 0)
+    {
+        boids::latency_report(latency);
+    }
+
+    backend->finish(p, work);
+
+    #if defined(PROFILE)
+    boids::prof_report(p);
+    #endif
 }
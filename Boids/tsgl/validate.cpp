@@ -0,0 +1,363 @@
+/*
+    Side-by-side check of a backend against the reference loop, without TSGL.
+
+    Float reassociation (vector lanes, tiles, cell order, -Ofast) keeps the
+    fast kernels from matching compute_new_headings bit for bit, and the
+    flocking dynamics amplify any difference, so equality is not the test.
+    Both backends start from the same seed and step in lockstep; after
+    every step the states are matched up by boid id (reordering permutes
+    the slots) and compared:
+
+      - max and RMS distance between the two positions of each boid
+        (minimum image, so a boid that wrapped on one side only is close)
+      - max and RMS difference of the velocities
+      - pairs within the largest active rule radius in one run only, and
+        the boids whose neighbor set differs (each from its own positions)
+      - for grid and verlet, the pairs within that radius that the
+        candidate's step did not test, from its own cell or neighbor lists
+
+    One TSV row per step goes to stdout (or -out). The flocking dynamics
+    amplify round-off exponentially, so after a few dozen steps even a
+    correct kernel drifts past any fixed bound; -tol and -vtol therefore
+    only apply to the first -gate steps, while the deviation is still the
+    kernel's own rounding. The exit status is 1 if a step there exceeded
+    them, or if the candidate missed a pair at any step, so a script can
+    gate on it.
+
+    A deviation well below the tolerance that grows smoothly from step to
+    step is round-off being amplified; a jump on the first step, or missed
+    pairs, point at a kernel that misses or adds neighbors. A jump with no
+    missed pairs is usually a boid right on the edge of another's field of
+    view (-angle), which the vector kernels' fused dot product rounds to the
+    other side; from then on it grows like any other difference.
+
+    Every simulation option of tsglBoids applies to both runs; -backend
+    picks the candidate. Type -help for the validation options.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <omp.h>
+#include "misc.h"
+#include "boids.hpp"
+#include "rules.hpp"
+#include "backends.hpp"
+#include "GetArguments.hpp"
+
+
+/**
+ * @brief What to compare against and when to call it a failure.
+ */
+struct ValidateOptions
+{
+    int reference;              // index of the reference backend
+    double tol;                 // max position deviation, in pixels
+    double vtol;                // max velocity deviation
+    int gate;                   // steps over which tol and vtol apply
+    bool neighbors;             // compare the neighbor sets (O(num^2) per step)
+    const char *out;            // per-step TSV, NULL for stdout
+};
+
+/**
+ * @brief Deviations of one step.
+ */
+struct Deviation
+{
+    double maxPos, rmsPos;
+    double maxVel, rmsVel;
+    long pairs;                 // pairs that are neighbors in one run only
+    int boids;                  // boids whose neighbor set differs
+    long missed;                // pairs within reach the candidate did not test
+};
+
+/**
+ * @brief One run: its backend, parameters, workspace and state.
+ */
+struct Run
+{
+    const boids::Backend *b;
+    boids::Params p;
+    boids::Workspace w;
+    int *ids;
+    float *a[8];                // xp, yp, xv, yv and the back buffers
+    float *x, *y, *vx, *vy;     // the current state, indexed by boid id
+};
+
+static void print_validate_help()
+{
+    fprintf(stderr, "\nvalidateBoids runs -backend next to a reference backend and compares them.\n\n");
+    fprintf(stderr, "-reference\t[str]\tBackend to compare against (serial)\n");
+    fprintf(stderr, "-tol\t\t[float]\tMax position deviation, in pixels (0.01)\n");
+    fprintf(stderr, "-vtol\t\t[float]\tMax velocity deviation (0.001)\n");
+    fprintf(stderr, "-gate\t\t[int]\tSteps over which -tol and -vtol apply (10)\n");
+    fprintf(stderr, "-neighbors\t[int]\tCompare the neighbor sets and check for missed pairs (1)\n");
+    fprintf(stderr, "-out\t\t[file]\tWrite the per-step TSV here instead of stdout\n");
+    fprintf(stderr, "\nAll tsglBoids options below set the other parameters.\n");
+}
+
+/**
+ * @brief Take the validation options out of argv, leaving the rest for get_arguments.
+ *
+ * @return the new argc
+ */
+static int get_validate_arguments(int argc, char *argv[], ValidateOptions &o)
+{
+    int kept = 1;
+
+    for (int i = 1; i < argc; i++)
+    {
+        const char *a = argv[i];
+        const char *v = (i + 1 < argc) ? argv[i + 1] : NULL;
+
+        while (*a == '-')
+            a++;
+
+        if (v != NULL && strcmp(a, "reference") == 0)
+        {
+            o.reference = boids::backend_find(v);
+            if (o.reference < 0)
+            {
+                fprintf(stderr, "Unknown backend '%s'\n", v);
+                exit(1);
+            }
+        }
+        else if (v != NULL && strcmp(a, "tol") == 0)
+            o.tol = atof(v);
+        else if (v != NULL && strcmp(a, "vtol") == 0)
+            o.vtol = atof(v);
+        else if (v != NULL && strcmp(a, "gate") == 0)
+            o.gate = atoi(v);
+        else if (v != NULL && strcmp(a, "neighbors") == 0)
+            o.neighbors = atoi(v) != 0;
+        else if (v != NULL && strcmp(a, "out") == 0)
+            o.out = v;
+        else
+        {
+            if (strcmp(a, "help") == 0)
+                print_validate_help();
+            argv[kept++] = argv[i];
+            continue;
+        }
+        i++;
+    }
+
+    return kept;
+}
+
+/**
+ * @brief Set up backend index on the initial state of p.
+ */
+static void run_init(Run &r, boids::Params p, int index)
+{
+    r.b = boids::backend_get(index);
+    r.p = p;
+    r.p.backend = index;
+    r.b->init(r.p, r.w);
+
+    r.ids = new int[p.num];
+    for (int k = 0; k < 8; k++)
+        r.a[k] = new float[p.num];
+    r.x = new float[p.num];
+    r.y = new float[p.num];
+    r.vx = new float[p.num];
+    r.vy = new float[p.num];
+
+    for (int i = 0; i < p.num; i++)
+        r.ids[i] = i;
+    boids::random_boids(r.p, r.a[0], r.a[1], r.a[2], r.a[3]);
+}
+
+/**
+ * @brief Advance one step and gather the new state into id order.
+ */
+static void run_step(Run &r)
+{
+    boids::backend_advance(r.b, r.p, r.w, 1, &r.ids,
+                           &r.a[0], &r.a[1], &r.a[2], &r.a[3], &r.a[4], &r.a[5], &r.a[6], &r.a[7]);
+
+    for (int i = 0; i < r.p.num; i++)
+    {
+        int id = r.ids[i];
+
+        r.x[id] = r.a[0][i];
+        r.y[id] = r.a[1][i];
+        r.vx[id] = r.a[2][i];
+        r.vy[id] = r.a[3][i];
+    }
+}
+
+static void run_free(Run &r)
+{
+    r.b->finish(r.p, r.w);
+    for (int k = 0; k < 8; k++)
+        delete[] r.a[k];
+    delete[] r.ids;
+    delete[] r.x;
+    delete[] r.y;
+    delete[] r.vx;
+    delete[] r.vy;
+}
+
+/**
+ * @brief Compare the states of two runs, boid by boid.
+ *
+ * A pair counts as neighbors when its minimum-image distance is within the
+ * largest radius of the active rules, the same test the kernels use
+ * before evaluating the rules. Those sets only show a lost neighbor once
+ * the trajectories have drifted apart, so a candidate with cell or neighbor
+ * lists also counts the pairs its step skipped, straight from the lists.
+ *
+ * @param p
+ * @param ref
+ * @param cand just stepped
+ * @param neighbors also compare the neighbor sets and count missed pairs
+ */
+static Deviation compare(const boids::Params &p, const Run &ref, Run &cand, bool neighbors)
+{
+    Deviation d = {0, 0, 0, 0, 0, 0, 0};
+    float maxr2 = SQR(boids::rule_consts(p).maxr);
+    double sumPos = 0, sumVel = 0, maxPos = 0, maxVel = 0;
+    long pairs = 0;
+    int differing = 0;
+
+    #pragma omp parallel for reduction(+:sumPos, sumVel, pairs, differing) reduction(max:maxPos, maxVel) schedule(dynamic, 64) num_threads(p.threads)
+    for (int i = 0; i < p.num; i++)
+    {
+        double dx = boids::min_image(cand.x[i] - ref.x[i], p.width);
+        double dy = boids::min_image(cand.y[i] - ref.y[i], p.height);
+        double pos2 = SQR(dx) + SQR(dy);
+        double vel2 = SQR(cand.vx[i] - ref.vx[i]) + SQR(cand.vy[i] - ref.vy[i]);
+        long differ = 0;
+
+        sumPos += pos2;
+        sumVel += vel2;
+        maxPos = MAX(maxPos, pos2);
+        maxVel = MAX(maxVel, vel2);
+
+        if (!neighbors)
+            continue;
+
+        for (int j = 0; j < p.num; j++)
+        {
+            if (j == i)
+                continue;
+
+            float rx = boids::min_image(ref.x[j] - ref.x[i], p.width);
+            float ry = boids::min_image(ref.y[j] - ref.y[i], p.height);
+            float cx = boids::min_image(cand.x[j] - cand.x[i], p.width);
+            float cy = boids::min_image(cand.y[j] - cand.y[i], p.height);
+
+            if ((SQR(rx) + SQR(ry) <= maxr2) != (SQR(cx) + SQR(cy) <= maxr2))
+                differ++;
+        }
+
+        pairs += differ;
+        differing += differ > 0;
+    }
+
+    d.maxPos = sqrt(maxPos);
+    d.rmsPos = sqrt(sumPos / p.num);
+    d.maxVel = sqrt(maxVel);
+    d.rmsVel = sqrt(sumVel / p.num);
+    d.pairs = pairs / 2;    // each pair was seen from both ends
+    d.boids = differing;
+
+    // The positions the step started from are in the back buffers now
+    if (neighbors && cand.b->missed != NULL)
+        d.missed = cand.b->missed(cand.p, cand.w, cand.a[4], cand.a[5]);
+    return d;
+}
+
+int main(int argc, char *argv[])
+{
+    boids::Params p = boids::getDefaultParams();
+    ValidateOptions o;
+    bool noDraw = true;
+
+    o.reference = boids::backend_find("serial");
+    o.tol = 0.01;
+    o.vtol = 0.001;
+    o.gate = 10;
+    o.neighbors = true;
+    o.out = NULL;
+
+    argc = get_validate_arguments(argc, argv, o);
+    get_arguments(argc, argv, p, noDraw);
+
+    Run ref, cand;
+
+    run_init(ref, p, o.reference);
+    run_init(cand, p, p.backend);
+    fprintf(stderr, "Validating %s against %s: %d boids, %d steps, seed %d\n",
+            cand.b->name, ref.b->name, p.num, p.steps, p.seed);
+
+    FILE *f = stdout;
+    if (o.out != NULL && (f = fopen(o.out, "w")) == NULL)
+    {
+        perror(o.out);
+        return 1;
+    }
+
+    bool missed = o.neighbors && cand.b->missed != NULL;
+    fprintf(f, "step\tmaxPos\trmsPos\tmaxVel\trmsVel%s%s\n", o.neighbors ? "\tneighborPairs\tneighborBoids" : "",
+            missed ? "\tmissedPairs" : "");
+
+    int firstPos = -1, firstVel = -1, firstNeighbors = -1, firstMissed = -1;
+    Deviation worst = {0, 0, 0, 0, 0, 0, 0};
+    for (int step = 0; step < p.steps; step++)
+    {
+        run_step(ref);
+        run_step(cand);
+
+        Deviation d = compare(p, ref, cand, o.neighbors);
+
+        fprintf(f, "%d\t%.6g\t%.6g\t%.6g\t%.6g", step, d.maxPos, d.rmsPos, d.maxVel, d.rmsVel);
+        if (o.neighbors)
+            fprintf(f, "\t%ld\t%d", d.pairs, d.boids);
+        if (missed)
+            fprintf(f, "\t%ld", d.missed);
+        fprintf(f, "\n");
+
+        if (firstPos < 0 && d.maxPos > o.tol)
+            firstPos = step;
+        if (firstVel < 0 && d.maxVel > o.vtol)
+            firstVel = step;
+        if (firstNeighbors < 0 && d.pairs > 0)
+            firstNeighbors = step;
+        if (firstMissed < 0 && d.missed > 0)
+            firstMissed = step;
+        worst.maxPos = MAX(worst.maxPos, d.maxPos);
+        worst.maxVel = MAX(worst.maxVel, d.maxVel);
+        worst.pairs = MAX(worst.pairs, d.pairs);
+        worst.missed = MAX(worst.missed, d.missed);
+    }
+
+    if (f != stdout)
+        fclose(f);
+
+    fprintf(stderr, "Largest deviation: position %.3g, velocity %.3g", worst.maxPos, worst.maxVel);
+    if (o.neighbors)
+        fprintf(stderr, ", %ld differing neighbor pairs", worst.pairs);
+    if (missed)
+        fprintf(stderr, ", %ld missed pairs", worst.missed);
+    fprintf(stderr, "\n");
+    if (firstPos >= 0)
+        fprintf(stderr, "Position deviation first exceeded %g at step %d\n", o.tol, firstPos);
+    if (firstVel >= 0)
+        fprintf(stderr, "Velocity deviation first exceeded %g at step %d\n", o.vtol, firstVel);
+    if (firstNeighbors >= 0)
+        fprintf(stderr, "Neighbor sets first differed at step %d\n", firstNeighbors);
+    if (firstMissed >= 0)
+        fprintf(stderr, "%s first missed a pair at step %d\n", cand.b->name, firstMissed);
+
+    // Later deviations are the dynamics amplifying round-off, not the kernel
+    bool early = (firstPos >= 0 && firstPos < o.gate) || (firstVel >= 0 && firstVel < o.gate);
+    if (!early)
+        fprintf(stderr, "Within tolerance for the first %d steps\n", MIN(o.gate, p.steps));
+
+    run_free(ref);
+    run_free(cand);
+    return (early || firstMissed >= 0) ? 1 : 0;
+}
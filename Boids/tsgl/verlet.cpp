@@ -0,0 +1,365 @@
+/*
+    Verlet-list neighbor search for the boids.
+
+    Speeds are bounded by minv and the momentum factor ddt, so a boid's
+    neighbors barely change between steps. Instead of searching for them
+    every step, each boid keeps a list of every boid within maxr + skin.
+    The lists are rebuilt (with the uniform grid) only once the largest
+    displacement since the last build exceeds skin / 2; in between, the
+    heading kernel just walks the list and applies the rules in rules.hpp.
+*/
+
+#include <cmath>
+#include <stdio.h>
+#include <stdlib.h>
+#include <omp.h>
+#include "misc.h"
+#include "boids.hpp"
+#include "rules.hpp"
+#include "grid.hpp"
+#include "verlet.hpp"
+#include "balance.hpp"
+#include "prof.hpp"
+
+
+/**
+ * @brief Allocate the lists and the grid used to build them.
+ *
+ * @param p
+ * @param v
+ */
+void boids::verlet_init(struct boids::Params p, boids::Verlet &v)
+{
+	v.skin = p.skin;
+	boids::grid_init(p, v.grid, rule_consts(p).maxr + v.skin);
+
+	v.start = new int[p.num + 1];
+	v.capacity = 0;
+	v.nbrs = NULL;
+	v.x0 = new float[p.num];
+	v.y0 = new float[p.num];
+	v.valid = false;
+
+	v.builds = 0;
+	v.updates = 0;
+}
+
+/**
+ * @brief Release the memory of lists made by verlet_init.
+ *
+ * @param v
+ */
+void boids::verlet_free(boids::Verlet &v)
+{
+	boids::grid_free(v.grid);
+	delete[] v.start;
+	delete[] v.nbrs;
+	delete[] v.x0;
+	delete[] v.y0;
+	v.start = v.nbrs = NULL;
+	v.x0 = v.y0 = NULL;
+}
+
+/**
+ * @brief Rebuild the candidate lists from scratch for the current positions.
+ *
+ * Counts the candidates of every boid, prefix-sums the counts into start,
+ * then fills nbrs, so each boid's list is contiguous.
+ */
+static void verlet_build(struct boids::Params p, boids::Verlet &v, float *xp, float *yp)
+{
+	boids::Grid &g = v.grid;
+	float reach = boids::rule_consts(p).maxr + v.skin;
+	int spanx = MIN(g.ncx, 3);
+	int spany = MIN(g.ncy, 3);
+
+	boids::grid_build(p, g, xp, yp);
+
+	/* Pass 1 counts into start[which + 1], pass 2 writes from start[which]. */
+	for (int pass = 0; pass < 2; pass++)
+	{
+		#if defined(OMP)
+		#pragma omp parallel for shared(xp, yp, v, g) num_threads(p.threads)
+		#endif
+		for (int which = 0; which < p.num; which++)
+		{
+			int cell = g.boidCell[which];
+			int cx = cell % g.ncx;
+			int cy = cell / g.ncx;
+			int n = 0;
+
+			for (int oy = 0; oy < spany; oy++)
+			{
+				int row = (g.ncy < 3) ? oy : (cy - 1 + oy + g.ncy) % g.ncy;
+
+				for (int ox = 0; ox < spanx; ox++)
+				{
+					int col = (g.ncx < 3) ? ox : (cx - 1 + ox + g.ncx) % g.ncx;
+					int nc = row * g.ncx + col;
+
+					for (int k = g.cellStart[nc]; k < g.cellStart[nc + 1]; k++)
+					{
+						int i = g.cellBoids[k];
+						float dx, dy;
+
+						if (i == which)
+							continue;
+
+						dx = boids::min_image(xp[i] - xp[which], p.width);
+						dy = boids::min_image(yp[i] - yp[which], p.height);
+						if (SQR(dx) + SQR(dy) > SQR(reach))
+							continue;
+
+						if (pass == 1)
+							v.nbrs[v.start[which] + n] = i;
+						n++;
+					}
+				}
+			}
+
+			if (pass == 0)
+				v.start[which + 1] = n;
+		}
+
+		if (pass == 0)
+		{
+			v.start[0] = 0;
+			for (int i = 0; i < p.num; i++)
+				v.start[i + 1] += v.start[i];
+
+			if (v.start[p.num] > v.capacity)
+			{
+				/* Leave some headroom so a slowly densifying flock does not
+				 * reallocate on every build.
+				 */
+				delete[] v.nbrs;
+				v.capacity = v.start[p.num] + v.start[p.num] / 4 + 1;
+				v.nbrs = new int[v.capacity];
+			}
+		}
+	}
+
+	for (int i = 0; i < p.num; i++)
+	{
+		v.x0[i] = xp[i];
+		v.y0[i] = yp[i];
+	}
+
+	v.valid = true;
+	v.builds++;
+	PROF_COUNT(boids::PROF_REBUILDS, 1);
+}
+
+/**
+ * @brief Rebuild the lists if they may have gone stale.
+ *
+ * Must be called whenever positions have changed, before
+ * compute_new_headings_verlet.
+ *
+ * @param p
+ * @param v
+ * @param xp
+ * @param yp
+ * @return true if the lists were rebuilt
+ */
+bool boids::verlet_update(struct boids::Params p, boids::Verlet &v, float *xp, float *yp)
+{
+	float maxd2 = 0;
+
+	v.updates++;
+
+	if (v.valid)
+	{
+		#if defined(OMP)
+		#pragma omp parallel for reduction(max : maxd2) shared(xp, yp, v) num_threads(p.threads)
+		#endif
+		for (int i = 0; i < p.num; i++)
+		{
+			float dx = boids::min_image(xp[i] - v.x0[i], p.width);
+			float dy = boids::min_image(yp[i] - v.y0[i], p.height);
+			maxd2 = MAX(maxd2, SQR(dx) + SQR(dy));
+		}
+
+		if (maxd2 <= SQR(v.skin / 2))
+			return false;
+	}
+
+	verlet_build(p, v, xp, yp);
+	return true;
+}
+
+/**
+ * @brief compute_new_headings_verlet for one rule mask and precision.
+ */
+template <unsigned RULES, typename Real>
+struct VerletKernel
+{
+	/**
+	 * @brief Fused step of boid(which).
+	 *
+	 * @return the length of its candidate list, the work done for this boid
+	 */
+	#if defined(MC) || defined(GPU)
+	#pragma acc routine seq
+	#endif
+	static inline int heading(
+		const boids::Params &p, const boids::RuleConsts &c, const boids::Verlet &v,
+		int which, const int *ids,
+		float *xp, float *yp,
+		float *xv, float *yv,
+		float *xnv, float *ynv,
+		float *xnp, float *ynp)
+	{
+		boids::Accum<Real> a = {0, 0, 0, 0, 0, 0, 0, 0, 0};
+
+		for (int k = v.start[which]; k < v.start[which + 1]; k++)
+		{
+			int i = v.nbrs[k];
+			Real dx, dy, dist;
+
+			dx = boids::min_image(xp[i] - xp[which], p.width);
+			dy = boids::min_image(yp[i] - yp[which], p.height);
+			dist = LEN(dx, dy);
+			if (dist > c.maxr)
+				continue;
+
+			boids::accumulate_pair<RULES, Real>(p, c, a, dx, dy, dist,
+					xv[which], yv[which], xv[i], yv[i]);
+		}
+
+		boids::finish_heading<RULES, Real>(p, a, ids[which], xv[which], yv[which], &xnv[which], &ynv[which]);
+
+		/* With back buffers, also move the boid: one fused pass per step. */
+		if (xnp != NULL)
+			boids::integrate(p, xp[which], yp[which], xnv[which], ynv[which], &xnp[which], &ynp[which]);
+
+		PROF_COUNT(boids::PROF_TESTED, v.start[which + 1] - v.start[which]);
+		return v.start[which + 1] - v.start[which];
+	}
+
+	static void run(
+		struct boids::Params p, boids::Verlet &v, const int *ids,
+		float *xp, float *yp,
+		float *xv, float *yv,
+		float *xnv, float *ynv,
+		float *xnp, float *ynp,
+		boids::Balance *b)
+	{
+		boids::RuleConsts c = boids::rule_consts(p);
+
+		#if defined(OMP)
+		if (b != NULL)
+		{
+			boids::balanced_for(p, *b, [&](int which) {
+				return heading(p, c, v, which, ids, xp, yp, xv, yv, xnv, ynv, xnp, ynp);
+			});
+			return;
+		}
+		#endif
+
+		#if defined(PROFILE)
+		if (boids::prof_trace)
+		{
+			boids::traced_for(p, "share", [&](int which) {
+				heading(p, c, v, which, ids, xp, yp, xv, yv, xnv, ynv, xnp, ynp);
+			});
+			return;
+		}
+		#endif
+
+		#if defined(OMP)
+		#pragma omp parallel for collapse(1) shared(ids, xp, yp, xv, yv, xnv, ynv, xnp, ynp, v) num_threads(p.threads)
+		#elif defined(MC)
+		#pragma acc parallel loop independent collapse(1) num_gangs(p.threads)
+		#elif defined(GPU)
+		#pragma acc kernels loop independent collapse(1)
+		#endif
+		for (int which = 0; which < p.num; which++)
+		{
+			heading(p, c, v, which, ids, xp, yp, xv, yv, xnv, ynv, xnp, ynp);
+		}
+	}
+};
+
+/**
+ * @brief Computes the headings for all boids from their candidate lists.
+ *
+ * Same result as boids::compute_new_headings within float tolerance;
+ * verlet_update must have been called for the current positions.
+ *
+ * @param p
+ * @param v
+ * @param ids stable id of the boid in each slot, keys the wrand noise
+ * @param xp
+ * @param yp
+ * @param xv
+ * @param yv
+ * @param xnv
+ * @param ynv
+ * @param xnp back buffer for the new x positions, or NULL to only compute headings
+ * @param ynp back buffer for the new y positions
+ * @param b split the boids by the cost of the last step, or NULL for equal blocks
+ */
+void boids::compute_new_headings_verlet(
+	struct boids::Params p, boids::Verlet &v, const int *ids,
+	float *xp, float *yp,
+	float *xv, float *yv,
+	float *xnv, float *ynv,
+	float *xnp, float *ynp,
+	boids::Balance *b)
+{
+	boids::select_kernel<VerletKernel>(p)(p, v, ids, xp, yp, xv, yv, xnv, ynv, xnp, ynp, b);
+}
+
+/**
+ * @brief Count the pairs within the largest rule radius that are missing
+ * from the candidate lists compute_new_headings_verlet walked.
+ *
+ * Checks every boid's list against every other boid, so it costs O(num^2)
+ * and is for validation only. Anything but 0 means the lists were stale
+ * (the skin was overrun without a rebuild) or lost neighbors when built.
+ *
+ * @param p
+ * @param v as used for the step
+ * @param xp the positions of that step, in the same slots
+ * @param yp
+ */
+long boids::verlet_missed(struct boids::Params p, const boids::Verlet &v, const float *xp, const float *yp)
+{
+	float maxr = boids::rule_consts(p).maxr;
+	long missed = 0;
+
+	#if defined(OMP)
+	#pragma omp parallel reduction(+:missed) num_threads(p.threads)
+	#endif
+	{
+		// The last boid whose list held each candidate
+		int *seen = new int[p.num];
+		for (int i = 0; i < p.num; i++)
+			seen[i] = -1;
+
+		#if defined(OMP)
+		#pragma omp for schedule(dynamic, 64)
+		#endif
+		for (int which = 0; which < p.num; which++)
+		{
+			for (int k = v.start[which]; k < v.start[which + 1]; k++)
+				seen[v.nbrs[k]] = which;
+
+			for (int i = 0; i < p.num; i++)
+			{
+				if (i == which || seen[i] == which)
+					continue;
+
+				float dx = boids::min_image(xp[i] - xp[which], p.width);
+				float dy = boids::min_image(yp[i] - yp[which], p.height);
+				if (LEN(dx, dy) <= maxr)
+					missed++;
+			}
+		}
+
+		delete[] seen;
+	}
+
+	return missed;
+}
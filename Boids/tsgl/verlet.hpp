@@ -0,0 +1,45 @@
+/*
+    Verlet neighbor lists reused across steps.
+*/
+#ifndef VERLET_HPP
+#define VERLET_HPP
+
+#include "boids.hpp"
+#include "grid.hpp"
+#include "balance.hpp"
+
+namespace boids {
+
+    /**
+     * @brief Candidate neighbor lists within maxr + skin, stored CSR style.
+     *
+     * The candidates of boid i are nbrs[start[i] .. start[i + 1]). The lists
+     * stay valid until some boid has moved more than skin / 2 since they were
+     * built, because no pair can close a gap of skin before then.
+     */
+    struct Verlet
+    {
+        float skin;
+        Grid grid;        // cells at least maxr + skin wide, used to build
+        int *start;       // p.num + 1 offsets into nbrs
+        int *nbrs;        // candidate indices for all boids
+        int capacity;     // allocated length of nbrs
+        float *x0, *y0;   // positions when the lists were last built
+        bool valid;       // false forces a rebuild on the next update
+
+        int builds;       // number of times the lists were built
+        int updates;      // number of calls to verlet_update
+    };
+
+    void verlet_init(struct Params p, Verlet &v);
+
+    void verlet_free(Verlet &v);
+
+    bool verlet_update(struct Params p, Verlet &v, float *xp, float *yp);
+
+    long verlet_missed(struct Params p, const Verlet &v, const float *xp, const float *yp);
+
+    void compute_new_headings_verlet(struct Params p, Verlet &v, const int* ids, float* xp, float* yp, float* xv, float* yv, float* xnv, float* ynv, float* xnp = NULL, float* ynp = NULL, Balance* b = NULL);
+
+}
+#endif